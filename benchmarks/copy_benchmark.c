@@ -0,0 +1,431 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Times the shm copy kernels that sommelier uses to forward client buffers
+// to the host, and the dmabuf sync ioctls that bracket every copy when the
+// devices for them are present.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gbm.h>
+#include <libdrm/drm_fourcc.h>
+#include <linux/virtwl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_SMALL_RECTS 64
+
+struct bench_format {
+  const char* name;
+  uint32_t format;
+};
+
+struct bench_damage {
+  const char* name;
+  pixman_box32_t rects[NUM_SMALL_RECTS];
+  int num_rects;
+};
+
+static const struct bench_format bench_formats[] = {
+    {"argb8888", WL_SHM_FORMAT_ARGB8888}, {"xrgb8888", WL_SHM_FORMAT_XRGB8888},
+    {"abgr8888", WL_SHM_FORMAT_ABGR8888}, {"xbgr8888", WL_SHM_FORMAT_XBGR8888},
+    {"rgb565", WL_SHM_FORMAT_RGB565},     {"nv12", WL_SHM_FORMAT_NV12},
+};
+
+// Minimum time spent on each case. Cases are repeated until it is reached.
+static uint64_t bench_min_usec = 200000;
+
+static uint64_t bench_now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static const char* bench_arg_value(const char* arg) {
+  const char* s = strchr(arg, '=');
+  if (!s) {
+    fprintf(stderr, "error: missing value for %s\n", arg);
+    exit(EXIT_FAILURE);
+  }
+  return s + 1;
+}
+
+static size_t bench_align(size_t value, size_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Initializes |map| to describe a heap allocation for a |width| x |height|
+// buffer of |format| with rows aligned to |alignment| bytes. The layout
+// matches what sl_mmap_create() produces for shm buffers.
+static void bench_mmap_init(struct sl_mmap* map,
+                            uint32_t format,
+                            uint32_t width,
+                            uint32_t height,
+                            size_t alignment) {
+  size_t i;
+  void* addr;
+  int rv;
+
+  memset(map, 0, sizeof(*map));
+  map->refcount = 1;
+  map->fd = -1;
+  map->bpp = sl_shm_bpp_for_shm_format(format);
+  map->num_planes = sl_shm_num_planes_for_shm_format(format);
+  for (i = 0; i < map->num_planes; ++i) {
+    map->y_ss[i] = format == WL_SHM_FORMAT_NV12 && i ? 2 : 1;
+    map->stride[i] = bench_align(width * map->bpp, alignment);
+    map->offset[i] = map->size;
+    map->size += map->stride[i] * height / map->y_ss[i];
+  }
+
+  rv = posix_memalign(&addr, 4096, map->size);
+  assert(!rv);
+  UNUSED(rv);
+  memset(addr, 0x55, map->size);
+  map->addr = addr;
+}
+
+// Fills |damage| with the region shapes that are benchmarked: a full frame,
+// a scrolling band, a blinking caret, a large rect that doesn't span full
+// rows and many tiny rects.
+static int bench_damage_init(struct bench_damage* damage,
+                             int32_t width,
+                             int32_t height) {
+  int i;
+
+  damage[0].name = "full";
+  damage[0].rects[0] = (pixman_box32_t){0, 0, width, height};
+  damage[0].num_rects = 1;
+
+  damage[1].name = "band";
+  damage[1].rects[0] =
+      (pixman_box32_t){0, height / 4, width, height / 4 + height / 4};
+  damage[1].num_rects = 1;
+
+  damage[2].name = "caret";
+  damage[2].rects[0] = (pixman_box32_t){width / 2, height / 2,
+                                        MIN(width, width / 2 + 2),
+                                        MIN(height, height / 2 + 16)};
+  damage[2].num_rects = 1;
+
+  damage[3].name = "window";
+  damage[3].rects[0] = (pixman_box32_t){width / 4, height / 4,
+                                        width / 4 + width / 2,
+                                        height / 4 + height / 2};
+  damage[3].num_rects = 1;
+
+  damage[4].name = "rects";
+  for (i = 0; i < NUM_SMALL_RECTS; ++i) {
+    int32_t x = (i * 7919) % MAX(width - 8, 1) & ~1;
+    int32_t y = (i * 104729) % MAX(height - 8, 1) & ~1;
+
+    damage[4].rects[i] =
+        (pixman_box32_t){x, y, MIN(width, x + 8), MIN(height, y + 8)};
+  }
+  damage[4].num_rects = NUM_SMALL_RECTS;
+
+  return 5;
+}
+
+static size_t bench_damage_size(struct bench_damage* damage,
+                                struct sl_mmap* map) {
+  size_t size = 0;
+  int i;
+
+  for (i = 0; i < damage->num_rects; ++i) {
+    pixman_box32_t* rect = &damage->rects[i];
+    size_t area = (size_t)(rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+
+    // Chroma planes are the same size as the luma plane but with half the
+    // rows for the formats supported here.
+    size += area * map->bpp + (map->num_planes > 1 ? area / 2 : 0);
+  }
+  return size;
+}
+
+// Copies |damage| from |src| to |target| until the minimum time has passed,
+// bracketing each frame with the begin and end write functions of the
+// target mapping. Prints the time per frame and the copy bandwidth.
+static void bench_copy(const char* format,
+                       const char* layout,
+                       const char* kernel,
+                       struct sl_copy_target* target,
+                       struct sl_mmap* src,
+                       sl_copy_rect_func_t copy_rect,
+                       struct bench_damage* damage) {
+  struct sl_mmap* dst = target->mmap;
+  uint64_t start_usec = bench_now_usec();
+  uint64_t elapsed_usec;
+  uint64_t frames = 0;
+  double usec_per_frame;
+  int i;
+
+  do {
+    if (dst->begin_write)
+      dst->begin_write(dst->fd);
+    for (i = 0; i < damage->num_rects; ++i) {
+      pixman_box32_t* rect = &damage->rects[i];
+
+      copy_rect(target, src, rect->x1, rect->y1, rect->x2, rect->y2);
+    }
+    if (dst->end_write)
+      dst->end_write(dst->fd);
+    ++frames;
+    elapsed_usec = bench_now_usec() - start_usec;
+  } while (elapsed_usec < bench_min_usec);
+
+  usec_per_frame = (double)elapsed_usec / frames;
+  printf("%-10s %-8s %-8s %-8s %12.2f %10.2f\n", format, layout, damage->name,
+         kernel, usec_per_frame,
+         bench_damage_size(damage, src) / usec_per_frame);
+}
+
+// Times the copy of every damage shape from a |src_alignment| aligned source
+// to a |dst_alignment| aligned destination, with both the streaming and the
+// plain memcpy plane copies.
+static void bench_format_layout(const struct bench_format* format,
+                                const char* layout,
+                                uint32_t width,
+                                uint32_t height,
+                                size_t src_alignment,
+                                size_t dst_alignment) {
+  struct bench_damage damage[5];
+  struct sl_copy_target target;
+  struct sl_mmap src, dst, half;
+  sl_copy_rect_func_t copy_rect, downscale_rect;
+  int i, num_damage;
+
+  bench_mmap_init(&src, format->format, width, height, src_alignment);
+  bench_mmap_init(&dst, format->format, width, height, dst_alignment);
+  copy_rect = sl_copy_rect_func_for_shm_format(format->format, &dst);
+  num_damage = bench_damage_init(damage, width, height);
+
+  target.mmap = &dst;
+  target.width = width;
+  for (i = 0; i < num_damage; ++i) {
+    target.stream_plane = sl_stream_copy_plane_func();
+    bench_copy(format->name, layout, "stream", &target, &src, copy_rect,
+               &damage[i]);
+    target.stream_plane = NULL;
+    bench_copy(format->name, layout, "memcpy", &target, &src, copy_rect,
+               &damage[i]);
+  }
+
+  // Copies into half resolution buffers for --low-resolution windows.
+  downscale_rect = sl_downscale_rect_func_for_shm_format(format->format);
+  if (downscale_rect) {
+    bench_mmap_init(&half, format->format, (width + 1) / 2, (height + 1) / 2,
+                    dst_alignment);
+    target.mmap = &half;
+    target.width = (width + 1) / 2;
+    target.src_width = width;
+    target.src_height = height;
+    target.stream_plane = NULL;
+    for (i = 0; i < num_damage; ++i) {
+      bench_copy(format->name, layout, "half", &target, &src, downscale_rect,
+                 &damage[i]);
+    }
+    free(half.addr);
+  }
+
+  free(src.addr);
+  free(dst.addr);
+}
+
+// Times the sync ioctls of |fd| on their own and then with a full frame
+// copy into its mapping in between, which is what a commit does.
+static void bench_sync(const char* name,
+                       int fd,
+                       size_t offset,
+                       size_t stride,
+                       uint32_t width,
+                       uint32_t height,
+                       sl_begin_end_access_func_t begin_write,
+                       sl_begin_end_access_func_t end_write) {
+  struct bench_damage damage[5];
+  struct sl_copy_target target;
+  struct sl_mmap src, dst;
+  sl_copy_rect_func_t copy_rect;
+  uint64_t start_usec = bench_now_usec();
+  uint64_t elapsed_usec;
+  uint64_t syncs = 0;
+
+  do {
+    begin_write(fd);
+    end_write(fd);
+    ++syncs;
+    elapsed_usec = bench_now_usec() - start_usec;
+  } while (elapsed_usec < bench_min_usec);
+  printf("%-10s %-8s %-8s %-8s %12.2f\n", name, "-", "none", "sync",
+         (double)elapsed_usec / syncs);
+
+  bench_mmap_init(&src, WL_SHM_FORMAT_XRGB8888, width, height, 64);
+  memset(&dst, 0, sizeof(dst));
+  dst.refcount = 1;
+  dst.fd = fd;
+  dst.bpp = 4;
+  dst.num_planes = 1;
+  dst.offset[0] = offset;
+  dst.stride[0] = stride;
+  dst.y_ss[0] = 1;
+  dst.size = stride * height;
+  dst.begin_write = begin_write;
+  dst.end_write = end_write;
+  dst.addr =
+      mmap(NULL, dst.size + offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (dst.addr == MAP_FAILED) {
+    fprintf(stderr, "error: failed to map %s buffer: %s\n", name,
+            strerror(errno));
+    free(src.addr);
+    return;
+  }
+
+  copy_rect = sl_copy_rect_func_for_shm_format(WL_SHM_FORMAT_XRGB8888, &dst);
+  bench_damage_init(damage, width, height);
+  target.mmap = &dst;
+  target.width = width;
+  target.stream_plane = sl_stream_copy_plane_func();
+  bench_copy(name, "device", "stream", &target, &src, copy_rect, &damage[0]);
+  target.stream_plane = NULL;
+  bench_copy(name, "device", "memcpy", &target, &src, copy_rect, &damage[0]);
+
+  munmap(dst.addr, dst.size + offset);
+  free(src.addr);
+}
+
+static void bench_dmabuf(const char* device, uint32_t width, uint32_t height) {
+  struct gbm_device* gbm;
+  struct gbm_bo* bo;
+  int drm_fd, fd;
+
+  drm_fd = open(device, O_RDWR | O_CLOEXEC);
+  if (drm_fd < 0) {
+    printf("# skipping dmabuf: could not open %s (%s)\n", device,
+           strerror(errno));
+    return;
+  }
+
+  gbm = gbm_create_device(drm_fd);
+  bo = gbm ? gbm_bo_create(gbm, width, height, GBM_FORMAT_XRGB8888,
+                           GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR)
+           : NULL;
+  if (!bo) {
+    printf("# skipping dmabuf: buffer allocation failed on %s\n", device);
+  } else {
+    fd = gbm_bo_get_fd(bo);
+    bench_sync("dmabuf", fd, 0, gbm_bo_get_stride(bo), width, height,
+               sl_dmabuf_begin_write, sl_dmabuf_end_write);
+    close(fd);
+    gbm_bo_destroy(bo);
+  }
+  if (gbm)
+    gbm_device_destroy(gbm);
+  close(drm_fd);
+}
+
+static void bench_virtwl(const char* device, uint32_t width, uint32_t height) {
+  struct virtwl_ioctl_new ioctl_new = {
+      .type = VIRTWL_IOCTL_NEW_DMABUF,
+      .fd = -1,
+      .flags = 0,
+      .dmabuf = {.width = width,
+                 .height = height,
+                 .format = DRM_FORMAT_XRGB8888}};
+  int virtwl_fd, rv;
+
+  virtwl_fd = open(device, O_RDWR | O_CLOEXEC);
+  if (virtwl_fd < 0) {
+    printf("# skipping virtwl: could not open %s (%s)\n", device,
+           strerror(errno));
+    return;
+  }
+
+  rv = ioctl(virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+  if (rv) {
+    printf("# skipping virtwl: dmabuf allocation failed (%s)\n",
+           strerror(errno));
+  } else {
+    bench_sync("virtwl", ioctl_new.fd, ioctl_new.dmabuf.offset0,
+               ioctl_new.dmabuf.stride0, width, height,
+               sl_virtwl_dmabuf_begin_write, sl_virtwl_dmabuf_end_write);
+    close(ioctl_new.fd);
+  }
+  close(virtwl_fd);
+}
+
+static void bench_usage(const char* name) {
+  printf(
+      "usage: %s [options]\n\n"
+      "options:\n"
+      "  -h, --help\t\t\tPrint this help\n"
+      "  --width=WIDTH\t\t\tBuffer width (default 1920)\n"
+      "  --height=HEIGHT\t\tBuffer height (default 1080)\n"
+      "  --min-time=MS\t\t\tMinimum time spent on each case\n"
+      "  --drm-device=DEVICE\t\tDRM device for dmabuf sync timing\n"
+      "  --virtwl-device=DEVICE\tVirtWL device for virtwl sync timing\n",
+      name);
+}
+
+int main(int argc, char** argv) {
+  const char* drm_device = "/dev/dri/renderD128";
+  const char* virtwl_device = "/dev/wl0";
+  uint32_t width = 1920;
+  uint32_t height = 1080;
+  size_t i;
+  int arg;
+
+  for (arg = 1; arg < argc; ++arg) {
+    const char* s = argv[arg];
+
+    if (strcmp(s, "--help") == 0 || strcmp(s, "-h") == 0) {
+      bench_usage(argv[0]);
+      return EXIT_SUCCESS;
+    } else if (strstr(s, "--width") == s) {
+      width = atoi(bench_arg_value(s));
+    } else if (strstr(s, "--height") == s) {
+      height = atoi(bench_arg_value(s));
+    } else if (strstr(s, "--min-time") == s) {
+      bench_min_usec = atoi(bench_arg_value(s)) * 1000ull;
+    } else if (strstr(s, "--drm-device") == s) {
+      drm_device = bench_arg_value(s);
+    } else if (strstr(s, "--virtwl-device") == s) {
+      virtwl_device = bench_arg_value(s);
+    } else {
+      fprintf(stderr, "error: unknown option: %s\n", s);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (width < 16 || height < 16) {
+    fprintf(stderr, "error: buffer must be at least 16x16\n");
+    return EXIT_FAILURE;
+  }
+  // Chroma planes of subsampled formats need whole samples.
+  width &= ~1;
+  height &= ~1;
+
+  printf("%-10s %-8s %-8s %-8s %12s %10s\n", "format", "layout", "damage",
+         "kernel", "usec/frame", "MB/s");
+  for (i = 0; i < ARRAY_SIZE(bench_formats); ++i) {
+    // Clients with tightly packed rows copied to a buffer with the same
+    // layout, as with the virtwl driver, and typical client and GPU row
+    // alignments, as with the dmabuf drivers.
+    bench_format_layout(&bench_formats[i], "packed", width, height, 4, 4);
+    bench_format_layout(&bench_formats[i], "padded", width, height, 64, 256);
+  }
+
+  bench_dmabuf(drm_device, width, height);
+  bench_virtwl(virtwl_device, width, height);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,157 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_DEMOS_BENCHMARK_COMMON_H_
+#define VM_TOOLS_SOMMELIER_DEMOS_BENCHMARK_COMMON_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Every benchmark frame damages the first pixel and stores a timestamp in
+// it. The benchmark host decodes the timestamp when the frame arrives to
+// measure commit latency without a side channel between the processes.
+// 32 bpp formats store the low 32 bits of the time in microseconds and 16
+// bpp formats store it in units of 16 microseconds.
+
+enum BenchmarkDamage {
+  kDamageFull,
+  kDamageScroll,
+  kDamageCaret,
+  kDamageRects,
+};
+
+struct BenchmarkRect {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
+inline uint64_t BenchmarkNowUsec() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+inline bool BenchmarkParseDamage(const std::string& name,
+                                 BenchmarkDamage* damage) {
+  if (name == "full") {
+    *damage = kDamageFull;
+  } else if (name == "scroll") {
+    *damage = kDamageScroll;
+  } else if (name == "caret") {
+    *damage = kDamageCaret;
+  } else if (name == "rects") {
+    *damage = kDamageRects;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Returns the rectangles that frame |frame| of a |width| x |height| surface
+// updates for |damage|. The first rectangle always covers the timestamp
+// pixel.
+inline std::vector<BenchmarkRect> BenchmarkDamageRects(BenchmarkDamage damage,
+                                                       int32_t width,
+                                                       int32_t height,
+                                                       uint32_t frame) {
+  std::vector<BenchmarkRect> rects = {{0, 0, 1, 1}};
+
+  switch (damage) {
+    case kDamageFull:
+      rects[0] = {0, 0, width, height};
+      break;
+    case kDamageScroll: {
+      // A band a quarter of the height tall that moves 8 rows per frame.
+      int32_t band_height = height / 4 ? height / 4 : 1;
+      int32_t y = (frame * 8) % height;
+
+      rects.push_back({0, y, width, std::min(band_height, height - y)});
+    } break;
+    case kDamageCaret: {
+      // A 2x16 caret in the middle of the surface.
+      int32_t x = width / 2;
+      int32_t y = height / 2;
+
+      rects.push_back(
+          {x, y, std::min(2, width - x), std::min(16, height - y)});
+    } break;
+    case kDamageRects: {
+      // 64 8x8 rectangles at pseudo random positions.
+      uint32_t seed = frame * 2654435761u;
+      int i;
+
+      for (i = 0; i < 64; ++i) {
+        seed = seed * 1103515245u + 12345u;
+        int32_t x = (seed >> 8) % width;
+        seed = seed * 1103515245u + 12345u;
+        int32_t y = (seed >> 8) % height;
+
+        rects.push_back(
+            {x, y, std::min(8, width - x), std::min(8, height - y)});
+      }
+    } break;
+  }
+  return rects;
+}
+
+// Fills |rect| of a buffer with a color derived from |frame|.
+inline void BenchmarkFillRect(uint8_t* data,
+                              int32_t stride,
+                              int32_t bpp,
+                              const BenchmarkRect& rect,
+                              uint32_t frame) {
+  uint32_t color = 0xff000000 | (frame * 0x010305);
+  int32_t x, y;
+
+  for (y = rect.y; y < rect.y + rect.height; ++y) {
+    uint8_t* row = data + y * stride + rect.x * bpp;
+
+    if (bpp == 4) {
+      uint32_t* pixels = reinterpret_cast<uint32_t*>(row);
+      for (x = 0; x < rect.width; ++x)
+        pixels[x] = color;
+    } else {
+      uint16_t* pixels = reinterpret_cast<uint16_t*>(row);
+      for (x = 0; x < rect.width; ++x)
+        pixels[x] = color;
+    }
+  }
+}
+
+inline void BenchmarkStamp(uint8_t* data, int32_t bpp) {
+  uint64_t now = BenchmarkNowUsec();
+
+  if (bpp == 4) {
+    uint32_t stamp = now;
+    memcpy(data, &stamp, sizeof(stamp));
+  } else {
+    uint16_t stamp = now >> 4;
+    memcpy(data, &stamp, sizeof(stamp));
+  }
+}
+
+// Returns the time in microseconds since the stamp in |data| was written.
+inline uint64_t BenchmarkStampAge(const uint8_t* data, int32_t bpp) {
+  uint64_t now = BenchmarkNowUsec();
+
+  if (bpp == 4) {
+    uint32_t stamp;
+    memcpy(&stamp, data, sizeof(stamp));
+    return static_cast<uint32_t>(now - stamp);
+  }
+
+  uint16_t stamp;
+  memcpy(&stamp, data, sizeof(stamp));
+  return static_cast<uint64_t>(static_cast<uint16_t>((now >> 4) - stamp)) << 4;
+}
+
+#endif  // VM_TOOLS_SOMMELIER_DEMOS_BENCHMARK_COMMON_H_
@@ -0,0 +1,895 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <drm_fourcc.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/strings/string_number_conversions.h"
+#include "brillo/syslog_logging.h"
+#include "demos/benchmark_common.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"  // NOLINT(build/include)
+#include "xdg-shell-server-protocol.h"                 // NOLINT(build/include)
+
+constexpr char kSocketFlag[] = "socket";
+constexpr char kWidthFlag[] = "width";
+constexpr char kHeightFlag[] = "height";
+constexpr char kRefreshFlag[] = "refresh";
+constexpr char kReleaseLatencyFlag[] = "release-latency";
+constexpr char kDurationFlag[] = "duration";
+
+// Minimal host compositor for benchmarking sommelier without a real
+// display. Buffers are never composited. Frame callbacks complete at the
+// refresh rate, replaced buffers are released after a configurable delay
+// and the latency from client commit to host commit is recorded from the
+// timestamp that benchmark clients store in the first pixel of each frame.
+
+struct host_data {
+  struct wl_display* display;
+  struct wl_event_loop* loop;
+  uint32_t width;
+  uint32_t height;
+  uint32_t refresh;
+  uint32_t release_latency;
+  struct wl_list frame_callbacks;
+  struct wl_event_source* refresh_timer;
+  uint32_t frames;
+  uint64_t first_frame_usec;
+  uint64_t last_frame_usec;
+  std::vector<uint64_t> latencies;
+};
+
+struct host_dmabuf_buffer {
+  struct wl_resource* resource;
+  int fd;
+  uint32_t offset;
+  uint32_t stride;
+  uint32_t format;
+  uint8_t* data;
+  size_t size;
+};
+
+struct host_dmabuf_params {
+  int fd;
+  uint32_t offset;
+  uint32_t stride;
+};
+
+struct host_buffer_ref {
+  struct wl_resource* buffer;
+  struct wl_listener destroy_listener;
+};
+
+struct host_release {
+  struct host_buffer_ref ref;
+  struct wl_event_source* timer;
+};
+
+struct host_surface {
+  struct host_data* host;
+  struct host_buffer_ref pending_buffer;
+  bool pending_attach;
+  struct wl_list pending_frame_callbacks;
+  struct host_buffer_ref current_buffer;
+};
+
+static void host_buffer_ref_destroyed(struct wl_listener* listener,
+                                      void* data) {
+  struct host_buffer_ref* ref =
+      wl_container_of(listener, ref, destroy_listener);
+  ref->buffer = nullptr;
+  wl_list_remove(&ref->destroy_listener.link);
+  wl_list_init(&ref->destroy_listener.link);
+}
+
+static void host_buffer_ref_init(struct host_buffer_ref* ref) {
+  ref->buffer = nullptr;
+  ref->destroy_listener.notify = host_buffer_ref_destroyed;
+  wl_list_init(&ref->destroy_listener.link);
+}
+
+static void host_buffer_ref_set(struct host_buffer_ref* ref,
+                                struct wl_resource* buffer) {
+  wl_list_remove(&ref->destroy_listener.link);
+  wl_list_init(&ref->destroy_listener.link);
+  ref->buffer = buffer;
+  if (buffer)
+    wl_resource_add_destroy_listener(buffer, &ref->destroy_listener);
+}
+
+static void host_destroy(struct wl_client* client,
+                         struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void host_release_buffer(struct host_release* release) {
+  if (release->ref.buffer)
+    wl_buffer_send_release(release->ref.buffer);
+  host_buffer_ref_set(&release->ref, nullptr);
+  if (release->timer)
+    wl_event_source_remove(release->timer);
+  delete release;
+}
+
+static int host_handle_release_timer(void* data) {
+  host_release_buffer(static_cast<struct host_release*>(data));
+  return 0;
+}
+
+// Releases |buffer| after the configured release latency.
+static void host_schedule_release(struct host_data* host,
+                                  struct wl_resource* buffer) {
+  struct host_release* release = new host_release;
+
+  host_buffer_ref_init(&release->ref);
+  host_buffer_ref_set(&release->ref, buffer);
+  release->timer = nullptr;
+  if (!host->release_latency) {
+    host_release_buffer(release);
+    return;
+  }
+
+  release->timer = wl_event_loop_add_timer(host->loop,
+                                           host_handle_release_timer, release);
+  wl_event_source_timer_update(release->timer, host->release_latency);
+}
+
+static void host_dmabuf_buffer_destroy(struct wl_resource* resource) {
+  struct host_dmabuf_buffer* buffer = static_cast<struct host_dmabuf_buffer*>(
+      wl_resource_get_user_data(resource));
+
+  if (buffer->data)
+    munmap(buffer->data, buffer->size);
+  close(buffer->fd);
+  delete buffer;
+}
+
+static const struct wl_buffer_interface host_dmabuf_buffer_implementation = {
+    host_destroy};
+
+// Records the latency of the frame in |buffer| from its timestamp.
+static void host_record_frame(struct host_data* host,
+                              struct wl_resource* buffer) {
+  struct wl_shm_buffer* shm_buffer = wl_shm_buffer_get(buffer);
+  uint64_t now_usec = BenchmarkNowUsec();
+
+  if (shm_buffer) {
+    int32_t bpp =
+        wl_shm_buffer_get_format(shm_buffer) == WL_SHM_FORMAT_RGB565 ? 2 : 4;
+
+    wl_shm_buffer_begin_access(shm_buffer);
+    host->latencies.push_back(BenchmarkStampAge(
+        static_cast<uint8_t*>(wl_shm_buffer_get_data(shm_buffer)), bpp));
+    wl_shm_buffer_end_access(shm_buffer);
+  } else if (wl_resource_instance_of(buffer, &wl_buffer_interface,
+                                     &host_dmabuf_buffer_implementation)) {
+    struct host_dmabuf_buffer* dmabuf_buffer =
+        static_cast<struct host_dmabuf_buffer*>(
+            wl_resource_get_user_data(buffer));
+    int32_t bpp = dmabuf_buffer->format == DRM_FORMAT_RGB565 ? 2 : 4;
+
+    if (dmabuf_buffer->data) {
+      host->latencies.push_back(BenchmarkStampAge(
+          dmabuf_buffer->data + dmabuf_buffer->offset, bpp));
+    }
+  }
+
+  if (!host->frames++)
+    host->first_frame_usec = now_usec;
+  host->last_frame_usec = now_usec;
+}
+
+static void host_frame_callback_destroy(struct wl_resource* resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+static int host_handle_refresh_timer(void* data) {
+  struct host_data* host = static_cast<struct host_data*>(data);
+  struct wl_resource *resource, *next;
+  uint32_t time = BenchmarkNowUsec() / 1000;
+
+  wl_resource_for_each_safe(resource, next, &host->frame_callbacks) {
+    wl_callback_send_done(resource, time);
+    wl_resource_destroy(resource);
+  }
+
+  wl_event_source_timer_update(host->refresh_timer, 1000 / host->refresh);
+  return 0;
+}
+
+static void host_surface_attach(struct wl_client* client,
+                                struct wl_resource* resource,
+                                struct wl_resource* buffer,
+                                int32_t x,
+                                int32_t y) {
+  struct host_surface* surface =
+      static_cast<struct host_surface*>(wl_resource_get_user_data(resource));
+
+  host_buffer_ref_set(&surface->pending_buffer, buffer);
+  surface->pending_attach = true;
+}
+
+static void host_surface_damage(struct wl_client* client,
+                                struct wl_resource* resource,
+                                int32_t x,
+                                int32_t y,
+                                int32_t width,
+                                int32_t height) {}
+
+static void host_surface_frame(struct wl_client* client,
+                               struct wl_resource* resource,
+                               uint32_t callback) {
+  struct host_surface* surface =
+      static_cast<struct host_surface*>(wl_resource_get_user_data(resource));
+  struct wl_resource* callback_resource =
+      wl_resource_create(client, &wl_callback_interface, 1, callback);
+
+  wl_resource_set_implementation(callback_resource, nullptr, nullptr,
+                                 host_frame_callback_destroy);
+  wl_list_insert(surface->pending_frame_callbacks.prev,
+                 wl_resource_get_link(callback_resource));
+}
+
+static void host_surface_set_region(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    struct wl_resource* region) {}
+
+static void host_surface_commit(struct wl_client* client,
+                                struct wl_resource* resource) {
+  struct host_surface* surface =
+      static_cast<struct host_surface*>(wl_resource_get_user_data(resource));
+  struct host_data* host = surface->host;
+
+  if (surface->pending_attach) {
+    struct wl_resource* buffer = surface->pending_buffer.buffer;
+
+    // The timestamp is current in every new frame, whatever the damage
+    // that sommelier forwards for it covers.
+    if (buffer)
+      host_record_frame(host, buffer);
+    if (surface->current_buffer.buffer &&
+        surface->current_buffer.buffer != buffer) {
+      host_schedule_release(host, surface->current_buffer.buffer);
+    }
+    host_buffer_ref_set(&surface->current_buffer, buffer);
+    host_buffer_ref_set(&surface->pending_buffer, nullptr);
+  }
+  surface->pending_attach = false;
+
+  wl_list_insert_list(host->frame_callbacks.prev,
+                      &surface->pending_frame_callbacks);
+  wl_list_init(&surface->pending_frame_callbacks);
+}
+
+static void host_surface_set_buffer_transform(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              int32_t transform) {}
+
+static void host_surface_set_buffer_scale(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          int32_t scale) {}
+
+static const struct wl_surface_interface host_surface_implementation = {
+    host_destroy,
+    host_surface_attach,
+    host_surface_damage,
+    host_surface_frame,
+    host_surface_set_region,
+    host_surface_set_region,
+    host_surface_commit,
+    host_surface_set_buffer_transform,
+    host_surface_set_buffer_scale,
+    host_surface_damage};
+
+static void host_surface_destroy(struct wl_resource* resource) {
+  struct host_surface* surface =
+      static_cast<struct host_surface*>(wl_resource_get_user_data(resource));
+  struct wl_resource *callback, *next;
+
+  if (surface->current_buffer.buffer)
+    host_schedule_release(surface->host, surface->current_buffer.buffer);
+  host_buffer_ref_set(&surface->current_buffer, nullptr);
+  host_buffer_ref_set(&surface->pending_buffer, nullptr);
+  wl_resource_for_each_safe(callback, next,
+                            &surface->pending_frame_callbacks) {
+    wl_list_remove(wl_resource_get_link(callback));
+    wl_list_init(wl_resource_get_link(callback));
+  }
+  delete surface;
+}
+
+static void host_region_update(struct wl_client* client,
+                               struct wl_resource* resource,
+                               int32_t x,
+                               int32_t y,
+                               int32_t width,
+                               int32_t height) {}
+
+static const struct wl_region_interface host_region_implementation = {
+    host_destroy, host_region_update, host_region_update};
+
+static void host_compositor_create_surface(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t id) {
+  struct host_surface* surface = new host_surface;
+  struct wl_resource* surface_resource = wl_resource_create(
+      client, &wl_surface_interface, wl_resource_get_version(resource), id);
+
+  surface->host =
+      static_cast<struct host_data*>(wl_resource_get_user_data(resource));
+  host_buffer_ref_init(&surface->pending_buffer);
+  host_buffer_ref_init(&surface->current_buffer);
+  surface->pending_attach = false;
+  wl_list_init(&surface->pending_frame_callbacks);
+  wl_resource_set_implementation(surface_resource,
+                                 &host_surface_implementation, surface,
+                                 host_surface_destroy);
+}
+
+static void host_compositor_create_region(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t id) {
+  struct wl_resource* region_resource =
+      wl_resource_create(client, &wl_region_interface, 1, id);
+
+  wl_resource_set_implementation(region_resource, &host_region_implementation,
+                                 nullptr, nullptr);
+}
+
+static const struct wl_compositor_interface host_compositor_implementation = {
+    host_compositor_create_surface, host_compositor_create_region};
+
+static void host_bind_compositor(struct wl_client* client,
+                                 void* data,
+                                 uint32_t version,
+                                 uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_compositor_interface, version, id);
+
+  wl_resource_set_implementation(resource, &host_compositor_implementation,
+                                 data, nullptr);
+}
+
+static void host_bind_output(struct wl_client* client,
+                             void* data,
+                             uint32_t version,
+                             uint32_t id) {
+  struct host_data* host = static_cast<struct host_data*>(data);
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_output_interface, version, id);
+
+  wl_resource_set_implementation(resource, nullptr, nullptr, nullptr);
+  wl_output_send_geometry(resource, 0, 0, host->width * 254 / 960,
+                          host->height * 254 / 960,
+                          WL_OUTPUT_SUBPIXEL_UNKNOWN, "sommelier",
+                          "benchmark", WL_OUTPUT_TRANSFORM_NORMAL);
+  wl_output_send_mode(resource,
+                      WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+                      host->width, host->height, host->refresh * 1000);
+  if (version >= WL_OUTPUT_SCALE_SINCE_VERSION)
+    wl_output_send_scale(resource, 1);
+  if (version >= WL_OUTPUT_DONE_SINCE_VERSION)
+    wl_output_send_done(resource);
+}
+
+static void host_shell_surface_pong(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    uint32_t serial) {}
+
+static void host_shell_surface_move(struct wl_client* client,
+                                    struct wl_resource* resource,
+                                    struct wl_resource* seat,
+                                    uint32_t serial) {}
+
+static void host_shell_surface_resize(struct wl_client* client,
+                                      struct wl_resource* resource,
+                                      struct wl_resource* seat,
+                                      uint32_t serial,
+                                      uint32_t edges) {}
+
+static void host_shell_surface_set_toplevel(struct wl_client* client,
+                                            struct wl_resource* resource) {}
+
+static void host_shell_surface_set_transient(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             struct wl_resource* parent,
+                                             int32_t x,
+                                             int32_t y,
+                                             uint32_t flags) {}
+
+static void host_shell_surface_set_fullscreen(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              uint32_t method,
+                                              uint32_t framerate,
+                                              struct wl_resource* output) {}
+
+static void host_shell_surface_set_popup(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         struct wl_resource* seat,
+                                         uint32_t serial,
+                                         struct wl_resource* parent,
+                                         int32_t x,
+                                         int32_t y,
+                                         uint32_t flags) {}
+
+static void host_shell_surface_set_maximized(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             struct wl_resource* output) {}
+
+static void host_set_string(struct wl_client* client,
+                            struct wl_resource* resource,
+                            const char* value) {}
+
+static const struct wl_shell_surface_interface
+    host_shell_surface_implementation = {
+        host_shell_surface_pong,          host_shell_surface_move,
+        host_shell_surface_resize,        host_shell_surface_set_toplevel,
+        host_shell_surface_set_transient, host_shell_surface_set_fullscreen,
+        host_shell_surface_set_popup,     host_shell_surface_set_maximized,
+        host_set_string,                  host_set_string};
+
+static void host_shell_get_shell_surface(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         uint32_t id,
+                                         struct wl_resource* surface) {
+  struct wl_resource* shell_surface_resource =
+      wl_resource_create(client, &wl_shell_surface_interface, 1, id);
+
+  wl_resource_set_implementation(shell_surface_resource,
+                                 &host_shell_surface_implementation, nullptr,
+                                 nullptr);
+}
+
+static const struct wl_shell_interface host_shell_implementation = {
+    host_shell_get_shell_surface};
+
+static void host_bind_shell(struct wl_client* client,
+                            void* data,
+                            uint32_t version,
+                            uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &wl_shell_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &host_shell_implementation, data,
+                                 nullptr);
+}
+
+static void host_positioner_set_size(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     int32_t width,
+                                     int32_t height) {}
+
+static void host_positioner_set_rect(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     int32_t x,
+                                     int32_t y,
+                                     int32_t width,
+                                     int32_t height) {}
+
+static void host_positioner_set_value(struct wl_client* client,
+                                      struct wl_resource* resource,
+                                      uint32_t value) {}
+
+static void host_positioner_set_offset(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       int32_t x,
+                                       int32_t y) {}
+
+static const struct xdg_positioner_interface host_positioner_implementation =
+    {host_destroy,
+     host_positioner_set_size,
+     host_positioner_set_rect,
+     host_positioner_set_value,
+     host_positioner_set_value,
+     host_positioner_set_value,
+     host_positioner_set_offset};
+
+static void host_toplevel_set_parent(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* parent) {}
+
+static void host_toplevel_show_window_menu(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           struct wl_resource* seat,
+                                           uint32_t serial,
+                                           int32_t x,
+                                           int32_t y) {}
+
+static void host_toplevel_move(struct wl_client* client,
+                               struct wl_resource* resource,
+                               struct wl_resource* seat,
+                               uint32_t serial) {}
+
+static void host_toplevel_resize(struct wl_client* client,
+                                 struct wl_resource* resource,
+                                 struct wl_resource* seat,
+                                 uint32_t serial,
+                                 uint32_t edges) {}
+
+static void host_toplevel_set_size(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   int32_t width,
+                                   int32_t height) {}
+
+static void host_toplevel_set_state(struct wl_client* client,
+                                    struct wl_resource* resource) {}
+
+static void host_toplevel_set_fullscreen(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         struct wl_resource* output) {}
+
+static const struct xdg_toplevel_interface host_toplevel_implementation = {
+    host_destroy,
+    host_toplevel_set_parent,
+    host_set_string,
+    host_set_string,
+    host_toplevel_show_window_menu,
+    host_toplevel_move,
+    host_toplevel_resize,
+    host_toplevel_set_size,
+    host_toplevel_set_size,
+    host_toplevel_set_state,
+    host_toplevel_set_state,
+    host_toplevel_set_fullscreen,
+    host_toplevel_set_state,
+    host_toplevel_set_state};
+
+static void host_popup_grab(struct wl_client* client,
+                            struct wl_resource* resource,
+                            struct wl_resource* seat,
+                            uint32_t serial) {}
+
+static const struct xdg_popup_interface host_popup_implementation = {
+    host_destroy, host_popup_grab};
+
+static uint32_t host_next_serial(struct wl_resource* resource) {
+  return wl_display_next_serial(
+      wl_client_get_display(wl_resource_get_client(resource)));
+}
+
+static void host_xdg_surface_get_toplevel(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t id) {
+  struct wl_resource* toplevel_resource = wl_resource_create(
+      client, &xdg_toplevel_interface, wl_resource_get_version(resource), id);
+  struct wl_array states;
+
+  wl_resource_set_implementation(toplevel_resource,
+                                 &host_toplevel_implementation, nullptr,
+                                 nullptr);
+  wl_array_init(&states);
+  xdg_toplevel_send_configure(toplevel_resource, 0, 0, &states);
+  wl_array_release(&states);
+  xdg_surface_send_configure(resource, host_next_serial(resource));
+}
+
+static void host_xdg_surface_get_popup(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       uint32_t id,
+                                       struct wl_resource* parent,
+                                       struct wl_resource* positioner) {
+  struct wl_resource* popup_resource = wl_resource_create(
+      client, &xdg_popup_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(popup_resource, &host_popup_implementation,
+                                 nullptr, nullptr);
+  xdg_popup_send_configure(popup_resource, 0, 0, 1, 1);
+  xdg_surface_send_configure(resource, host_next_serial(resource));
+}
+
+static void host_xdg_surface_set_window_geometry(struct wl_client* client,
+                                                 struct wl_resource* resource,
+                                                 int32_t x,
+                                                 int32_t y,
+                                                 int32_t width,
+                                                 int32_t height) {}
+
+static void host_xdg_surface_ack_configure(struct wl_client* client,
+                                           struct wl_resource* resource,
+                                           uint32_t serial) {}
+
+static const struct xdg_surface_interface host_xdg_surface_implementation = {
+    host_destroy, host_xdg_surface_get_toplevel, host_xdg_surface_get_popup,
+    host_xdg_surface_set_window_geometry, host_xdg_surface_ack_configure};
+
+static void host_xdg_wm_base_create_positioner(struct wl_client* client,
+                                               struct wl_resource* resource,
+                                               uint32_t id) {
+  struct wl_resource* positioner_resource = wl_resource_create(
+      client, &xdg_positioner_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(positioner_resource,
+                                 &host_positioner_implementation, nullptr,
+                                 nullptr);
+}
+
+static void host_xdg_wm_base_get_xdg_surface(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             uint32_t id,
+                                             struct wl_resource* surface) {
+  struct wl_resource* xdg_surface_resource = wl_resource_create(
+      client, &xdg_surface_interface, wl_resource_get_version(resource), id);
+
+  wl_resource_set_implementation(xdg_surface_resource,
+                                 &host_xdg_surface_implementation, nullptr,
+                                 nullptr);
+}
+
+static void host_xdg_wm_base_pong(struct wl_client* client,
+                                  struct wl_resource* resource,
+                                  uint32_t serial) {}
+
+static const struct xdg_wm_base_interface host_xdg_wm_base_implementation = {
+    host_destroy, host_xdg_wm_base_create_positioner,
+    host_xdg_wm_base_get_xdg_surface, host_xdg_wm_base_pong};
+
+static void host_bind_xdg_wm_base(struct wl_client* client,
+                                  void* data,
+                                  uint32_t version,
+                                  uint32_t id) {
+  struct wl_resource* resource =
+      wl_resource_create(client, &xdg_wm_base_interface, 1, id);
+
+  wl_resource_set_implementation(resource, &host_xdg_wm_base_implementation,
+                                 data, nullptr);
+}
+
+static void host_dmabuf_params_destroy(struct wl_resource* resource) {
+  struct host_dmabuf_params* params = static_cast<struct host_dmabuf_params*>(
+      wl_resource_get_user_data(resource));
+
+  if (params->fd >= 0)
+    close(params->fd);
+  delete params;
+}
+
+static void host_dmabuf_params_add(struct wl_client* client,
+                                   struct wl_resource* resource,
+                                   int32_t fd,
+                                   uint32_t plane_idx,
+                                   uint32_t offset,
+                                   uint32_t stride,
+                                   uint32_t modifier_hi,
+                                   uint32_t modifier_lo) {
+  struct host_dmabuf_params* params = static_cast<struct host_dmabuf_params*>(
+      wl_resource_get_user_data(resource));
+
+  // Only the first plane is needed to read the timestamp.
+  if (plane_idx || params->fd >= 0) {
+    close(fd);
+    return;
+  }
+
+  params->fd = fd;
+  params->offset = offset;
+  params->stride = stride;
+}
+
+static struct wl_resource* host_dmabuf_params_create_buffer(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    uint32_t buffer_id,
+    int32_t height,
+    uint32_t format) {
+  struct host_dmabuf_params* params = static_cast<struct host_dmabuf_params*>(
+      wl_resource_get_user_data(resource));
+  struct host_dmabuf_buffer* buffer = new host_dmabuf_buffer;
+
+  buffer->fd = params->fd;
+  buffer->offset = params->offset;
+  buffer->stride = params->stride;
+  buffer->format = format;
+  buffer->size = params->offset + params->stride * height;
+  buffer->data = static_cast<uint8_t*>(
+      mmap(nullptr, buffer->size, PROT_READ, MAP_SHARED, buffer->fd, 0));
+  if (buffer->data == MAP_FAILED)
+    buffer->data = nullptr;
+  params->fd = -1;
+
+  buffer->resource =
+      wl_resource_create(client, &wl_buffer_interface, 1, buffer_id);
+  wl_resource_set_implementation(buffer->resource,
+                                 &host_dmabuf_buffer_implementation, buffer,
+                                 host_dmabuf_buffer_destroy);
+  return buffer->resource;
+}
+
+static void host_dmabuf_params_create(struct wl_client* client,
+                                      struct wl_resource* resource,
+                                      int32_t width,
+                                      int32_t height,
+                                      uint32_t format,
+                                      uint32_t flags) {
+  struct wl_resource* buffer_resource =
+      host_dmabuf_params_create_buffer(client, resource, 0, height, format);
+
+  zwp_linux_buffer_params_v1_send_created(resource, buffer_resource);
+}
+
+static void host_dmabuf_params_create_immed(struct wl_client* client,
+                                            struct wl_resource* resource,
+                                            uint32_t buffer_id,
+                                            int32_t width,
+                                            int32_t height,
+                                            uint32_t format,
+                                            uint32_t flags) {
+  host_dmabuf_params_create_buffer(client, resource, buffer_id, height,
+                                   format);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface
+    host_dmabuf_params_implementation = {
+        host_destroy, host_dmabuf_params_add, host_dmabuf_params_create,
+        host_dmabuf_params_create_immed};
+
+static void host_dmabuf_create_params(struct wl_client* client,
+                                      struct wl_resource* resource,
+                                      uint32_t id) {
+  struct host_dmabuf_params* params = new host_dmabuf_params;
+  struct wl_resource* params_resource =
+      wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+                         wl_resource_get_version(resource), id);
+
+  params->fd = -1;
+  params->offset = 0;
+  params->stride = 0;
+  wl_resource_set_implementation(params_resource,
+                                 &host_dmabuf_params_implementation, params,
+                                 host_dmabuf_params_destroy);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface host_dmabuf_implementation =
+    {host_destroy, host_dmabuf_create_params};
+
+static void host_bind_dmabuf(struct wl_client* client,
+                             void* data,
+                             uint32_t version,
+                             uint32_t id) {
+  const uint32_t formats[] = {DRM_FORMAT_ARGB8888, DRM_FORMAT_XRGB8888,
+                              DRM_FORMAT_ABGR8888, DRM_FORMAT_XBGR8888,
+                              DRM_FORMAT_RGB565};
+  struct wl_resource* resource =
+      wl_resource_create(client, &zwp_linux_dmabuf_v1_interface, version, id);
+
+  wl_resource_set_implementation(resource, &host_dmabuf_implementation, data,
+                                 nullptr);
+  for (uint32_t format : formats)
+    zwp_linux_dmabuf_v1_send_format(resource, format);
+}
+
+static int host_handle_terminate(int signal_number, void* data) {
+  wl_display_terminate(static_cast<struct wl_display*>(data));
+  return 1;
+}
+
+static int host_handle_duration_timer(void* data) {
+  wl_display_terminate(static_cast<struct wl_display*>(data));
+  return 0;
+}
+
+static uint64_t host_percentile(const std::vector<uint64_t>& sorted,
+                                int percentile) {
+  if (sorted.empty())
+    return 0;
+  return sorted[std::min(sorted.size() - 1,
+                         sorted.size() * percentile / 100)];
+}
+
+int main(int argc, char* argv[]) {
+  brillo::InitLog(brillo::kLogToStderr);
+
+  base::CommandLine::Init(argc, argv);
+  base::CommandLine* cl = base::CommandLine::ForCurrentProcess();
+  struct host_data host;
+  host.width = 1920;
+  host.height = 1080;
+  host.refresh = 60;
+  host.release_latency = 0;
+  host.frames = 0;
+  host.first_frame_usec = 0;
+  host.last_frame_usec = 0;
+  uint32_t duration = 0;
+  std::string socket = "benchmark-host";
+
+  if (cl->HasSwitch(kSocketFlag))
+    socket = cl->GetSwitchValueASCII(kSocketFlag);
+  if (cl->HasSwitch(kWidthFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kWidthFlag), &host.width)) {
+    LOG(ERROR) << "Invalid width parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kHeightFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kHeightFlag),
+                          &host.height)) {
+    LOG(ERROR) << "Invalid height parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kRefreshFlag) &&
+      (!base::StringToUint(cl->GetSwitchValueASCII(kRefreshFlag),
+                           &host.refresh) ||
+       !host.refresh)) {
+    LOG(ERROR) << "Invalid refresh parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kReleaseLatencyFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kReleaseLatencyFlag),
+                          &host.release_latency)) {
+    LOG(ERROR) << "Invalid release-latency parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kDurationFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kDurationFlag), &duration)) {
+    LOG(ERROR) << "Invalid duration parameter passed";
+    return -1;
+  }
+
+  host.display = wl_display_create();
+  host.loop = wl_display_get_event_loop(host.display);
+  if (wl_display_add_socket(host.display, socket.c_str())) {
+    LOG(ERROR) << "Failed adding socket " << socket;
+    return -1;
+  }
+
+  wl_display_init_shm(host.display);
+  wl_display_add_shm_format(host.display, WL_SHM_FORMAT_RGB565);
+  wl_global_create(host.display, &wl_compositor_interface, 4, &host,
+                   host_bind_compositor);
+  wl_global_create(host.display, &wl_output_interface, 2, &host,
+                   host_bind_output);
+  wl_global_create(host.display, &wl_shell_interface, 1, &host,
+                   host_bind_shell);
+  wl_global_create(host.display, &xdg_wm_base_interface, 1, &host,
+                   host_bind_xdg_wm_base);
+  wl_global_create(host.display, &zwp_linux_dmabuf_v1_interface, 2, &host,
+                   host_bind_dmabuf);
+
+  wl_list_init(&host.frame_callbacks);
+  host.refresh_timer =
+      wl_event_loop_add_timer(host.loop, host_handle_refresh_timer, &host);
+  wl_event_source_timer_update(host.refresh_timer, 1000 / host.refresh);
+
+  wl_event_loop_add_signal(host.loop, SIGINT, host_handle_terminate,
+                           host.display);
+  wl_event_loop_add_signal(host.loop, SIGTERM, host_handle_terminate,
+                           host.display);
+  if (duration) {
+    struct wl_event_source* duration_timer = wl_event_loop_add_timer(
+        host.loop, host_handle_duration_timer, host.display);
+    wl_event_source_timer_update(duration_timer, duration * 1000);
+  }
+
+  wl_display_run(host.display);
+
+  std::sort(host.latencies.begin(), host.latencies.end());
+  uint64_t frames_usec = host.last_frame_usec - host.first_frame_usec;
+  printf("host_frames=%u\n", host.frames);
+  printf("host_fps=%.1f\n",
+         frames_usec ? (host.frames - 1) * 1000000.0 / frames_usec : 0.0);
+  printf("latency_p50_usec=%llu\n",
+         static_cast<unsigned long long>(  // NOLINT(runtime/int)
+             host_percentile(host.latencies, 50)));
+  printf("latency_p90_usec=%llu\n",
+         static_cast<unsigned long long>(  // NOLINT(runtime/int)
+             host_percentile(host.latencies, 90)));
+  printf("latency_p99_usec=%llu\n",
+         static_cast<unsigned long long>(  // NOLINT(runtime/int)
+             host_percentile(host.latencies, 99)));
+  printf("latency_max_usec=%llu\n",
+         static_cast<unsigned long long>(  // NOLINT(runtime/int)
+             host.latencies.empty() ? 0 : host.latencies.back()));
+
+  wl_display_destroy_clients(host.display);
+  wl_display_destroy(host.display);
+  return 0;
+}
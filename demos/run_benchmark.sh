@@ -0,0 +1,100 @@
+#!/bin/sh
+# Copyright 2020 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# Runs the benchmark clients through sommelier against benchmark_host for
+# every shm driver and prints sustained fps, commit latency percentiles and
+# sommelier CPU time and peak RSS. Drivers that sommelier cannot initialize
+# here (virtwl without /dev/wl0, dmabuf without a render node) are skipped.
+#
+# Usage: run_benchmark.sh [client args...]
+#
+# SOMMELIER, BUILD_DIR, DRIVERS, CLIENTS, DURATION and RELEASE_LATENCY can
+# be set in the environment to override the defaults below.
+
+BUILD_DIR="${BUILD_DIR:-.}"
+SOMMELIER="${SOMMELIER:-${BUILD_DIR}/sommelier}"
+DRIVERS="${DRIVERS:-noop dmabuf virtwl virtwl-dmabuf}"
+CLIENTS="${CLIENTS:-wayland x11}"
+DURATION="${DURATION:-10}"
+RELEASE_LATENCY="${RELEASE_LATENCY:-0}"
+
+TMP_DIR="$(mktemp -d)"
+trap 'rm -rf "${TMP_DIR}"' EXIT
+
+# Prints "<cpu ms> <peak rss kB>" for |pid|.
+sample_process() {
+  pid="$1"
+  ticks="$(cut -d' ' -f14,15 "/proc/${pid}/stat" 2>/dev/null)" || return 1
+  hwm="$(awk '/^VmHWM:/ { print $2 }' "/proc/${pid}/status" 2>/dev/null)"
+  set -- ${ticks}
+  echo "$(( ($1 + $2) * 1000 / $(getconf CLK_TCK) )) ${hwm:-0}"
+}
+
+# Prints the value of |key| from a key=value results file.
+result() {
+  sed -n "s/^$2=//p" "$1"
+}
+
+run() {
+  client="$1"
+  driver="$2"
+  shift 2
+  socket="benchmark-host-$$"
+  out="${TMP_DIR}/${client}-${driver}"
+
+  "${BUILD_DIR}/benchmark_host" --socket="${socket}" \
+      --release-latency="${RELEASE_LATENCY}" >"${out}.host" 2>/dev/null &
+  host_pid=$!
+  sleep 1
+
+  x_args=""
+  if [ "${client}" = "x11" ]; then
+    x_args="-X"
+  fi
+
+  # The client output is written to a file so that sommelier is the
+  # background job and can be sampled while the client runs.
+  "${SOMMELIER}" --display="${socket}" --shm-driver="${driver}" ${x_args} \
+      "${BUILD_DIR}/${client}_benchmark" --duration="${DURATION}" "$@" \
+      >"${out}.client" 2>"${out}.log" &
+  sommelier_pid=$!
+
+  sample=""
+  while kill -0 "${sommelier_pid}" 2>/dev/null; do
+    sample="$(sample_process "${sommelier_pid}")" || break
+    if grep -q '^client_fps=' "${out}.client"; then
+      kill "${sommelier_pid}" 2>/dev/null
+      break
+    fi
+    sleep 0.2
+  done
+  wait "${sommelier_pid}" 2>/dev/null
+
+  kill -INT "${host_pid}" 2>/dev/null
+  wait "${host_pid}" 2>/dev/null
+
+  if [ -z "$(result "${out}.client" client_fps)" ]; then
+    printf '%-8s %-14s skipped (%s)\n' "${client}" "${driver}" \
+        "$(head -n1 "${out}.log")"
+    return
+  fi
+
+  set -- ${sample:-0 0}
+  printf '%-8s %-14s %8s %8s %8s %8s %8s %8s %8s\n' "${client}" "${driver}" \
+      "$(result "${out}.client" client_fps)" \
+      "$(result "${out}.host" host_fps)" \
+      "$(result "${out}.host" latency_p50_usec)" \
+      "$(result "${out}.host" latency_p90_usec)" \
+      "$(result "${out}.host" latency_p99_usec)" \
+      "$1" "$2"
+}
+
+printf '%-8s %-14s %8s %8s %8s %8s %8s %8s %8s\n' client driver fps \
+    host_fps p50_us p90_us p99_us cpu_ms rss_kb
+for client in ${CLIENTS}; do
+  for driver in ${DRIVERS}; do
+    run "${client}" "${driver}" "$@"
+  done
+done
@@ -0,0 +1,295 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include <wayland-client-protocol.h>
+
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/memory/shared_memory.h"
+#include "base/strings/string_number_conversions.h"
+#include "brillo/syslog_logging.h"
+#include "demos/benchmark_common.h"
+
+constexpr char kWidthFlag[] = "width";
+constexpr char kHeightFlag[] = "height";
+constexpr char kFpsFlag[] = "fps";
+constexpr char kDamageFlag[] = "damage";
+constexpr char kFormatFlag[] = "format";
+constexpr char kDurationFlag[] = "duration";
+constexpr int kNumBuffers = 3;
+
+struct benchmark_buffer {
+  struct wl_buffer* buffer;
+  uint8_t* data;
+  bool busy;
+};
+
+struct benchmark_data {
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  uint32_t duration;
+  BenchmarkDamage damage;
+  uint32_t format;
+  int32_t bpp;
+  int32_t stride;
+  struct wl_compositor* compositor;
+  struct wl_shell* shell;
+  struct wl_shm* shm;
+  struct wl_surface* surface;
+  struct wl_shell_surface* shell_surface;
+  struct benchmark_buffer buffers[kNumBuffers];
+  uint32_t frame;
+  uint32_t skipped;
+};
+
+void benchmark_registry_listener(void* data,
+                                 struct wl_registry* registry,
+                                 uint32_t id,
+                                 const char* interface,
+                                 uint32_t version) {
+  struct benchmark_data* data_ptr =
+      reinterpret_cast<struct benchmark_data*>(data);
+  if (!strcmp("wl_compositor", interface)) {
+    data_ptr->compositor = reinterpret_cast<struct wl_compositor*>(
+        wl_registry_bind(registry, id, &wl_compositor_interface, 1));
+  } else if (!strcmp("wl_shell", interface)) {
+    data_ptr->shell = reinterpret_cast<struct wl_shell*>(
+        wl_registry_bind(registry, id, &wl_shell_interface, 1));
+  } else if (!strcmp("wl_shm", interface)) {
+    data_ptr->shm = reinterpret_cast<struct wl_shm*>(
+        wl_registry_bind(registry, id, &wl_shm_interface, 1));
+  }
+}
+
+void benchmark_registry_remover(void* data,
+                                struct wl_registry* registry,
+                                uint32_t id) {}
+
+void shell_surface_ping(void* data,
+                        struct wl_shell_surface* shell_surface,
+                        uint32_t serial) {
+  wl_shell_surface_pong(shell_surface, serial);
+}
+
+void shell_surface_configure(void* data,
+                             struct wl_shell_surface* shell_surface,
+                             uint32_t edges,
+                             int32_t width,
+                             int32_t height) {}
+
+void shell_surface_popup_done(void* data,
+                              struct wl_shell_surface* shell_surface) {}
+
+void buffer_release(void* data, struct wl_buffer* buffer) {
+  struct benchmark_buffer* buffer_ptr =
+      reinterpret_cast<struct benchmark_buffer*>(data);
+  buffer_ptr->busy = false;
+}
+
+// Draws and commits the next frame into a free buffer. Frames are skipped
+// when all buffers are still held by the compositor.
+void benchmark_draw(struct benchmark_data* data) {
+  struct benchmark_buffer* buffer = nullptr;
+
+  for (int i = 0; i < kNumBuffers; ++i) {
+    if (!data->buffers[i].busy) {
+      buffer = &data->buffers[i];
+      break;
+    }
+  }
+  if (!buffer) {
+    ++data->skipped;
+    return;
+  }
+
+  std::vector<BenchmarkRect> rects =
+      BenchmarkDamageRects(data->damage, data->width, data->height,
+                           data->frame);
+  for (const BenchmarkRect& rect : rects) {
+    BenchmarkFillRect(buffer->data, data->stride, data->bpp, rect,
+                      data->frame);
+    wl_surface_damage(data->surface, rect.x, rect.y, rect.width, rect.height);
+  }
+  BenchmarkStamp(buffer->data, data->bpp);
+
+  wl_surface_attach(data->surface, buffer->buffer, 0, 0);
+  wl_surface_commit(data->surface);
+  buffer->busy = true;
+  ++data->frame;
+}
+
+// Commits frames at a fixed rate with a configurable damage pattern. The
+// achieved frame rate is printed when done. Latency is measured by the
+// benchmark host from the timestamps stored in each frame.
+int main(int argc, char* argv[]) {
+  brillo::InitLog(brillo::kLogToStderr);
+
+  base::CommandLine::Init(argc, argv);
+  base::CommandLine* cl = base::CommandLine::ForCurrentProcess();
+  struct benchmark_data data;
+  memset(&data, 0, sizeof(data));
+  data.width = 1024;
+  data.height = 768;
+  data.fps = 60;
+  data.duration = 10;
+  data.damage = kDamageFull;
+  data.format = WL_SHM_FORMAT_XRGB8888;
+  data.bpp = 4;
+
+  if (cl->HasSwitch(kWidthFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kWidthFlag), &data.width)) {
+    LOG(ERROR) << "Invalid width parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kHeightFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kHeightFlag),
+                          &data.height)) {
+    LOG(ERROR) << "Invalid height parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kFpsFlag) &&
+      (!base::StringToUint(cl->GetSwitchValueASCII(kFpsFlag), &data.fps) ||
+       !data.fps)) {
+    LOG(ERROR) << "Invalid fps parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kDurationFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kDurationFlag),
+                          &data.duration)) {
+    LOG(ERROR) << "Invalid duration parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kDamageFlag) &&
+      !BenchmarkParseDamage(cl->GetSwitchValueASCII(kDamageFlag),
+                            &data.damage)) {
+    LOG(ERROR) << "Invalid damage parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kFormatFlag)) {
+    std::string format = cl->GetSwitchValueASCII(kFormatFlag);
+    if (format == "xrgb8888") {
+      data.format = WL_SHM_FORMAT_XRGB8888;
+      data.bpp = 4;
+    } else if (format == "argb8888") {
+      data.format = WL_SHM_FORMAT_ARGB8888;
+      data.bpp = 4;
+    } else if (format == "rgb565") {
+      data.format = WL_SHM_FORMAT_RGB565;
+      data.bpp = 2;
+    } else {
+      LOG(ERROR) << "Invalid format parameter passed";
+      return -1;
+    }
+  }
+
+  struct wl_display* display = wl_display_connect(nullptr);
+  if (!display) {
+    LOG(ERROR) << "Failed connecting to display";
+    return -1;
+  }
+
+  struct wl_registry_listener registry_listener = {
+      benchmark_registry_listener, benchmark_registry_remover,
+  };
+  struct wl_registry* registry = wl_display_get_registry(display);
+  wl_registry_add_listener(registry, &registry_listener, &data);
+  wl_display_roundtrip(display);
+
+  if (!data.compositor || !data.shell || !data.shm) {
+    LOG(ERROR) << "Missing compositor, shell or shared memory global";
+    return -1;
+  }
+
+  data.surface = wl_compositor_create_surface(data.compositor);
+  data.shell_surface = wl_shell_get_shell_surface(data.shell, data.surface);
+  const struct wl_shell_surface_listener shell_surface_listener = {
+      shell_surface_ping, shell_surface_configure, shell_surface_popup_done};
+  wl_shell_surface_add_listener(data.shell_surface, &shell_surface_listener,
+                                nullptr);
+  wl_shell_surface_set_toplevel(data.shell_surface);
+  wl_shell_surface_set_title(data.shell_surface, "wayland_benchmark");
+
+  data.stride = data.width * data.bpp;
+  size_t buffer_size = data.stride * data.height;
+  base::SharedMemory shared_mem;
+  if (!shared_mem.CreateAndMapAnonymous(buffer_size * kNumBuffers)) {
+    LOG(ERROR) << "Failed creating shared memory";
+    return -1;
+  }
+
+  const struct wl_buffer_listener buffer_listener = {buffer_release};
+  struct wl_shm_pool* pool = wl_shm_create_pool(
+      data.shm, shared_mem.handle().fd, buffer_size * kNumBuffers);
+  for (int i = 0; i < kNumBuffers; ++i) {
+    data.buffers[i].buffer = wl_shm_pool_create_buffer(
+        pool, buffer_size * i, data.width, data.height, data.stride,
+        data.format);
+    data.buffers[i].data =
+        reinterpret_cast<uint8_t*>(shared_mem.memory()) + buffer_size * i;
+    wl_buffer_add_listener(data.buffers[i].buffer, &buffer_listener,
+                           &data.buffers[i]);
+  }
+  wl_shm_pool_destroy(pool);
+
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  uint64_t period_nsec = 1000000000ull / data.fps;
+  struct itimerspec interval = {};
+  interval.it_interval.tv_sec = period_nsec / 1000000000ull;
+  interval.it_interval.tv_nsec = period_nsec % 1000000000ull;
+  interval.it_value = interval.it_interval;
+  timerfd_settime(timer_fd, 0, &interval, nullptr);
+
+  uint64_t start_usec = BenchmarkNowUsec();
+  uint64_t end_usec = start_usec + data.duration * 1000000ull;
+  struct pollfd fds[] = {
+      {wl_display_get_fd(display), POLLIN, 0},
+      {timer_fd, POLLIN, 0},
+  };
+  while (BenchmarkNowUsec() < end_usec) {
+    while (wl_display_prepare_read(display) != 0)
+      wl_display_dispatch_pending(display);
+    wl_display_flush(display);
+
+    if (poll(fds, 2, -1) < 0) {
+      wl_display_cancel_read(display);
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if (wl_display_read_events(display) < 0) {
+        LOG(ERROR) << "Lost connection to display";
+        return -1;
+      }
+    } else {
+      wl_display_cancel_read(display);
+    }
+    wl_display_dispatch_pending(display);
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+        data.skipped += expirations - 1;
+        benchmark_draw(&data);
+        wl_display_flush(display);
+      }
+    }
+  }
+  uint64_t elapsed_usec = BenchmarkNowUsec() - start_usec;
+
+  printf("client_frames=%u\n", data.frame);
+  printf("client_skipped=%u\n", data.skipped);
+  printf("client_fps=%.1f\n", data.frame * 1000000.0 / elapsed_usec);
+
+  close(timer_fd);
+  wl_display_disconnect(display);
+  return 0;
+}
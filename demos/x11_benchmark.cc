@@ -0,0 +1,136 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/strings/string_number_conversions.h"
+#include "brillo/syslog_logging.h"
+#include "demos/benchmark_common.h"
+
+constexpr char kWidthFlag[] = "width";
+constexpr char kHeightFlag[] = "height";
+constexpr char kFpsFlag[] = "fps";
+constexpr char kDamageFlag[] = "damage";
+constexpr char kDurationFlag[] = "duration";
+
+// Updates an X window at a fixed rate with a configurable damage pattern
+// using XPutImage, which Xwayland turns into surface commits. The achieved
+// frame rate is printed when done. Latency is measured by the benchmark
+// host from the timestamps stored in each frame.
+int main(int argc, char* argv[]) {
+  brillo::InitLog(brillo::kLogToStderr);
+
+  base::CommandLine::Init(argc, argv);
+  base::CommandLine* cl = base::CommandLine::ForCurrentProcess();
+  unsigned int width = 1024;
+  unsigned int height = 768;
+  unsigned int fps = 60;
+  unsigned int duration = 10;
+  BenchmarkDamage damage = kDamageFull;
+
+  if (cl->HasSwitch(kWidthFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kWidthFlag), &width)) {
+    LOG(ERROR) << "Invalid width parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kHeightFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kHeightFlag), &height)) {
+    LOG(ERROR) << "Invalid height parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kFpsFlag) &&
+      (!base::StringToUint(cl->GetSwitchValueASCII(kFpsFlag), &fps) || !fps)) {
+    LOG(ERROR) << "Invalid fps parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kDurationFlag) &&
+      !base::StringToUint(cl->GetSwitchValueASCII(kDurationFlag), &duration)) {
+    LOG(ERROR) << "Invalid duration parameter passed";
+    return -1;
+  }
+  if (cl->HasSwitch(kDamageFlag) &&
+      !BenchmarkParseDamage(cl->GetSwitchValueASCII(kDamageFlag), &damage)) {
+    LOG(ERROR) << "Invalid damage parameter passed";
+    return -1;
+  }
+
+  Display* dpy = XOpenDisplay(nullptr);
+  if (!dpy) {
+    LOG(ERROR) << "Failed opening display";
+    return -1;
+  }
+
+  int screen = DefaultScreen(dpy);
+  Visual* visual = DefaultVisual(dpy, screen);
+  if (DefaultDepth(dpy, screen) != 24) {
+    LOG(ERROR) << "Default visual must have depth 24";
+    return -1;
+  }
+
+  Window win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), 0, 0, width,
+                                   height, 0, 0 /* black */, 0);
+  XStoreName(dpy, win, "x11_benchmark");
+  XMapWindow(dpy, win);
+  GC gc = XCreateGC(dpy, win, 0, nullptr);
+
+  int32_t stride = width * 4;
+  char* pixels = static_cast<char*>(calloc(stride, height));
+  XImage* image = XCreateImage(dpy, visual, 24, ZPixmap, 0, pixels, width,
+                               height, 32, stride);
+  XSync(dpy, False);
+
+  uint64_t period_usec = 1000000 / fps;
+  uint64_t start_usec = BenchmarkNowUsec();
+  uint64_t end_usec = start_usec + duration * 1000000ull;
+  uint64_t deadline_usec = start_usec;
+  uint32_t frame = 0, skipped = 0;
+  while (deadline_usec < end_usec) {
+    uint64_t now_usec = BenchmarkNowUsec();
+
+    // Drop frames that we are too late for.
+    if (now_usec > deadline_usec + period_usec) {
+      uint64_t missed = (now_usec - deadline_usec) / period_usec;
+      skipped += missed;
+      deadline_usec += missed * period_usec;
+    } else if (now_usec < deadline_usec) {
+      struct timespec ts = {
+          static_cast<time_t>((deadline_usec - now_usec) / 1000000),
+          static_cast<long>((deadline_usec - now_usec) % 1000000 * 1000)};
+      nanosleep(&ts, nullptr);
+    }
+    deadline_usec += period_usec;
+
+    std::vector<BenchmarkRect> rects =
+        BenchmarkDamageRects(damage, width, height, frame);
+    uint8_t* data = reinterpret_cast<uint8_t*>(pixels);
+    for (const BenchmarkRect& rect : rects)
+      BenchmarkFillRect(data, stride, 4, rect, frame);
+    BenchmarkStamp(data, 4);
+    for (const BenchmarkRect& rect : rects) {
+      XPutImage(dpy, win, gc, image, rect.x, rect.y, rect.x, rect.y,
+                rect.width, rect.height);
+    }
+    // Wait for the X server to process the frame like a real client
+    // would before it draws the next one.
+    XSync(dpy, False);
+    ++frame;
+  }
+  uint64_t elapsed_usec = BenchmarkNowUsec() - start_usec;
+
+  printf("client_frames=%u\n", frame);
+  printf("client_skipped=%u\n", skipped);
+  printf("client_fps=%.1f\n", frame * 1000000.0 / elapsed_usec);
+
+  XDestroyImage(image);
+  XFreeGC(dpy, gc);
+  XCloseDisplay(dpy);
+  return 0;
+}
@@ -11,8 +11,11 @@
 #include <limits.h>
 #include <linux/virtwl.h>
 #include <pixman.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <wayland-client.h>
@@ -25,14 +28,22 @@
 #define MIN_SIZE (INT_MIN / 10)
 #define MAX_SIZE (INT_MAX / 10)
 
-#define DMA_BUF_SYNC_READ (1 << 0)
-#define DMA_BUF_SYNC_WRITE (2 << 0)
-#define DMA_BUF_SYNC_RW (DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE)
-#define DMA_BUF_SYNC_START (0 << 2)
-#define DMA_BUF_SYNC_END (1 << 2)
+// Size of the tiles that are hashed to detect changed contents when
+// --damage-tiles is enabled.
+#define DAMAGE_TILE_SIZE 64
 
-#define DMA_BUF_BASE 'b'
-#define DMA_BUF_IOCTL_SYNC _IOW(DMA_BUF_BASE, 0, struct dma_buf_sync)
+// Copies at least this large are done by the copy threads when enabled.
+#define ASYNC_COPY_MIN_SIZE (1024 * 1024)
+
+// Number of cursor images kept in host buffers, and the largest cursor size
+// that is cached.
+#define CURSOR_CACHE_SIZE 16
+#define CURSOR_CACHE_MAX_SIZE 256
+#define COPY_BAND_ALIGNMENT 16
+
+// Longest time a request that has to be ordered after a commit waits for the
+// fence of the commit before the commit is forwarded anyway.
+#define FENCE_WAIT_TIMEOUT_MS 100
 
 struct sl_host_compositor {
   struct sl_compositor* compositor;
@@ -45,51 +56,63 @@ struct sl_output_buffer {
   uint32_t width;
   uint32_t height;
   uint32_t format;
+  // Factor by which the contents are reduced, 1 for full resolution.
+  int downscale;
+  // Size bucket the buffer size is rounded up to, and the size of the
+  // contents it last held. Zero if the buffer matches the contents size.
+  int bucket;
+  uint32_t contents_width;
+  uint32_t contents_height;
   struct wl_buffer* internal;
   struct sl_mmap* mmap;
+  // Buffer object of dmabuf output buffers with a tiled layout. These can't
+  // be written through a plain mapping of the dmabuf and are mapped with GBM
+  // around each copy instead.
+  struct gbm_bo* bo;
   struct pixman_region32 damage;
   struct sl_host_surface* surface;
+  // Copy kernel for the buffer format and its destination. Both are set up
+  // once when the buffer is allocated.
+  sl_copy_rect_func_t copy_rect;
+  struct sl_copy_target copy_target;
+  // Hash of the contents of each tile when --damage-tiles is enabled. Zero
+  // means contents are unknown.
+  uint64_t* tile_hashes;
+  // Set while the host holds on to the buffer.
+  int busy;
+  // Hash of the contents of buffers in the cursor cache.
+  uint64_t cursor_hash;
 };
 
-struct dma_buf_sync {
-  __u64 flags;
+struct sl_copy_job {
+  struct wl_list link;
+  struct sl_host_surface* host;
+  struct sl_output_buffer* buffer;
+  struct sl_mmap* src;
+  pixman_box32_t* rects;
+  int num_rects;
+  int32_t y1;
+  int32_t band_height;
+  int num_bands;
+  // Fields below are protected by the pool lock.
+  int next_band;
+  int done_bands;
+  int starting;
+  int started;
+  int complete;
+  uint64_t write_usec;
 };
 
-static void sl_dmabuf_sync(int fd, __u64 flags) {
-  struct dma_buf_sync sync = {0};
-  int rv;
-
-  sync.flags = flags;
-  do {
-    rv = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
-  } while (rv == -1 && errno == EINTR);
-}
-
-static void sl_dmabuf_begin_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
-}
-
-static void sl_dmabuf_end_write(int fd) {
-  sl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
-}
-
-static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
-  struct virtwl_ioctl_dmabuf_sync sync = {0};
-  int rv;
-
-  sync.flags = flags;
-  rv = ioctl(fd, VIRTWL_IOCTL_DMABUF_SYNC, &sync);
-  assert(!rv);
-  UNUSED(rv);
-}
-
-static void sl_virtwl_dmabuf_begin_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
-}
-
-static void sl_virtwl_dmabuf_end_write(int fd) {
-  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
-}
+struct sl_copy_pool {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  struct wl_list jobs;
+  struct wl_list completed;
+  int num_threads;
+  int event_fd;
+  struct wl_event_source* event_source;
+};
 
 static uint32_t sl_gbm_format_for_shm_format(uint32_t format) {
   switch (format) {
@@ -129,25 +152,691 @@ static uint32_t sl_drm_format_for_shm_format(int format) {
   return 0;
 }
 
-static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
+static size_t sl_damage_tile_count(uint32_t width, uint32_t height) {
+  return ((width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE) *
+         ((height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE);
+}
+
+// Hashes a tile of a single plane buffer. Four independent lanes keep the
+// multiplies from serializing. The result is never zero.
+static uint64_t sl_damage_tile_hash(struct sl_mmap* mmap,
+                                    int32_t x1,
+                                    int32_t y1,
+                                    int32_t x2,
+                                    int32_t y2) {
+  const uint64_t prime = 0x100000001b3ull;
+  uint64_t h[4] = {0xcbf29ce484222325ull, 0x84222325cbf29ce4ull,
+                   0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full};
+  size_t stride = mmap->stride[0];
+  size_t bytes = (x2 - x1) * mmap->bpp;
+  const uint8_t* row =
+      (uint8_t*)mmap->addr + mmap->offset[0] + y1 * stride + x1 * mmap->bpp;
+  int32_t y;
+
+  for (y = y1; y < y2; ++y) {
+    const uint8_t* p = row;
+    size_t n = bytes;
+
+    while (n >= 32) {
+      uint64_t v[4];
+
+      memcpy(v, p, sizeof(v));
+      h[0] = (h[0] ^ v[0]) * prime;
+      h[1] = (h[1] ^ v[1]) * prime;
+      h[2] = (h[2] ^ v[2]) * prime;
+      h[3] = (h[3] ^ v[3]) * prime;
+      p += 32;
+      n -= 32;
+    }
+    while (n--)
+      h[0] = (h[0] ^ *p++) * prime;
+
+    row += stride;
+  }
+
+  return (h[0] ^ (h[1] << 1 | h[1] >> 63) ^ (h[2] << 2 | h[2] >> 62) ^
+          (h[3] << 3 | h[3] >> 61)) |
+         1;
+}
+
+// Reduces |damage| to the tiles whose contents differ from what |buffer|
+// holds, and computes |host_damage| as the tiles that differ from the last
+// contents committed to the host. Both regions are in buffer coordinates.
+static void sl_damage_tiles_update(struct sl_host_surface* host,
+                                   struct sl_output_buffer* buffer,
+                                   pixman_region32_t* damage,
+                                   pixman_region32_t* host_damage) {
+  uint32_t width = host->contents_width;
+  uint32_t height = host->contents_height;
+  uint32_t tiles_x = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+  pixman_region32_t tiles;
+  pixman_box32_t* rect;
+  int n;
+
+  if (!host->tile_hashes || host->tile_hashes_width != width ||
+      host->tile_hashes_height != height) {
+    free(host->tile_hashes);
+    host->tile_hashes =
+        calloc(sl_damage_tile_count(width, height), sizeof(uint64_t));
+    assert(host->tile_hashes);
+    host->tile_hashes_width = width;
+    host->tile_hashes_height = height;
+  }
+
+  // Round damage out to whole tiles.
+  pixman_region32_init(&tiles);
+  rect = pixman_region32_rectangles(damage, &n);
+  while (n--) {
+    int32_t x1 = rect->x1 & ~(DAMAGE_TILE_SIZE - 1);
+    int32_t y1 = rect->y1 & ~(DAMAGE_TILE_SIZE - 1);
+    int32_t x2 = (rect->x2 + DAMAGE_TILE_SIZE - 1) & ~(DAMAGE_TILE_SIZE - 1);
+    int32_t y2 = (rect->y2 + DAMAGE_TILE_SIZE - 1) & ~(DAMAGE_TILE_SIZE - 1);
+
+    pixman_region32_union_rect(&tiles, &tiles, x1, y1, x2 - x1, y2 - y1);
+    ++rect;
+  }
+
+  pixman_region32_clear(damage);
+  rect = pixman_region32_rectangles(&tiles, &n);
+  while (n--) {
+    int32_t x, y;
+
+    for (y = rect->y1; y < rect->y2; y += DAMAGE_TILE_SIZE) {
+      for (x = rect->x1; x < rect->x2; x += DAMAGE_TILE_SIZE) {
+        size_t i = (y / DAMAGE_TILE_SIZE) * tiles_x + x / DAMAGE_TILE_SIZE;
+        int32_t x2 = MIN(x + DAMAGE_TILE_SIZE, (int32_t)width);
+        int32_t y2 = MIN(y + DAMAGE_TILE_SIZE, (int32_t)height);
+        uint64_t hash;
+
+        hash = sl_damage_tile_hash(host->contents_shm_mmap, x, y, x2, y2);
+        if (buffer->tile_hashes[i] != hash) {
+          pixman_region32_union_rect(damage, damage, x, y, x2 - x, y2 - y);
+          buffer->tile_hashes[i] = hash;
+        }
+        if (host->tile_hashes[i] != hash) {
+          pixman_region32_union_rect(host_damage, host_damage, x, y, x2 - x,
+                                     y2 - y);
+          host->tile_hashes[i] = hash;
+        }
+      }
+    }
+    ++rect;
+  }
+  pixman_region32_fini(&tiles);
+}
+
+static void sl_output_buffer_destroy(struct sl_context* ctx,
+                                     struct sl_output_buffer* buffer) {
+  ctx->stats.output_buffers_destroyed++;
+  ctx->output_buffer_size -= buffer->mmap->size;
   wl_buffer_destroy(buffer->internal);
-  sl_mmap_unref(buffer->mmap);
+  if (buffer->bo) {
+    sl_slab_free(&ctx->mmap_slab, buffer->mmap);
+    gbm_bo_destroy(buffer->bo);
+  } else {
+    sl_mmap_unref(buffer->mmap);
+  }
   pixman_region32_fini(&buffer->damage);
+  free(buffer->tile_hashes);
+  wl_list_remove(&buffer->link);
+  sl_slab_free(&ctx->output_buffer_slab, buffer);
+}
+
+// Computes the size of output buffers for the current contents of |host|.
+static void sl_host_surface_output_buffer_size(struct sl_host_surface* host,
+                                               uint32_t* width,
+                                               uint32_t* height) {
+  int downscale = host->contents_downscale;
+  int bucket = host->contents_bucket;
+
+  *width = (host->contents_width + downscale - 1) / downscale;
+  *height = (host->contents_height + downscale - 1) / downscale;
+  if (bucket) {
+    *width = (*width + bucket - 1) / bucket * bucket;
+    *height = (*height + bucket - 1) / bucket * bucket;
+  }
+}
+
+static int sl_output_buffer_matches(struct sl_host_surface* host,
+                                    struct sl_output_buffer* buffer) {
+  struct sl_mmap* mmap = host->contents_shm_mmap;
+  int downscale = host->contents_downscale;
+  uint32_t width, height;
+
+  sl_host_surface_output_buffer_size(host, &width, &height);
+  if (buffer->downscale != downscale ||
+      buffer->bucket != host->contents_bucket || buffer->width != width ||
+      buffer->height != height || buffer->format != host->contents_shm_format)
+    return 0;
+
+  // VirtWL output buffers use the same layout as the client buffer unless
+  // they are reduced in size or bucketed.
+  if (host->ctx->shm_driver == SHM_DRIVER_VIRTWL && downscale == 1 &&
+      !buffer->bucket) {
+    return buffer->mmap->size == mmap->size &&
+           buffer->mmap->stride[0] == mmap->stride[0] &&
+           buffer->mmap->stride[1] == mmap->stride[1] &&
+           buffer->mmap->offset[1] == mmap->offset[1] - mmap->offset[0];
+  }
+
+  return 1;
+}
+
+// Returns an output buffer that is no longer used by a surface to the process
+// wide pool. Least recently returned buffers are destroyed when the pool
+// grows beyond its limit.
+static void sl_output_buffer_pool_put(struct sl_context* ctx,
+                                      struct sl_output_buffer* buffer) {
   wl_list_remove(&buffer->link);
-  free(buffer);
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  buffer->surface = NULL;
+  ctx->output_buffer_pool_size += buffer->mmap->size;
+
+  while (ctx->output_buffer_pool_size > ctx->output_buffer_pool_max_size) {
+    struct sl_output_buffer* oldest =
+        wl_container_of(ctx->output_buffer_pool.prev, oldest, link);
+
+    ctx->output_buffer_pool_size -= oldest->mmap->size;
+    sl_output_buffer_destroy(ctx, oldest);
+  }
+}
+
+static struct sl_output_buffer* sl_output_buffer_pool_get(
+    struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer* buffer;
+
+  wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+    if (buffer->busy || !sl_output_buffer_matches(host, buffer))
+      continue;
+
+    wl_list_remove(&buffer->link);
+    wl_list_init(&buffer->link);
+    ctx->output_buffer_pool_size -= buffer->mmap->size;
+
+    // Contents are unknown to the new surface.
+    buffer->contents_width = host->contents_width;
+    buffer->contents_height = host->contents_height;
+    pixman_region32_fini(&buffer->damage);
+    pixman_region32_init_rect(&buffer->damage, 0, 0, MAX_SIZE, MAX_SIZE);
+    if (buffer->tile_hashes) {
+      memset(buffer->tile_hashes, 0,
+             sl_damage_tile_count(buffer->width, buffer->height) *
+                 sizeof(uint64_t));
+    }
+    return buffer;
+  }
+
+  return NULL;
 }
 
+static void sl_host_surface_present_mailbox(struct sl_host_surface* host);
+
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer = wl_buffer_get_user_data(buffer);
   struct sl_host_surface* host_surface = output_buffer->surface;
 
+  output_buffer->busy = 0;
+
+  // Buffers of destroyed surfaces stay in the pool.
+  if (!host_surface)
+    return;
+
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+
+  // Host caught up. Present the latest client frame that was held back.
+  if (host_surface->mailbox_pending)
+    sl_host_surface_present_mailbox(host_surface);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+// Allocates a buffer object using one of the modifiers the host supports for
+// |drm_format|, leaving the choice of the best one to the driver. Returns
+// NULL if the host didn't advertise any modifiers for the format or none of
+// them can be allocated and mapped for CPU writes.
+static struct gbm_bo* sl_output_buffer_create_bo_with_modifiers(
+    struct sl_context* ctx,
+    uint32_t width,
+    uint32_t height,
+    uint32_t gbm_format,
+    uint32_t drm_format) {
+  struct sl_dmabuf_modifier* m;
+  struct gbm_bo* bo;
+  uint64_t* modifiers;
+  unsigned count = 0;
+  void* map_data = NULL;
+  uint32_t stride;
+
+  if (!ctx->linux_dmabuf->modifiers.size)
+    return NULL;
+
+  modifiers = malloc(ctx->linux_dmabuf->modifiers.size);
+  assert(modifiers);
+  wl_array_for_each(m, &ctx->linux_dmabuf->modifiers) {
+    if (m->format == drm_format && m->modifier != DRM_FORMAT_MOD_INVALID)
+      modifiers[count++] = m->modifier;
+  }
+
+  bo = count ? gbm_bo_create_with_modifiers(ctx->gbm, width, height,
+                                            gbm_format, modifiers, count)
+             : NULL;
+  free(modifiers);
+  if (!bo)
+    return NULL;
+
+  // Some layouts, such as compressed ones, can't be mapped by all drivers.
+  if (!gbm_bo_map(bo, 0, 0, 1, 1, GBM_BO_TRANSFER_WRITE, &stride,
+                  &map_data)) {
+    gbm_bo_destroy(bo);
+    return NULL;
+  }
+  gbm_bo_unmap(bo, map_data);
+
+  return bo;
+}
+
+// Maps the part of |buffer| covered by |damage| for CPU writes and points the
+// buffer mapping at it. The existing contents only have to be read back when
+// |damage| is not a single rectangle. Returns the data to unmap the buffer
+// with.
+static void* sl_output_buffer_map(struct sl_output_buffer* buffer,
+                                  pixman_region32_t* damage) {
+  pixman_box32_t* extents = pixman_region32_extents(damage);
+  int downscale = buffer->downscale;
+  uint32_t x1 = extents->x1 / downscale;
+  uint32_t y1 = extents->y1 / downscale;
+  uint32_t x2 = MIN(buffer->width, (extents->x2 + downscale - 1) / downscale);
+  uint32_t y2 = MIN(buffer->height, (extents->y2 + downscale - 1) / downscale);
+  uint32_t flags = pixman_region32_n_rects(damage) == 1
+                       ? GBM_BO_TRANSFER_WRITE
+                       : GBM_BO_TRANSFER_READ_WRITE;
+  void* map_data = NULL;
+  uint32_t stride;
+  uint8_t* addr;
+
+  addr = gbm_bo_map(buffer->bo, x1, y1, x2 - x1, y2 - y1, flags, &stride,
+                    &map_data);
+  if (!addr) {
+    fprintf(stderr, "error: failed to map output buffer\n");
+    _exit(EXIT_FAILURE);
+  }
+
+  // Copies address the mapping relative to the origin of the buffer.
+  buffer->mmap->addr = addr - y1 * stride - x1 * buffer->mmap->bpp;
+  buffer->mmap->stride[0] = stride;
+
+  return map_data;
+}
+
+// Allocates a new output buffer matching the current contents of |host|.
+static struct sl_output_buffer* sl_output_buffer_create(
+    struct sl_host_surface* host) {
+  struct sl_mmap* shm_mmap = host->contents_shm_mmap;
+  struct sl_output_buffer* buffer;
+  int downscale = host->contents_downscale;
+  uint32_t shm_format = host->contents_shm_format;
+  size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
+  size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
+  uint32_t width, height;
+
+  sl_host_surface_output_buffer_size(host, &width, &height);
+
+  buffer = sl_slab_alloc(&host->ctx->output_buffer_slab,
+                         sizeof(struct sl_output_buffer));
+  host->ctx->stats.output_buffers_created++;
+  wl_list_insert(&host->released_buffers, &buffer->link);
+  buffer->width = width;
+  buffer->height = height;
+  buffer->format = shm_format;
+  buffer->downscale = downscale;
+  buffer->bucket = host->contents_bucket;
+  buffer->contents_width = host->contents_width;
+  buffer->contents_height = host->contents_height;
+  buffer->bo = NULL;
+  buffer->surface = host;
+  buffer->busy = 0;
+  pixman_region32_init_rect(&buffer->damage, 0, 0, MAX_SIZE, MAX_SIZE);
+
+  switch (host->ctx->shm_driver) {
+    case SHM_DRIVER_DMABUF: {
+      uint32_t gbm_format = sl_gbm_format_for_shm_format(shm_format);
+      uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+      struct zwp_linux_buffer_params_v1* buffer_params;
+      uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+      struct gbm_bo* bo = NULL;
+      int stride0;
+      int fd;
+      int i;
+
+      // Prefer a layout the host can scan out or sample from directly.
+      if (host->ctx->dmabuf_modifiers && num_planes == 1) {
+        bo = sl_output_buffer_create_bo_with_modifiers(
+            host->ctx, width, height, gbm_format, drm_format);
+      }
+      if (bo) {
+        modifier = gbm_bo_get_modifier(bo);
+      } else {
+        bo = gbm_bo_create(host->ctx->gbm, width, height, gbm_format,
+                           GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
+      }
+      stride0 = gbm_bo_get_stride(bo);
+      fd = gbm_bo_get_fd(bo);
+
+      buffer_params = zwp_linux_dmabuf_v1_create_params(
+          host->ctx->linux_dmabuf->internal);
+      for (i = 0; i < gbm_bo_get_plane_count(bo); ++i) {
+        zwp_linux_buffer_params_v1_add(
+            buffer_params, fd, i, gbm_bo_get_offset(bo, i),
+            gbm_bo_get_stride_for_plane(bo, i), modifier >> 32,
+            modifier & 0xffffffff);
+      }
+      buffer->internal = zwp_linux_buffer_params_v1_create_immed(
+          buffer_params, width, height, drm_format, 0);
+      zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+      if (modifier == DRM_FORMAT_MOD_INVALID ||
+          modifier == DRM_FORMAT_MOD_LINEAR) {
+        buffer->mmap = sl_mmap_create(host->ctx, fd, height * stride0, bpp, 1,
+                                      0, stride0, 0, 0, 1, 0);
+        buffer->mmap->begin_write = sl_dmabuf_begin_write;
+        buffer->mmap->end_write = sl_dmabuf_end_write;
+        gbm_bo_destroy(bo);
+      } else {
+        // The mapping is set up by sl_output_buffer_map() before each copy.
+        buffer->mmap =
+            sl_slab_alloc(&host->ctx->mmap_slab, sizeof(*buffer->mmap));
+        memset(buffer->mmap, 0, sizeof(*buffer->mmap));
+        buffer->mmap->refcount = 1;
+        buffer->mmap->fd = -1;
+        buffer->mmap->size = height * stride0;
+        buffer->mmap->bpp = bpp;
+        buffer->mmap->num_planes = 1;
+        buffer->mmap->stride[0] = stride0;
+        buffer->mmap->y_ss[0] = 1;
+        buffer->bo = bo;
+        close(fd);
+      }
+    } break;
+    case SHM_DRIVER_VIRTWL: {
+      // Reduced size and bucketed buffers are tightly packed.
+      int packed = downscale > 1 || buffer->bucket;
+      size_t stride0 = packed ? width * bpp : shm_mmap->stride[0];
+      size_t size = packed ? stride0 * height : shm_mmap->size;
+      struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
+                                           .fd = -1,
+                                           .flags = 0,
+                                           .size = size};
+      struct wl_shm_pool* pool;
+      int rv;
+
+      rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+      assert(rv == 0);
+      UNUSED(rv);
+
+      pool = wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
+      buffer->internal = wl_shm_pool_create_buffer(pool, 0, width, height,
+                                                   stride0, shm_format);
+      wl_shm_pool_destroy(pool);
+
+      buffer->mmap = sl_mmap_create(
+          host->ctx, ioctl_new.fd, size, bpp, num_planes, 0, stride0,
+          shm_mmap->offset[1] - shm_mmap->offset[0], shm_mmap->stride[1],
+          shm_mmap->y_ss[0], shm_mmap->y_ss[1]);
+    } break;
+    case SHM_DRIVER_VIRTWL_DMABUF: {
+      uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
+      struct virtwl_ioctl_new ioctl_new = {
+          .type = VIRTWL_IOCTL_NEW_DMABUF,
+          .fd = -1,
+          .flags = 0,
+          .dmabuf = {.width = width, .height = height, .format = drm_format}};
+      struct zwp_linux_buffer_params_v1* buffer_params;
+      size_t size;
+      int rv;
+
+      rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
+      if (rv) {
+        fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
+                strerror(errno));
+        _exit(EXIT_FAILURE);
+      }
+
+      size = ioctl_new.dmabuf.stride0 * height;
+      buffer_params = zwp_linux_dmabuf_v1_create_params(
+          host->ctx->linux_dmabuf->internal);
+      zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
+                                     ioctl_new.dmabuf.offset0,
+                                     ioctl_new.dmabuf.stride0, 0, 0);
+      if (num_planes > 1) {
+        zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
+                                       ioctl_new.dmabuf.offset1,
+                                       ioctl_new.dmabuf.stride1, 0, 0);
+        size = MAX(size, ioctl_new.dmabuf.offset1 +
+                             ioctl_new.dmabuf.stride1 * height /
+                                 shm_mmap->y_ss[1]);
+      }
+      buffer->internal = zwp_linux_buffer_params_v1_create_immed(
+          buffer_params, width, height, drm_format, 0);
+      zwp_linux_buffer_params_v1_destroy(buffer_params);
+
+      buffer->mmap = sl_mmap_create(
+          host->ctx, ioctl_new.fd, size, bpp, num_planes,
+          ioctl_new.dmabuf.offset0, ioctl_new.dmabuf.stride0,
+          ioctl_new.dmabuf.offset1, ioctl_new.dmabuf.stride1, shm_mmap->y_ss[0],
+          shm_mmap->y_ss[1]);
+      buffer->mmap->begin_write = sl_virtwl_dmabuf_begin_write;
+      buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
+    } break;
+  }
+
+  assert(buffer->internal);
+  assert(buffer->mmap);
+  host->ctx->output_buffer_size += buffer->mmap->size;
+
+  if (downscale > 1) {
+    buffer->copy_rect = sl_downscale_rect_func_for_shm_format(shm_format);
+  } else {
+    buffer->copy_rect =
+        sl_copy_rect_func_for_shm_format(shm_format, buffer->mmap);
+  }
+  buffer->copy_target.mmap = buffer->mmap;
+  buffer->copy_target.width = width;
+  buffer->copy_target.src_width = host->contents_width;
+  buffer->copy_target.src_height = host->contents_height;
+  // All output buffers are host visible mappings that are written by us and
+  // read by the host. Don't let large copies thrash our caches.
+  buffer->copy_target.stream_plane = sl_stream_copy_plane_func();
+
+  // Tile hashing is only implemented for single plane formats at full
+  // resolution.
+  buffer->tile_hashes = NULL;
+  if (host->ctx->damage_tiles && num_planes == 1 && downscale == 1) {
+    buffer->tile_hashes =
+        calloc(sl_damage_tile_count(width, height), sizeof(uint64_t));
+    assert(buffer->tile_hashes);
+  }
+
+  wl_buffer_set_user_data(buffer->internal, buffer);
+  wl_buffer_add_listener(buffer->internal, &sl_output_buffer_listener, buffer);
+
+  return buffer;
+}
+
+// Returns the factor by which the current contents of |host| are reduced when
+// the window matches --low-resolution. The host scales them back up to the
+// viewport destination, so surfaces that have a viewport of their own and
+// formats without a downscaling copy keep their full resolution.
+static int sl_host_surface_contents_downscale(struct sl_host_surface* host) {
+  int low_resolution =
+      host->window ? host->window->low_resolution : host->low_resolution;
+
+  if (!low_resolution || !host->viewport ||
+      !wl_list_empty(&host->contents_viewport) ||
+      !sl_downscale_rect_func_for_shm_format(host->contents_shm_format) ||
+      host->contents_width < 2 || host->contents_height < 2)
+    return 1;
+
+  return 2;
+}
+
+// Returns the size bucket for output buffers of the current contents of
+// |host|. Only windows that the host is resizing use buckets, so their
+// buffers stay the same while the size changes within a bucket. The host
+// surface viewport is needed to crop them, which rules out surfaces with a
+// viewport of their own.
+static int sl_host_surface_contents_bucket(struct sl_host_surface* host) {
+  if (!host->ctx->resize_bucket_size || !host->window ||
+      !host->window->resizing || !host->viewport ||
+      !wl_list_empty(&host->contents_viewport) ||
+      host->contents_downscale > 1 ||
+      sl_shm_num_planes_for_shm_format(host->contents_shm_format) != 1)
+    return 0;
+
+  return host->ctx->resize_bucket_size;
+}
+
+// Keeps the contents of a bucketed buffer that was used for a different
+// size. Only the area the previous contents didn't cover needs to be copied
+// in addition to client damage.
+static void sl_output_buffer_resize_contents(struct sl_host_surface* host,
+                                             struct sl_output_buffer* buffer) {
+  if (buffer->contents_width == host->contents_width &&
+      buffer->contents_height == host->contents_height)
+    return;
+
+  pixman_region32_union_rect(&buffer->damage, &buffer->damage,
+                             buffer->contents_width, 0, MAX_SIZE, MAX_SIZE);
+  pixman_region32_union_rect(&buffer->damage, &buffer->damage, 0,
+                             buffer->contents_height, MAX_SIZE, MAX_SIZE);
+
+  // Tiles are laid out for the contents size.
+  if (buffer->tile_hashes) {
+    memset(buffer->tile_hashes, 0,
+           sl_damage_tile_count(buffer->width, buffer->height) *
+               sizeof(uint64_t));
+  }
+
+  buffer->contents_width = host->contents_width;
+  buffer->contents_height = host->contents_height;
+}
+
+// Picks the output buffer for the current contents of |host|. Buffers released
+// by the host are preferred over pooled and newly allocated buffers.
+static void sl_host_surface_acquire_output_buffer(
+    struct sl_host_surface* host) {
+  host->current_buffer = NULL;
+  while (!wl_list_empty(&host->released_buffers)) {
+    host->current_buffer = wl_container_of(host->released_buffers.next,
+                                           host->current_buffer, link);
+
+    if (sl_output_buffer_matches(host, host->current_buffer)) {
+      if (host->current_buffer->bucket)
+        sl_output_buffer_resize_contents(host, host->current_buffer);
+      return;
+    }
+
+    sl_output_buffer_pool_put(host->ctx, host->current_buffer);
+    host->current_buffer = NULL;
+  }
+
+  // Try to reuse a buffer from a previously destroyed or resized surface.
+  host->current_buffer = sl_output_buffer_pool_get(host);
+  if (host->current_buffer) {
+    wl_list_insert(&host->released_buffers, &host->current_buffer->link);
+    host->current_buffer->surface = host;
+    return;
+  }
+
+  // Allocate new output buffer.
+  host->current_buffer = sl_output_buffer_create(host);
+}
+
+// Returns non-zero if the host holds as many output buffers of |host| as
+// --max-inflight-buffers allows.
+static int sl_host_surface_mailbox_full(struct sl_host_surface* host) {
+  return host->ctx->max_inflight_buffers &&
+         wl_list_length(&host->busy_buffers) >=
+             host->ctx->max_inflight_buffers;
+}
+
+// Returns non-zero if the current contents of |host| are a cursor image that
+// is kept in the cursor cache.
+static int sl_host_surface_cursor_cacheable(struct sl_host_surface* host) {
+  return host->is_cursor && host->contents_downscale == 1 &&
+         host->contents_shm_mmap->num_planes == 1 &&
+         host->contents_width <= CURSOR_CACHE_MAX_SIZE &&
+         host->contents_height <= CURSOR_CACHE_MAX_SIZE;
+}
+
+// Attaches a host buffer with the current cursor image of |host|. Images that
+// have been seen before are bound to the buffer that already holds them.
+// Otherwise a new buffer is filled and replaces the least recently used one.
+static void sl_host_surface_attach_cursor(struct sl_host_surface* host) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_mmap* mmap = host->contents_shm_mmap;
+  struct sl_output_buffer* buffer;
+  void* map_data = NULL;
+  uint64_t hash;
+
+  host->cursor_attach = 0;
+  hash = sl_damage_tile_hash(mmap, 0, 0, host->contents_width,
+                             host->contents_height);
+
+  wl_list_for_each(buffer, &ctx->cursor_buffers, link) {
+    if (buffer->cursor_hash == hash && buffer->width == host->contents_width &&
+        buffer->height == host->contents_height &&
+        buffer->format == host->contents_shm_format) {
+      ctx->stats.cursor_cache_hits++;
+      wl_list_remove(&buffer->link);
+      wl_list_insert(&ctx->cursor_buffers, &buffer->link);
+      wl_surface_attach(host->proxy, buffer->internal, host->mailbox_x,
+                        host->mailbox_y);
+      return;
+    }
+  }
+
+  ctx->stats.cursor_cache_misses++;
+  buffer = sl_output_buffer_create(host);
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&ctx->cursor_buffers, &buffer->link);
+  buffer->surface = NULL;
+  buffer->cursor_hash = hash;
+  free(buffer->tile_hashes);
+  buffer->tile_hashes = NULL;
+
+  if (++ctx->cursor_buffer_count > CURSOR_CACHE_SIZE) {
+    struct sl_output_buffer* oldest =
+        wl_container_of(ctx->cursor_buffers.prev, oldest, link);
+
+    sl_output_buffer_destroy(ctx, oldest);
+    ctx->cursor_buffer_count--;
+  }
+
+  pixman_region32_fini(&buffer->damage);
+  pixman_region32_init_rect(&buffer->damage, 0, 0, host->contents_width,
+                            host->contents_height);
+  if (buffer->bo)
+    map_data = sl_output_buffer_map(buffer, &buffer->damage);
+  if (buffer->mmap->begin_write)
+    buffer->mmap->begin_write(buffer->mmap->fd);
+  buffer->copy_rect(&buffer->copy_target, mmap, 0, 0, host->contents_width,
+                    host->contents_height);
+  if (buffer->mmap->end_write)
+    buffer->mmap->end_write(buffer->mmap->fd);
+  if (buffer->bo)
+    gbm_bo_unmap(buffer->bo, map_data);
+  pixman_region32_clear(&buffer->damage);
+
+  host->bytes_copied += mmap->size;
+  ctx->stats.bytes_copied += mmap->size;
+
+  wl_surface_attach(host->proxy, buffer->internal, host->mailbox_x,
+                    host->mailbox_y);
+}
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -162,10 +851,27 @@ static void sl_host_surface_attach(struct wl_client* client,
   struct sl_host_buffer* host_buffer =
       buffer_resource ? wl_resource_get_user_data(buffer_resource) : NULL;
   struct wl_buffer* buffer_proxy = NULL;
-  struct sl_window* window;
   double scale = host->ctx->scale;
+  int32_t dropped_x = 0;
+  int32_t dropped_y = 0;
+
+  sl_host_surface_finish_commit(host);
+
+  // A newer frame replaces the one waiting for a host buffer. Release the
+  // client buffer of the replaced frame unless it is attached again. Its
+  // offset never reached the host, so it is added to the new one.
+  if (host->mailbox_pending) {
+    host->mailbox_pending = 0;
+    dropped_x = host->mailbox_x;
+    dropped_y = host->mailbox_y;
+    if (host->contents_shm_mmap->buffer_resource &&
+        (!host_buffer || host_buffer->shm_mmap != host->contents_shm_mmap))
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
+  }
 
   host->current_buffer = NULL;
+  host->mailbox_attach = 0;
+  host->cursor_attach = 0;
   if (host->contents_shm_mmap) {
     sl_mmap_unref(host->contents_shm_mmap);
     host->contents_shm_mmap = NULL;
@@ -174,187 +880,89 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (host_buffer) {
     host->contents_width = host_buffer->width;
     host->contents_height = host_buffer->height;
+    host->contents_shm_format = host_buffer->shm_format;
     buffer_proxy = host_buffer->proxy;
     if (host_buffer->shm_mmap)
       host->contents_shm_mmap = sl_mmap_ref(host_buffer->shm_mmap);
   }
 
+  host->contents_downscale = 1;
+  host->contents_bucket = 0;
   if (host->contents_shm_mmap) {
-    while (!wl_list_empty(&host->released_buffers)) {
-      host->current_buffer = wl_container_of(host->released_buffers.next,
-                                             host->current_buffer, link);
-
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          host->current_buffer->format == host_buffer->shm_format) {
-        break;
-      }
-
-      sl_output_buffer_destroy(host->current_buffer);
-      host->current_buffer = NULL;
-    }
-
-    // Allocate new output buffer.
-    if (!host->current_buffer) {
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
-      uint32_t shm_format = host_buffer->shm_format;
-      size_t bpp = sl_shm_bpp_for_shm_format(shm_format);
-      size_t num_planes = sl_shm_num_planes_for_shm_format(shm_format);
-
-      host->current_buffer = malloc(sizeof(struct sl_output_buffer));
-      assert(host->current_buffer);
-      wl_list_insert(&host->released_buffers, &host->current_buffer->link);
-      host->current_buffer->width = width;
-      host->current_buffer->height = height;
-      host->current_buffer->format = shm_format;
-      host->current_buffer->surface = host;
-      pixman_region32_init_rect(&host->current_buffer->damage, 0, 0, MAX_SIZE,
-                                MAX_SIZE);
-
-      switch (host->ctx->shm_driver) {
-        case SHM_DRIVER_DMABUF: {
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          struct gbm_bo* bo;
-          int stride0;
-          int fd;
-
-          bo = gbm_bo_create(host->ctx->gbm, width, height,
-                             sl_gbm_format_for_shm_format(shm_format),
-                             GBM_BO_USE_SCANOUT | GBM_BO_USE_LINEAR);
-          stride0 = gbm_bo_get_stride(bo);
-          fd = gbm_bo_get_fd(bo);
-
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, fd, 0, 0, stride0,
-                                         DRM_FORMAT_MOD_INVALID >> 32,
-                                         DRM_FORMAT_MOD_INVALID & 0xffffffff);
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(
-                  buffer_params, width, height,
-                  sl_drm_format_for_shm_format(shm_format), 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              fd, height * stride0, bpp, 1, 0, stride0, 0, 0, 1, 0);
-          host->current_buffer->mmap->begin_write = sl_dmabuf_begin_write;
-          host->current_buffer->mmap->end_write = sl_dmabuf_end_write;
-
-          gbm_bo_destroy(bo);
-        } break;
-        case SHM_DRIVER_VIRTWL: {
-          size_t size = host_buffer->shm_mmap->size;
-          struct virtwl_ioctl_new ioctl_new = {.type = VIRTWL_IOCTL_NEW_ALLOC,
-                                               .fd = -1,
-                                               .flags = 0,
-                                               .size = size};
-          struct wl_shm_pool* pool;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          assert(rv == 0);
-          UNUSED(rv);
-
-          pool =
-              wl_shm_create_pool(host->ctx->shm->internal, ioctl_new.fd, size);
-          host->current_buffer->internal = wl_shm_pool_create_buffer(
-              pool, 0, width, height, host_buffer->shm_mmap->stride[0],
-              shm_format);
-          wl_shm_pool_destroy(pool);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, 0,
-              host_buffer->shm_mmap->stride[0],
-              host_buffer->shm_mmap->offset[1] -
-                  host_buffer->shm_mmap->offset[0],
-              host_buffer->shm_mmap->stride[1], host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-        } break;
-        case SHM_DRIVER_VIRTWL_DMABUF: {
-          uint32_t drm_format = sl_drm_format_for_shm_format(shm_format);
-          struct virtwl_ioctl_new ioctl_new = {
-              .type = VIRTWL_IOCTL_NEW_DMABUF,
-              .fd = -1,
-              .flags = 0,
-              .dmabuf = {
-                  .width = width, .height = height, .format = drm_format}};
-          struct zwp_linux_buffer_params_v1* buffer_params;
-          size_t size;
-          int rv;
-
-          rv = ioctl(host->ctx->virtwl_fd, VIRTWL_IOCTL_NEW, &ioctl_new);
-          if (rv) {
-            fprintf(stderr, "error: virtwl dmabuf allocation failed: %s\n",
-                    strerror(errno));
-            _exit(EXIT_FAILURE);
-          }
-
-          size = ioctl_new.dmabuf.stride0 * height;
-          buffer_params = zwp_linux_dmabuf_v1_create_params(
-              host->ctx->linux_dmabuf->internal);
-          zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 0,
-                                         ioctl_new.dmabuf.offset0,
-                                         ioctl_new.dmabuf.stride0, 0, 0);
-          if (num_planes > 1) {
-            zwp_linux_buffer_params_v1_add(buffer_params, ioctl_new.fd, 1,
-                                           ioctl_new.dmabuf.offset1,
-                                           ioctl_new.dmabuf.stride1, 0, 0);
-            size = MAX(size, ioctl_new.dmabuf.offset1 +
-                                 ioctl_new.dmabuf.stride1 * height /
-                                     host_buffer->shm_mmap->y_ss[1]);
-          }
-          host->current_buffer->internal =
-              zwp_linux_buffer_params_v1_create_immed(buffer_params, width,
-                                                      height, drm_format, 0);
-          zwp_linux_buffer_params_v1_destroy(buffer_params);
-
-          host->current_buffer->mmap = sl_mmap_create(
-              ioctl_new.fd, size, bpp, num_planes, ioctl_new.dmabuf.offset0,
-              ioctl_new.dmabuf.stride0, ioctl_new.dmabuf.offset1,
-              ioctl_new.dmabuf.stride1, host_buffer->shm_mmap->y_ss[0],
-              host_buffer->shm_mmap->y_ss[1]);
-          host->current_buffer->mmap->begin_write =
-              sl_virtwl_dmabuf_begin_write;
-          host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
-        } break;
-      }
-
-      assert(host->current_buffer->internal);
-      assert(host->current_buffer->mmap);
-
-      wl_buffer_set_user_data(host->current_buffer->internal,
-                              host->current_buffer);
-      wl_buffer_add_listener(host->current_buffer->internal,
-                             &sl_output_buffer_listener, host->current_buffer);
-    }
+    host->contents_downscale = sl_host_surface_contents_downscale(host);
+    host->contents_bucket = sl_host_surface_contents_bucket(host);
   }
 
   x /= scale;
   y /= scale;
+  x += dropped_x;
+  y += dropped_y;
+
+  if (host->contents_shm_mmap) {
+    // Cursor images are looked up when committed, once their contents are
+    // final.
+    if (sl_host_surface_cursor_cacheable(host)) {
+      host->cursor_attach = 1;
+      host->mailbox_x = x;
+      host->mailbox_y = y;
+    } else if (sl_host_surface_mailbox_full(host)) {
+      // Wait for the host to release a buffer before picking one when too
+      // many are in flight.
+      host->mailbox_attach = 1;
+      host->mailbox_x = x;
+      host->mailbox_y = y;
+    } else {
+      sl_host_surface_acquire_output_buffer(host);
+    }
+  }
 
-  // TODO(davidriley): This should be done in the commit.
+  // Rendering to the buffer might still be in progress. Commit waits for
+  // this fence before contents are forwarded to the host. Commits in
+  // subsurface trees are not deferred, and neither are commits of buffers
+  // without a fence, so those wait for rendering here.
+  if (host->contents_fence_fd >= 0) {
+    close(host->contents_fence_fd);
+    host->contents_fence_fd = -1;
+  }
   if (host_buffer && host_buffer->sync_point) {
-    host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+    struct sl_sync_point* sync_point = host_buffer->sync_point;
+
+    if (sync_point->fence && !host->in_subsurface_tree)
+      host->contents_fence_fd = sync_point->fence(host->ctx, sync_point);
+    if (host->contents_fence_fd < 0 && sync_point->sync)
+      sync_point->sync(host->ctx, sync_point);
   }
 
   if (host->current_buffer) {
     assert(host->current_buffer->internal);
     wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
-  } else {
+  } else if (!host->mailbox_attach && !host->cursor_attach) {
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
   }
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      while (sl_process_pending_configure_acks(window, host))
-        continue;
-
-      break;
-    }
+  if (host->window) {
+    while (sl_process_pending_configure_acks(host->window, host))
+      continue;
   }
 }
 
+static void sl_host_surface_forward_damage(struct sl_host_surface* host,
+                                           int64_t x1,
+                                           int64_t y1,
+                                           int64_t x2,
+                                           int64_t y2) {
+  double scale = host->ctx->scale;
+
+  // Enclosing rect after scaling and outset by one pixel to account for
+  // potential filtering.
+  x1 = MAX(MIN_SIZE, x1 - 1) / scale;
+  y1 = MAX(MIN_SIZE, y1 - 1) / scale;
+  x2 = ceil(MIN(x2 + 1, MAX_SIZE) / scale);
+  y2 = ceil(MIN(y2 + 1, MAX_SIZE) / scale);
+
+  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+}
+
 static void sl_host_surface_damage(struct wl_client* client,
                                    struct wl_resource* resource,
                                    int32_t x,
@@ -362,9 +970,9 @@ static void sl_host_surface_damage(struct wl_client* client,
                                    int32_t width,
                                    int32_t height) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  double scale = host->ctx->scale;
   struct sl_output_buffer* buffer;
-  int64_t x1, y1, x2, y2;
+
+  sl_host_surface_finish_commit(host);
 
   wl_list_for_each(buffer, &host->busy_buffers, link) {
     pixman_region32_union_rect(&buffer->damage, &buffer->damage, x, y, width,
@@ -375,25 +983,26 @@ static void sl_host_surface_damage(struct wl_client* client,
                                height);
   }
 
-  x1 = x;
-  y1 = y;
-  x2 = x1 + width;
-  y2 = y1 + height;
-
-  // Enclosing rect after scaling and outset by one pixel to account for
-  // potential filtering.
-  x1 = MAX(MIN_SIZE, x1 - 1) / scale;
-  y1 = MAX(MIN_SIZE, y1 - 1) / scale;
-  x2 = ceil(MIN(x2 + 1, MAX_SIZE) / scale);
-  y2 = ceil(MIN(y2 + 1, MAX_SIZE) / scale);
+  // Hold back damage until commit when it might be reduced by tile hashing.
+  if (host->ctx->damage_tiles) {
+    pixman_region32_union_rect(&host->damage, &host->damage, x, y, width,
+                               height);
+    return;
+  }
 
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  sl_host_surface_forward_damage(host, x, y, x + width, y + height);
 }
 
 static void sl_frame_callback_done(void* data,
                                    struct wl_callback* callback,
                                    uint32_t time) {
   struct sl_host_callback* host = wl_callback_get_user_data(callback);
+  struct sl_event_counters* counters = &host->ctx->stats.frame_callbacks;
+  uint64_t now_usec = sl_now_usec();
+
+  counters->count++;
+  counters->usec += now_usec - host->start_usec;
+  sl_trace_event(host->ctx, "wayland", "frame", host->start_usec, now_usec);
 
   wl_callback_send_done(host->resource, time);
   wl_resource_destroy(host->resource);
@@ -407,7 +1016,7 @@ static void sl_host_callback_destroy(struct wl_resource* resource) {
 
   wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&host->ctx->callback_slab, host);
 }
 
 static void sl_host_surface_frame(struct wl_client* client,
@@ -416,8 +1025,12 @@ static void sl_host_surface_frame(struct wl_client* client,
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
 
-  host_callback = malloc(sizeof(*host_callback));
-  assert(host_callback);
+  sl_host_surface_finish_commit(host);
+
+  host_callback =
+      sl_slab_alloc(&host->ctx->callback_slab, sizeof(*host_callback));
+  host_callback->ctx = host->ctx;
+  host_callback->start_usec = sl_now_usec();
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
@@ -437,6 +1050,8 @@ static void sl_host_surface_set_opaque_region(
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
 
+  sl_host_surface_finish_commit(host);
+
   wl_surface_set_opaque_region(host->proxy,
                                host_region ? host_region->proxy : NULL);
 }
@@ -449,33 +1064,318 @@ static void sl_host_surface_set_input_region(
   struct sl_host_region* host_region =
       region_resource ? wl_resource_get_user_data(region_resource) : NULL;
 
+  sl_host_surface_finish_commit(host);
+
   wl_surface_set_input_region(host->proxy,
                               host_region ? host_region->proxy : NULL);
 }
 
-static void sl_host_surface_commit(struct wl_client* client,
-                                   struct wl_resource* resource) {
-  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+// Commits the host surface and releases the client buffer. Runs once the
+// contents copy for the commit has completed.
+static void sl_host_surface_commit_contents(struct sl_host_surface* host) {
+  // No need to defer client commits if surface has a role. E.g. is a cursor
+  // or shell surface.
+  if (host->has_role) {
+    wl_surface_commit(host->proxy);
+
+    // GTK determines the scale based on the output the surface has entered.
+    // If the surface has not entered any output, then have it enter the
+    // internal output. TODO(reveman): Remove this when surface-output tracking
+    // has been implemented in Chrome.
+    if (!host->has_output) {
+      struct sl_host_output* output;
+
+      wl_list_for_each(output, &host->ctx->host_outputs, link) {
+        if (output->internal) {
+          wl_surface_send_enter(host->resource, output->resource);
+          host->has_output = 1;
+          break;
+        }
+      }
+    }
+  } else {
+    // Commit if surface is associated with a window. Otherwise, defer
+    // commit until window is created.
+    if (host->window && host->window->xdg_surface) {
+      wl_surface_commit(host->proxy);
+      if (host->contents_width && host->contents_height)
+        host->window->realized = 1;
+    }
+  }
+
+  if (host->contents_shm_mmap) {
+    if (host->contents_shm_mmap->buffer_resource)
+      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
+    sl_mmap_unref(host->contents_shm_mmap);
+    host->contents_shm_mmap = NULL;
+  }
+}
+
+static size_t sl_region_size(pixman_region32_t* region, size_t bpp) {
+  pixman_box32_t* rect;
+  size_t size = 0;
+  int n;
+
+  rect = pixman_region32_rectangles(region, &n);
+  while (n--) {
+    size += (size_t)(rect->x2 - rect->x1) * (rect->y2 - rect->y1) * bpp;
+    ++rect;
+  }
+  return size;
+}
+
+// Copies one band of rows of a job. Called without the pool lock held.
+static void sl_copy_job_copy_band(struct sl_copy_job* job, int band) {
+  int32_t band_y1 = job->y1 + band * job->band_height;
+  int32_t band_y2 = band_y1 + job->band_height;
+  int i;
+
+  for (i = 0; i < job->num_rects; ++i) {
+    pixman_box32_t* rect = &job->rects[i];
+    int32_t y1 = MAX(rect->y1, band_y1);
+    int32_t y2 = MIN(rect->y2, band_y2);
+
+    if (y1 < y2) {
+      job->buffer->copy_rect(&job->buffer->copy_target, job->src, rect->x1,
+                             y1, rect->x2, y2);
+    }
+  }
+}
+
+// Performs the next piece of work of |job|, if any. Must be called with the
+// pool lock held, which is dropped while working. Returns 0 if there was
+// nothing left to do for the calling thread.
+static int sl_copy_job_step(struct sl_copy_pool* pool, struct sl_copy_job* job) {
+  struct sl_mmap* mmap = job->buffer->mmap;
+  int band;
+
+  if (!job->started) {
+    uint64_t start_usec;
+
+    if (job->starting)
+      return 0;
+
+    job->starting = 1;
+    pthread_mutex_unlock(&pool->mutex);
+    start_usec = sl_now_usec();
+    if (mmap->begin_write)
+      mmap->begin_write(mmap->fd);
+    pthread_mutex_lock(&pool->mutex);
+    job->write_usec += sl_now_usec() - start_usec;
+    job->started = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    return 1;
+  }
+
+  if (job->next_band == job->num_bands)
+    return 0;
+
+  band = job->next_band++;
+  pthread_mutex_unlock(&pool->mutex);
+  sl_copy_job_copy_band(job, band);
+  pthread_mutex_lock(&pool->mutex);
+
+  if (++job->done_bands == job->num_bands) {
+    uint64_t value = 1;
+    uint64_t start_usec;
+    ssize_t rv;
+
+    pthread_mutex_unlock(&pool->mutex);
+    start_usec = sl_now_usec();
+    if (mmap->end_write)
+      mmap->end_write(mmap->fd);
+    pthread_mutex_lock(&pool->mutex);
+    job->write_usec += sl_now_usec() - start_usec;
+
+    job->complete = 1;
+    wl_list_remove(&job->link);
+    wl_list_insert(pool->completed.prev, &job->link);
+    pthread_cond_broadcast(&pool->done_cond);
+
+    rv = write(pool->event_fd, &value, sizeof(value));
+    UNUSED(rv);
+  }
+  return 1;
+}
+
+static void* sl_copy_pool_thread(void* data) {
+  struct sl_copy_pool* pool = (struct sl_copy_pool*)data;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (1) {
+    struct sl_copy_job* job;
+    int worked = 0;
+
+    wl_list_for_each(job, &pool->jobs, link) {
+      if (sl_copy_job_step(pool, job)) {
+        worked = 1;
+        break;
+      }
+    }
+    if (!worked)
+      pthread_cond_wait(&pool->work_cond, &pool->mutex);
+  }
+
+  return NULL;
+}
+
+static void sl_copy_job_finish(struct sl_copy_job* job) {
+  struct sl_host_surface* host = job->host;
+
+  host->copy_job = NULL;
+  host->ctx->stats.write_usec += job->write_usec;
+  sl_mmap_unref(job->src);
+  free(job->rects);
+  free(job);
+
+  sl_host_surface_commit_contents(host);
+}
+
+static int sl_handle_copy_pool_event(int fd, uint32_t mask, void* data) {
+  struct sl_copy_pool* pool = (struct sl_copy_pool*)data;
+  struct wl_list completed;
+  uint64_t value;
+  ssize_t rv;
+
+  rv = read(fd, &value, sizeof(value));
+  UNUSED(rv);
+
+  wl_list_init(&completed);
+  pthread_mutex_lock(&pool->mutex);
+  wl_list_insert_list(&completed, &pool->completed);
+  wl_list_init(&pool->completed);
+  pthread_mutex_unlock(&pool->mutex);
+
+  while (!wl_list_empty(&completed)) {
+    struct sl_copy_job* job =
+        wl_container_of(completed.next, job, link);
+
+    wl_list_remove(&job->link);
+    sl_copy_job_finish(job);
+  }
+
+  return 1;
+}
+
+static struct sl_copy_pool* sl_copy_pool_create(struct sl_context* ctx) {
+  struct sl_copy_pool* pool;
+  int i, rv;
+
+  pool = malloc(sizeof(*pool));
+  assert(pool);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  wl_list_init(&pool->jobs);
+  wl_list_init(&pool->completed);
+  pool->num_threads = ctx->copy_threads;
+  pool->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  assert(pool->event_fd >= 0);
+  pool->event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), pool->event_fd,
+      WL_EVENT_READABLE, sl_handle_copy_pool_event, pool);
+
+  for (i = 0; i < pool->num_threads; ++i) {
+    pthread_t thread;
+
+    rv = pthread_create(&thread, NULL, sl_copy_pool_thread, pool);
+    assert(!rv);
+    pthread_detach(thread);
+  }
+  UNUSED(rv);
+
+  return pool;
+}
+
+// Hands the copy of |damage| into |buffer| to the copy threads. The damage is
+// split into bands of rows so multiple threads can work on it.
+static void sl_copy_pool_queue(struct sl_host_surface* host,
+                               struct sl_output_buffer* buffer,
+                               pixman_region32_t* damage) {
+  struct sl_context* ctx = host->ctx;
+  pixman_box32_t* extents = pixman_region32_extents(damage);
+  pixman_box32_t* rects;
+  struct sl_copy_job* job;
+  int32_t height = extents->y2 - extents->y1;
+  int num_bands;
+  int n;
+
+  if (!ctx->copy_pool)
+    ctx->copy_pool = sl_copy_pool_create(ctx);
+
+  rects = pixman_region32_rectangles(damage, &n);
+
+  job = malloc(sizeof(*job));
+  assert(job);
+  job->host = host;
+  job->buffer = buffer;
+  job->src = sl_mmap_ref(host->contents_shm_mmap);
+  job->rects = malloc(sizeof(pixman_box32_t) * n);
+  assert(job->rects);
+  memcpy(job->rects, rects, sizeof(pixman_box32_t) * n);
+  job->num_rects = n;
+
+  // Use a couple of bands per thread to balance the load. Band boundaries
+  // are aligned, starting from an aligned first row, so that subsampled
+  // planes never share rows between bands.
+  num_bands = ctx->copy_pool->num_threads * 2;
+  job->y1 = extents->y1 & ~(COPY_BAND_ALIGNMENT - 1);
+  height = extents->y2 - job->y1;
+  job->band_height = (height + num_bands - 1) / num_bands;
+  job->band_height = (job->band_height + COPY_BAND_ALIGNMENT - 1) &
+                     ~(COPY_BAND_ALIGNMENT - 1);
+  job->num_bands = (height + job->band_height - 1) / job->band_height;
+  job->next_band = 0;
+  job->done_bands = 0;
+  job->starting = 0;
+  job->started = 0;
+  job->complete = 0;
+  job->write_usec = 0;
+  host->copy_job = job;
+
+  pthread_mutex_lock(&ctx->copy_pool->mutex);
+  wl_list_insert(ctx->copy_pool->jobs.prev, &job->link);
+  pthread_cond_broadcast(&ctx->copy_pool->work_cond);
+  pthread_mutex_unlock(&ctx->copy_pool->mutex);
+}
+
+static void sl_host_surface_finish_copy(struct sl_host_surface* host) {
+  struct sl_copy_job* job = host->copy_job;
+  struct sl_copy_pool* pool;
+
+  if (!job)
+    return;
+
+  // Help out with the remaining bands instead of just waiting.
+  pool = host->ctx->copy_pool;
+  pthread_mutex_lock(&pool->mutex);
+  while (!job->complete) {
+    if (!sl_copy_job_step(pool, job))
+      pthread_cond_wait(&pool->done_cond, &pool->mutex);
+  }
+  wl_list_remove(&job->link);
+  pthread_mutex_unlock(&pool->mutex);
+
+  sl_copy_job_finish(job);
+}
+
+static void sl_host_surface_apply_commit(struct sl_host_surface* host) {
   struct sl_viewport* viewport = NULL;
-  struct sl_window* window;
+  int damage_tiles_updated = 0;
 
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
 
-  if (host->contents_shm_mmap) {
-    uint8_t* src_addr = host->contents_shm_mmap->addr;
-    uint8_t* dst_addr = host->current_buffer->mmap->addr;
-    size_t* src_offset = host->contents_shm_mmap->offset;
-    size_t* dst_offset = host->current_buffer->mmap->offset;
-    size_t* src_stride = host->contents_shm_mmap->stride;
-    size_t* dst_stride = host->current_buffer->mmap->stride;
-    size_t* y_ss = host->contents_shm_mmap->y_ss;
-    size_t bpp = host->contents_shm_mmap->bpp;
-    size_t num_planes = host->contents_shm_mmap->num_planes;
+  if (host->cursor_attach) {
+    sl_host_surface_attach_cursor(host);
+  } else if (host->contents_shm_mmap) {
+    struct sl_output_buffer* buffer = host->current_buffer;
     double contents_scale_x = host->contents_scale;
     double contents_scale_y = host->contents_scale;
     double contents_offset_x = 0.0;
     double contents_offset_y = 0.0;
+    pixman_region32_t damage;
+    size_t damage_area, copy_size;
     pixman_box32_t* rect;
     int n;
 
@@ -505,10 +1405,8 @@ static void sl_host_surface_commit(struct wl_client* client,
       }
     }
 
-    if (host->current_buffer->mmap->begin_write)
-      host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd);
-
-    rect = pixman_region32_rectangles(&host->current_buffer->damage, &n);
+    pixman_region32_init(&damage);
+    rect = pixman_region32_rectangles(&buffer->damage, &n);
     while (n--) {
       int32_t x1, y1, x2, y2;
 
@@ -523,45 +1421,123 @@ static void sl_host_surface_commit(struct wl_client* client,
       x2 = MIN(host->contents_width, x2);
       y2 = MIN(host->contents_height, y2);
 
-      if (x1 < x2 && y1 < y2) {
-        size_t i;
-
-        for (i = 0; i < num_planes; ++i) {
-          uint8_t* src_base = src_addr + src_offset[i];
-          uint8_t* dst_base = dst_addr + dst_offset[i];
-          uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
-          uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
-          int32_t width = x2 - x1;
-          int32_t height = (y2 - y1) / y_ss[i];
-          size_t bytes = width * bpp;
-
-          while (height--) {
-            memcpy(dst, src, bytes);
-            dst += dst_stride[i];
-            src += src_stride[i];
-          }
-        }
-      }
+      if (x1 < x2 && y1 < y2)
+        pixman_region32_union_rect(&damage, &damage, x1, y1, x2 - x1, y2 - y1);
 
       ++rect;
     }
 
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd);
+    if (buffer->tile_hashes) {
+      pixman_region32_t host_damage;
+
+      pixman_region32_init(&host_damage);
+      sl_damage_tiles_update(host, buffer, &damage, &host_damage);
+
+      // Forward changed tiles in surface coordinates.
+      rect = pixman_region32_rectangles(&host_damage, &n);
+      while (n--) {
+        sl_host_surface_forward_damage(
+            host, (rect->x1 - contents_offset_x) / contents_scale_x,
+            (rect->y1 - contents_offset_y) / contents_scale_y,
+            ceil((rect->x2 - contents_offset_x) / contents_scale_x),
+            ceil((rect->y2 - contents_offset_y) / contents_scale_y));
+        ++rect;
+      }
+      pixman_region32_fini(&host_damage);
+      pixman_region32_clear(&host->damage);
+      damage_tiles_updated = 1;
+    }
+
+    // Pooled buffers of the same size might have been created for contents
+    // that differ by a pixel.
+    buffer->copy_target.src_width = host->contents_width;
+    buffer->copy_target.src_height = host->contents_height;
+
+    damage_area = sl_region_size(&damage, 1);
+    copy_size = damage_area * host->contents_shm_mmap->bpp /
+                (buffer->downscale * buffer->downscale);
+    host->damage_area += damage_area;
+    host->bytes_copied += copy_size;
+    host->ctx->stats.damage_area += damage_area;
+    host->ctx->stats.bytes_copied += copy_size;
+
+    // Large copies are handed to the copy threads, and the commit completes
+    // from the main loop once they are done.
+    // Buffers mapped through GBM are always copied on the main thread, and
+    // so are the contents of subsurface trees to keep commit order.
+    if (host->ctx->copy_threads && copy_size >= ASYNC_COPY_MIN_SIZE &&
+        !buffer->bo && !host->in_subsurface_tree) {
+      sl_copy_pool_queue(host, buffer, &damage);
+    } else if (pixman_region32_not_empty(&damage)) {
+      uint64_t start_usec = sl_now_usec();
+      uint64_t write_usec;
+      void* map_data = NULL;
+
+      if (buffer->bo)
+        map_data = sl_output_buffer_map(buffer, &damage);
+      if (buffer->mmap->begin_write)
+        buffer->mmap->begin_write(buffer->mmap->fd);
+      write_usec = sl_now_usec() - start_usec;
+
+      rect = pixman_region32_rectangles(&damage, &n);
+      while (n--) {
+        buffer->copy_rect(&buffer->copy_target, host->contents_shm_mmap,
+                          rect->x1, rect->y1, rect->x2, rect->y2);
+        ++rect;
+      }
+
+      start_usec = sl_now_usec();
+      if (buffer->mmap->end_write)
+        buffer->mmap->end_write(buffer->mmap->fd);
+      if (buffer->bo)
+        gbm_bo_unmap(buffer->bo, map_data);
+      write_usec += sl_now_usec() - start_usec;
+      host->ctx->stats.write_usec += write_usec;
+    }
+
+    pixman_region32_fini(&damage);
+    pixman_region32_clear(&buffer->damage);
+
+    wl_list_remove(&buffer->link);
+    wl_list_insert(&host->busy_buffers, &buffer->link);
+    buffer->busy = 1;
+    host->ctx->stats.busy_buffers_max =
+        MAX(host->ctx->stats.busy_buffers_max,
+            (uint64_t)wl_list_length(&host->busy_buffers));
+  }
 
-    pixman_region32_clear(&host->current_buffer->damage);
+  // Forward damage that was held back but not reduced by tile hashing. The
+  // host no longer shows contents matching the tile hashes after this.
+  if (host->ctx->damage_tiles && !damage_tiles_updated) {
+    pixman_box32_t* rect;
+    int n;
 
-    wl_list_remove(&host->current_buffer->link);
-    wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+    rect = pixman_region32_rectangles(&host->damage, &n);
+    while (n--) {
+      sl_host_surface_forward_damage(host, rect->x1, rect->y1, rect->x2,
+                                     rect->y2);
+      ++rect;
+    }
+    pixman_region32_clear(&host->damage);
+    free(host->tile_hashes);
+    host->tile_hashes = NULL;
   }
 
   if (host->contents_width && host->contents_height) {
     double scale = host->ctx->scale * host->contents_scale;
+    int cropped = host->current_buffer && host->current_buffer->bucket;
 
     if (host->viewport) {
       int width = host->contents_width;
       int height = host->contents_height;
 
+      if (host->viewport_cropped && !cropped) {
+        wp_viewport_set_source(host->viewport, wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+                               wl_fixed_from_int(-1));
+        host->viewport_cropped = 0;
+      }
+
       // We need to take the client's viewport into account while still
       // making sure our scale is accounted for.
       if (viewport) {
@@ -590,50 +1566,141 @@ static void sl_host_surface_commit(struct wl_client* client,
     } /* else {
       wl_surface_set_buffer_scale(host->proxy, scale);
     } */
+
+    // Reduced resolution buffers are scaled to the destination size alone.
+    // Their size doesn't have to be a multiple of the buffer scale.
+    if (host->current_buffer && host->current_buffer->downscale > 1)
+      scale = 1;
     wl_surface_set_buffer_scale(host->proxy, scale);
+
+    // Crop bucketed buffers to the contents. The source rectangle is in
+    // buffer pixels divided by the buffer scale.
+    if (cropped) {
+      int32_t buffer_scale = MAX(1, (int32_t)scale);
+
+      wp_viewport_set_source(
+          host->viewport, wl_fixed_from_int(0), wl_fixed_from_int(0),
+          wl_fixed_from_double((double)host->contents_width / buffer_scale),
+          wl_fixed_from_double((double)host->contents_height / buffer_scale));
+      host->viewport_cropped = 1;
+    }
   }
 
-  // No need to defer client commits if surface has a role. E.g. is a cursor
-  // or shell surface.
-  if (host->has_role) {
-    wl_surface_commit(host->proxy);
+  if (!host->copy_job)
+    sl_host_surface_commit_contents(host);
+}
 
-    // GTK determines the scale based on the output the surface has entered.
-    // If the surface has not entered any output, then have it enter the
-    // internal output. TODO(reveman): Remove this when surface-output tracking
-    // has been implemented in Chrome.
-    if (!host->has_output) {
-      struct sl_host_output* output;
+// Attaches an output buffer for contents whose attach was deferred.
+static void sl_host_surface_attach_mailbox(struct sl_host_surface* host) {
+  host->mailbox_attach = 0;
+  sl_host_surface_acquire_output_buffer(host);
+  wl_surface_attach(host->proxy, host->current_buffer->internal,
+                    host->mailbox_x, host->mailbox_y);
+}
 
-      wl_list_for_each(output, &host->ctx->host_outputs, link) {
-        if (output->internal) {
-          wl_surface_send_enter(host->resource, output->resource);
-          host->has_output = 1;
-          break;
-        }
-      }
+static void sl_host_surface_present_mailbox(struct sl_host_surface* host) {
+  host->mailbox_pending = 0;
+  sl_host_surface_attach_mailbox(host);
+
+  // Damage forwarded while the frame was held back might have been consumed
+  // by other host commits. Forward all damage the buffer is missing again.
+  if (!host->ctx->damage_tiles) {
+    pixman_box32_t* rect;
+    int n;
+
+    rect = pixman_region32_rectangles(&host->current_buffer->damage, &n);
+    while (n--) {
+      sl_host_surface_forward_damage(host, rect->x1, rect->y1, rect->x2,
+                                     rect->y2);
+      ++rect;
     }
-  } else {
-    // Commit if surface is associated with a window. Otherwise, defer
-    // commit until window is created.
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
-      }
+  }
+
+  sl_host_surface_apply_commit(host);
+}
+
+// Completes a commit once contents are ready to be used by the host.
+static void sl_host_surface_commit_ready(struct sl_host_surface* host) {
+  // Contents of a held back frame are still current. Damage and frame
+  // callbacks of this commit are applied once that frame is presented.
+  if (host->mailbox_pending)
+    return;
+
+  // Hold back the frame until the host releases a buffer. A newer frame
+  // replaces it in the meantime.
+  if (host->mailbox_attach) {
+    if (sl_host_surface_mailbox_full(host)) {
+      host->mailbox_pending = 1;
+      return;
     }
+    sl_host_surface_attach_mailbox(host);
   }
 
-  if (host->contents_shm_mmap) {
-    if (host->contents_shm_mmap->buffer_resource)
-      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
-    sl_mmap_unref(host->contents_shm_mmap);
-    host->contents_shm_mmap = NULL;
+  sl_host_surface_apply_commit(host);
+}
+
+static void sl_host_surface_fence_signaled(struct sl_host_surface* host) {
+  wl_event_source_remove(host->fence_source);
+  host->fence_source = NULL;
+  close(host->fence_fd);
+  host->fence_fd = -1;
+
+  sl_host_surface_commit_ready(host);
+}
+
+static int sl_handle_host_surface_fence(int fd, uint32_t mask, void* data) {
+  struct sl_host_surface* host = (struct sl_host_surface*)data;
+
+  sl_host_surface_fence_signaled(host);
+  return 1;
+}
+
+void sl_host_surface_finish_commit(struct sl_host_surface* host) {
+  // Another request has to be ordered after the pending commit, so wait for
+  // rendering to complete before forwarding it. Host configure events and
+  // window updates get here independent of client pacing. The wait is
+  // bounded so that a fence that never signals can't stall the event loop
+  // for good.
+  if (host->fence_source) {
+    struct pollfd fds = {.fd = host->fence_fd, .events = POLLIN};
+    int rv;
+
+    do {
+      rv = poll(&fds, 1, FENCE_WAIT_TIMEOUT_MS);
+    } while (rv == -1 && errno == EINTR);
+
+    sl_host_surface_fence_signaled(host);
+  }
+
+  sl_host_surface_finish_copy(host);
+}
+
+static void sl_host_surface_commit(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_surface* host = wl_resource_get_user_data(resource);
+  uint64_t start_usec = sl_now_usec();
+
+  sl_host_surface_finish_commit(host);
+
+  host->commits++;
+  host->ctx->stats.commits++;
+  host->last_commit_usec = start_usec;
+  wl_list_remove(&host->link);
+  wl_list_insert(&host->ctx->host_surfaces, &host->link);
+
+  // Forward commit from the event loop once rendering to the buffer has
+  // completed.
+  if (host->contents_fence_fd >= 0) {
+    host->fence_fd = host->contents_fence_fd;
+    host->contents_fence_fd = -1;
+    host->fence_source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(host->ctx->host_display), host->fence_fd,
+        WL_EVENT_READABLE, sl_handle_host_surface_fence, host);
+  } else {
+    sl_host_surface_commit_ready(host);
   }
+
+  sl_trace_event(host->ctx, "wayland", "commit", start_usec, sl_now_usec());
 }
 
 static void sl_host_surface_set_buffer_transform(struct wl_client* client,
@@ -641,6 +1708,8 @@ static void sl_host_surface_set_buffer_transform(struct wl_client* client,
                                                  int32_t transform) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
 
+  sl_host_surface_finish_commit(host);
+
   wl_surface_set_buffer_transform(host->proxy, transform);
 }
 
@@ -649,6 +1718,8 @@ static void sl_host_surface_set_buffer_scale(struct wl_client* client,
                                              int32_t scale) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
 
+  sl_host_surface_finish_commit(host);
+
   host->contents_scale = scale;
 }
 
@@ -675,31 +1746,38 @@ static const struct wl_surface_interface sl_surface_implementation = {
 
 static void sl_destroy_host_surface(struct wl_resource* resource) {
   struct sl_host_surface* host = wl_resource_get_user_data(resource);
-  struct sl_window *window, *surface_window = NULL;
+  struct sl_window* surface_window = host->window;
   struct sl_output_buffer* buffer;
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
+  // No need to wait for rendering to contents that are never shown.
+  if (host->fence_source) {
+    wl_event_source_remove(host->fence_source);
+    host->fence_source = NULL;
+    close(host->fence_fd);
+    host->fence_fd = -1;
   }
+  if (host->contents_fence_fd >= 0)
+    close(host->contents_fence_fd);
+
+  sl_host_surface_finish_commit(host);
 
   if (surface_window) {
-    surface_window->host_surface_id = 0;
+    sl_window_set_host_surface_id(surface_window, 0);
     sl_window_update(surface_window);
   }
 
   if (host->contents_shm_mmap)
     sl_mmap_unref(host->contents_shm_mmap);
+  pixman_region32_fini(&host->damage);
+  free(host->tile_hashes);
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_pool_put(host->ctx, buffer);
   }
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_pool_put(host->ctx, buffer);
   }
   while (!wl_list_empty(&host->contents_viewport))
     wl_list_remove(host->contents_viewport.next);
@@ -707,6 +1785,7 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   if (host->viewport)
     wp_viewport_destroy(host->viewport);
   wl_surface_destroy(host->proxy);
+  wl_list_remove(&host->link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
 }
@@ -790,7 +1869,7 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
                                               uint32_t id) {
   struct sl_host_compositor* host = wl_resource_get_user_data(resource);
   struct sl_host_surface* host_surface;
-  struct sl_window *window, *unpaired_window = NULL;
+  struct sl_window* unpaired_window;
 
   host_surface = malloc(sizeof(*host_surface));
   assert(host_surface);
@@ -801,12 +1880,35 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->contents_scale = 1;
   wl_list_init(&host_surface->contents_viewport);
   host_surface->contents_shm_mmap = NULL;
+  host_surface->contents_shm_format = 0;
+  host_surface->contents_downscale = 1;
+  host_surface->contents_bucket = 0;
+  host_surface->viewport_cropped = 0;
+  // X11 windows are matched by their WM_CLASS once paired.
+  host_surface->low_resolution =
+      !host->compositor->ctx->xwayland &&
+      sl_low_resolution_match(host->compositor->ctx, NULL);
   host_surface->has_role = 0;
+  host_surface->is_cursor = 0;
+  host_surface->cursor_attach = 0;
   host_surface->has_output = 0;
   host_surface->last_event_serial = 0;
   host_surface->current_buffer = NULL;
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  pixman_region32_init(&host_surface->damage);
+  host_surface->tile_hashes = NULL;
+  host_surface->tile_hashes_width = 0;
+  host_surface->tile_hashes_height = 0;
+  host_surface->copy_job = NULL;
+  host_surface->in_subsurface_tree = 0;
+  host_surface->mailbox_attach = 0;
+  host_surface->mailbox_x = 0;
+  host_surface->mailbox_y = 0;
+  host_surface->mailbox_pending = 0;
+  host_surface->contents_fence_fd = -1;
+  host_surface->fence_fd = -1;
+  host_surface->fence_source = NULL;
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
@@ -822,15 +1924,16 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
         host_surface->ctx->viewporter->internal, host_surface->proxy);
   }
 
-  wl_list_for_each(window, &host->compositor->ctx->unpaired_windows, link) {
-    if (window->host_surface_id == id) {
-      unpaired_window = window;
-      break;
-    }
-  }
-
-  if (unpaired_window)
-    sl_window_update(window);
+  host_surface->window = NULL;
+  wl_list_insert(&host_surface->ctx->host_surfaces, &host_surface->link);
+  host_surface->last_commit_usec = sl_now_usec();
+  host_surface->commits = 0;
+  host_surface->damage_area = 0;
+  host_surface->bytes_copied = 0;
+  unpaired_window =
+      sl_lookup_window_by_host_surface_id(host_surface->ctx, id);
+  if (unpaired_window && unpaired_window->unpaired)
+    sl_window_update(unpaired_window);
 }
 
 static void sl_compositor_create_host_region(struct wl_client* client,
@@ -889,3 +1992,79 @@ struct sl_global* sl_compositor_global_create(struct sl_context* ctx) {
                           ctx->compositor->version, ctx,
                           sl_bind_host_compositor);
 }
+
+// Frees the output buffers of |host| that the host has released, except for
+// one that is attached for the next commit.
+static void sl_host_surface_trim_buffers(struct sl_host_surface* host) {
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* next;
+
+  wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+    if (buffer == host->current_buffer)
+      continue;
+
+    sl_output_buffer_destroy(host->ctx, buffer);
+    host->ctx->stats.output_buffers_trimmed++;
+  }
+}
+
+static int sl_compositor_over_budget(struct sl_context* ctx) {
+  return ctx->buffer_budget && ctx->output_buffer_size > ctx->buffer_budget;
+}
+
+// Frees output buffers that exceed the limits set by --idle-buffer-timeout
+// and --buffer-budget, or all buffers that aren't needed right away under
+// |memory_pressure|. Buffers of destroyed surfaces go first, followed by
+// cached cursor images and released buffers of the least recently committed
+// surfaces. Buffers held by the host are never freed.
+void sl_compositor_trim_buffers(struct sl_context* ctx, int memory_pressure) {
+  uint64_t now = sl_now_usec();
+  struct sl_host_surface* host;
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* prev;
+
+  wl_list_for_each_reverse_safe(buffer, prev, &ctx->output_buffer_pool, link) {
+    if (!memory_pressure && !sl_compositor_over_budget(ctx))
+      break;
+    if (buffer->busy)
+      continue;
+
+    ctx->output_buffer_pool_size -= buffer->mmap->size;
+    sl_output_buffer_destroy(ctx, buffer);
+    ctx->stats.output_buffers_trimmed++;
+  }
+
+  // The most recently used cursor image is likely the one the host shows.
+  while (ctx->cursor_buffer_count > 1 &&
+         (memory_pressure || sl_compositor_over_budget(ctx))) {
+    struct sl_output_buffer* oldest =
+        wl_container_of(ctx->cursor_buffers.prev, oldest, link);
+
+    sl_output_buffer_destroy(ctx, oldest);
+    ctx->cursor_buffer_count--;
+    ctx->stats.output_buffers_trimmed++;
+  }
+
+  wl_list_for_each_reverse(host, &ctx->host_surfaces, link) {
+    int idle = ctx->idle_buffer_timeout &&
+               now - host->last_commit_usec >=
+                   (uint64_t)ctx->idle_buffer_timeout * 1000;
+    int over_budget = sl_compositor_over_budget(ctx);
+
+    // Surfaces are ordered by last commit so none of the remaining ones are
+    // idle either.
+    if (!idle && !over_budget && !memory_pressure)
+      break;
+
+    // Contents of a commit that is still in progress are needed.
+    if (host->copy_job || host->fence_source || host->mailbox_pending)
+      continue;
+
+    sl_host_surface_trim_buffers(host);
+
+    // Give the host a chance to release memory before trimming surfaces
+    // that are still in use.
+    if (memory_pressure && !idle)
+      break;
+  }
+}
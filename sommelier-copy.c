@@ -0,0 +1,451 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/virtwl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define DMA_BUF_SYNC_READ (1 << 0)
+#define DMA_BUF_SYNC_WRITE (2 << 0)
+#define DMA_BUF_SYNC_RW (DMA_BUF_SYNC_READ | DMA_BUF_SYNC_WRITE)
+#define DMA_BUF_SYNC_START (0 << 2)
+#define DMA_BUF_SYNC_END (1 << 2)
+
+#define DMA_BUF_BASE 'b'
+#define DMA_BUF_IOCTL_SYNC _IOW(DMA_BUF_BASE, 0, struct dma_buf_sync)
+
+// Damaged rects at least this large are copied with streaming stores when
+// the output buffer mapping is write-combined.
+#define STREAM_COPY_MIN_SIZE (64 * 1024)
+
+struct dma_buf_sync {
+  __u64 flags;
+};
+
+static void sl_dmabuf_sync(int fd, __u64 flags) {
+  struct dma_buf_sync sync = {0};
+  int rv;
+
+  sync.flags = flags;
+  do {
+    rv = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+  } while (rv == -1 && errno == EINTR);
+}
+
+void sl_dmabuf_begin_write(int fd) {
+  sl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+}
+
+void sl_dmabuf_end_write(int fd) {
+  sl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+static void sl_virtwl_dmabuf_sync(int fd, __u32 flags) {
+  struct virtwl_ioctl_dmabuf_sync sync = {0};
+  int rv;
+
+  sync.flags = flags;
+  rv = ioctl(fd, VIRTWL_IOCTL_DMABUF_SYNC, &sync);
+  assert(!rv);
+  UNUSED(rv);
+}
+
+void sl_virtwl_dmabuf_begin_write(int fd) {
+  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+}
+
+void sl_virtwl_dmabuf_end_write(int fd) {
+  sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+}
+
+size_t sl_shm_bpp_for_shm_format(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_NV12:
+      return 1;
+    case WL_SHM_FORMAT_RGB565:
+      return 2;
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_XBGR8888:
+      return 4;
+  }
+  assert(0);
+  return 0;
+}
+
+size_t sl_shm_num_planes_for_shm_format(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_NV12:
+      return 2;
+    case WL_SHM_FORMAT_RGB565:
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_XBGR8888:
+      return 1;
+  }
+  assert(0);
+  return 0;
+}
+
+static void sl_copy_plane_memcpy(uint8_t* dst,
+                                 size_t dst_stride,
+                                 const uint8_t* src,
+                                 size_t src_stride,
+                                 size_t bytes,
+                                 size_t rows) {
+  while (rows--) {
+    memcpy(dst, src, bytes);
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Row copies using non-temporal stores. These avoid pulling the destination
+// into the cache, which only hurts when writing to write-combined memory.
+// Unaligned head and tail bytes are handled with memcpy.
+__attribute__((target("sse2"))) static void sl_copy_plane_stream_sse2(
+    uint8_t* dst,
+    size_t dst_stride,
+    const uint8_t* src,
+    size_t src_stride,
+    size_t bytes,
+    size_t rows) {
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = MIN(n, -(uintptr_t)d & 15);
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    while (n >= 64) {
+      __m128i a = _mm_loadu_si128((const __m128i*)s);
+      __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+      __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+      __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+
+      _mm_stream_si128((__m128i*)d, a);
+      _mm_stream_si128((__m128i*)(d + 16), b);
+      _mm_stream_si128((__m128i*)(d + 32), c);
+      _mm_stream_si128((__m128i*)(d + 48), e);
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    while (n >= 16) {
+      _mm_stream_si128((__m128i*)d, _mm_loadu_si128((const __m128i*)s));
+      d += 16;
+      s += 16;
+      n -= 16;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+  _mm_sfence();
+}
+
+__attribute__((target("avx2"))) static void sl_copy_plane_stream_avx2(
+    uint8_t* dst,
+    size_t dst_stride,
+    const uint8_t* src,
+    size_t src_stride,
+    size_t bytes,
+    size_t rows) {
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+    size_t head = MIN(n, -(uintptr_t)d & 31);
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    while (n >= 128) {
+      __m256i a = _mm256_loadu_si256((const __m256i*)s);
+      __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+      __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+      __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+
+      _mm256_stream_si256((__m256i*)d, a);
+      _mm256_stream_si256((__m256i*)(d + 32), b);
+      _mm256_stream_si256((__m256i*)(d + 64), c);
+      _mm256_stream_si256((__m256i*)(d + 96), e);
+      d += 128;
+      s += 128;
+      n -= 128;
+    }
+    while (n >= 32) {
+      _mm256_stream_si256((__m256i*)d, _mm256_loadu_si256((const __m256i*)s));
+      d += 32;
+      s += 32;
+      n -= 32;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+  _mm_sfence();
+}
+#elif defined(__ARM_NEON)
+// NEON has no non-temporal store intrinsic, but full 64 byte bursts still
+// fill complete write-combining lines instead of partial ones.
+static void sl_copy_plane_stream_neon(uint8_t* dst,
+                                      size_t dst_stride,
+                                      const uint8_t* src,
+                                      size_t src_stride,
+                                      size_t bytes,
+                                      size_t rows) {
+  while (rows--) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t n = bytes;
+
+    while (n >= 64) {
+      uint8x16_t a = vld1q_u8(s);
+      uint8x16_t b = vld1q_u8(s + 16);
+      uint8x16_t c = vld1q_u8(s + 32);
+      uint8x16_t e = vld1q_u8(s + 48);
+
+      vst1q_u8(d, a);
+      vst1q_u8(d + 16, b);
+      vst1q_u8(d + 32, c);
+      vst1q_u8(d + 48, e);
+      d += 64;
+      s += 64;
+      n -= 64;
+    }
+    memcpy(d, s, n);
+
+    dst += dst_stride;
+    src += src_stride;
+  }
+}
+#endif
+
+sl_copy_plane_func_t sl_stream_copy_plane_func(void) {
+  static sl_copy_plane_func_t func;
+
+  if (func)
+    return func;
+
+  func = sl_copy_plane_memcpy;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    func = sl_copy_plane_stream_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    func = sl_copy_plane_stream_sse2;
+#elif defined(__ARM_NEON)
+  func = sl_copy_plane_stream_neon;
+#endif
+  return func;
+}
+
+static inline void sl_copy_plane(struct sl_copy_target* target,
+                                 uint8_t* dst,
+                                 size_t dst_stride,
+                                 const uint8_t* src,
+                                 size_t src_stride,
+                                 size_t bytes,
+                                 size_t rows,
+                                 int full_rows) {
+  // Rows are contiguous when the damage spans full rows and both buffers
+  // use the same stride. Copy them as a single span.
+  if (full_rows && src_stride == dst_stride && rows > 1) {
+    bytes += (rows - 1) * src_stride;
+    rows = 1;
+  }
+
+  if (target->stream_plane && bytes * rows >= STREAM_COPY_MIN_SIZE)
+    target->stream_plane(dst, dst_stride, src, src_stride, bytes, rows);
+  else
+    sl_copy_plane_memcpy(dst, dst_stride, src, src_stride, bytes, rows);
+}
+
+static inline void sl_copy_rect_packed(struct sl_copy_target* target,
+                                       struct sl_mmap* src,
+                                       int32_t x1,
+                                       int32_t y1,
+                                       int32_t x2,
+                                       int32_t y2,
+                                       size_t bpp) {
+  struct sl_mmap* dst = target->mmap;
+  size_t src_stride = src->stride[0];
+  size_t dst_stride = dst->stride[0];
+
+  sl_copy_plane(
+      target,
+      (uint8_t*)dst->addr + dst->offset[0] + y1 * dst_stride + x1 * bpp,
+      dst_stride,
+      (uint8_t*)src->addr + src->offset[0] + y1 * src_stride + x1 * bpp,
+      src_stride, (x2 - x1) * bpp, y2 - y1,
+      x1 == 0 && x2 == (int32_t)target->width);
+}
+
+static void sl_copy_rect_32bpp(struct sl_copy_target* target,
+                               struct sl_mmap* src,
+                               int32_t x1,
+                               int32_t y1,
+                               int32_t x2,
+                               int32_t y2) {
+  sl_copy_rect_packed(target, src, x1, y1, x2, y2, 4);
+}
+
+static void sl_copy_rect_16bpp(struct sl_copy_target* target,
+                               struct sl_mmap* src,
+                               int32_t x1,
+                               int32_t y1,
+                               int32_t x2,
+                               int32_t y2) {
+  sl_copy_rect_packed(target, src, x1, y1, x2, y2, 2);
+}
+
+static void sl_copy_rect_nv12(struct sl_copy_target* target,
+                              struct sl_mmap* src,
+                              int32_t x1,
+                              int32_t y1,
+                              int32_t x2,
+                              int32_t y2) {
+  struct sl_mmap* dst = target->mmap;
+  int full_rows = x1 == 0 && x2 == (int32_t)target->width;
+
+  // Luma plane.
+  sl_copy_plane(target,
+                (uint8_t*)dst->addr + dst->offset[0] + y1 * dst->stride[0] + x1,
+                dst->stride[0],
+                (uint8_t*)src->addr + src->offset[0] + y1 * src->stride[0] + x1,
+                src->stride[0], x2 - x1, y2 - y1, full_rows);
+
+  // Interleaved chroma plane is subsampled by two in both directions. Round
+  // the rect out to whole chroma samples.
+  x1 &= ~1;
+  x2 = (x2 + 1) & ~1;
+  y1 /= 2;
+  y2 = (y2 + 1) / 2;
+  sl_copy_plane(target,
+                (uint8_t*)dst->addr + dst->offset[1] + y1 * dst->stride[1] + x1,
+                dst->stride[1],
+                (uint8_t*)src->addr + src->offset[1] + y1 * src->stride[1] + x1,
+                src->stride[1], x2 - x1, y2 - y1, full_rows);
+}
+
+static void sl_copy_rect_generic(struct sl_copy_target* target,
+                                 struct sl_mmap* src,
+                                 int32_t x1,
+                                 int32_t y1,
+                                 int32_t x2,
+                                 int32_t y2) {
+  struct sl_mmap* dst = target->mmap;
+  size_t bpp = src->bpp;
+  size_t i;
+
+  for (i = 0; i < src->num_planes; ++i) {
+    sl_copy_plane(
+        target,
+        (uint8_t*)dst->addr + dst->offset[i] + y1 * dst->stride[i] + x1 * bpp,
+        dst->stride[i],
+        (uint8_t*)src->addr + src->offset[i] + y1 * src->stride[i] + x1 * bpp,
+        src->stride[i], (x2 - x1) * bpp, (y2 - y1) / src->y_ss[i], 0);
+  }
+}
+
+sl_copy_rect_func_t sl_copy_rect_func_for_shm_format(uint32_t format,
+                                                     struct sl_mmap* mmap) {
+  switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_XBGR8888:
+      return sl_copy_rect_32bpp;
+    case WL_SHM_FORMAT_RGB565:
+      return sl_copy_rect_16bpp;
+    case WL_SHM_FORMAT_NV12:
+      if (mmap->num_planes == 2)
+        return sl_copy_rect_nv12;
+      break;
+  }
+  return sl_copy_rect_generic;
+}
+
+
+// Averages a 2x2 block of 32 bit pixels. All four channels are 8 bits so two
+// of them can be summed at a time without overflowing into each other.
+static inline uint32_t sl_average_32bpp(uint32_t a,
+                                        uint32_t b,
+                                        uint32_t c,
+                                        uint32_t d) {
+  uint32_t lo = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) +
+                (d & 0x00ff00ff);
+  uint32_t hi = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+                ((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff);
+
+  return (((lo + 0x00020002) >> 2) & 0x00ff00ff) |
+         ((((hi + 0x00020002) >> 2) & 0x00ff00ff) << 8);
+}
+
+// Writes the half resolution version of the source rect. Destination pixels
+// that are partially covered by the rect are recomputed from all of their
+// source pixels.
+static void sl_downscale_rect_32bpp(struct sl_copy_target* target,
+                                    struct sl_mmap* src,
+                                    int32_t x1,
+                                    int32_t y1,
+                                    int32_t x2,
+                                    int32_t y2) {
+  struct sl_mmap* dst = target->mmap;
+  int32_t src_x_max = target->src_width - 1;
+  int32_t src_y_max = target->src_height - 1;
+  int32_t dx1 = x1 / 2;
+  int32_t dx2 = (x2 + 1) / 2;
+  int32_t dy;
+
+  for (dy = y1 / 2; dy < (y2 + 1) / 2; ++dy) {
+    const uint8_t* src_base = (uint8_t*)src->addr + src->offset[0];
+    const uint32_t* row0 =
+        (const uint32_t*)(src_base + dy * 2 * src->stride[0]);
+    const uint32_t* row1 = (const uint32_t*)(src_base +
+                                             MIN(dy * 2 + 1, src_y_max) *
+                                                 src->stride[0]);
+    uint32_t* out = (uint32_t*)((uint8_t*)dst->addr + dst->offset[0] +
+                                dy * dst->stride[0]);
+    int32_t dx;
+
+    for (dx = dx1; dx < dx2; ++dx) {
+      int32_t sx0 = dx * 2;
+      int32_t sx1 = MIN(sx0 + 1, src_x_max);
+
+      out[dx] = sl_average_32bpp(row0[sx0], row0[sx1], row1[sx0], row1[sx1]);
+    }
+  }
+}
+
+sl_copy_rect_func_t sl_downscale_rect_func_for_shm_format(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XRGB8888:
+    case WL_SHM_FORMAT_XBGR8888:
+      return sl_downscale_rect_32bpp;
+  }
+  return NULL;
+}
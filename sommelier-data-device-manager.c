@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -38,12 +39,25 @@ struct sl_host_data_offer {
   struct wl_data_offer* proxy;
 };
 
+// Size of the ring buffer used when data can't be spliced.
+#define DATA_TRANSFER_BUFFER_SIZE (256 * 1024)
+
+// Maximum amount of data moved by one splice call. Limits the time spent
+// on a single transfer before returning to the event loop.
+#define DATA_TRANSFER_SPLICE_SIZE (1024 * 1024)
+
 struct sl_data_transfer {
   int read_fd;
   int write_fd;
+  // Set while data is moved with splice() between the fds.
+  int splice;
+  int reading;
+  int read_done;
+  // Ring buffer used when not splicing. |offset| is the position of the
+  // first byte not yet written and |bytes_left| the amount of buffered data.
   size_t offset;
   size_t bytes_left;
-  uint8_t data[4096];
+  uint8_t* data;
   struct wl_event_source* read_event_source;
   struct wl_event_source* write_event_source;
 };
@@ -55,52 +69,125 @@ static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
   wl_event_source_remove(transfer->write_event_source);
   close(transfer->read_fd);
   close(transfer->write_fd);
+  free(transfer->data);
   free(transfer);
 }
 
+// Listen for the events that allow the transfer to make progress.
+static void sl_data_transfer_update(struct sl_data_transfer* transfer,
+                                    int readable,
+                                    int writable) {
+  transfer->reading = readable;
+  wl_event_source_fd_update(transfer->read_event_source,
+                            readable ? WL_EVENT_READABLE : 0);
+  wl_event_source_fd_update(transfer->write_event_source,
+                            writable ? WL_EVENT_WRITABLE : 0);
+}
+
+static void sl_data_transfer_update_buffered(
+    struct sl_data_transfer* transfer) {
+  sl_data_transfer_update(
+      transfer,
+      !transfer->read_done &&
+          transfer->bytes_left < DATA_TRANSFER_BUFFER_SIZE,
+      transfer->bytes_left > 0);
+}
+
+// Moves data from the read fd to the write fd inside the kernel. Returns 0
+// when the fds don't support splicing.
+static int sl_data_transfer_splice(struct sl_data_transfer* transfer,
+                                   int writing) {
+  ssize_t rv;
+
+  rv = splice(transfer->read_fd, NULL, transfer->write_fd, NULL,
+              DATA_TRANSFER_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (rv > 0) {
+    // Keep going from read events as long as data can be moved.
+    sl_data_transfer_update(transfer, 1, 0);
+  } else if (rv < 0 && errno == EAGAIN) {
+    // Either there is no data to read or no room in the write pipe. Wait
+    // for the other end than the one that triggered this attempt.
+    sl_data_transfer_update(transfer, writing, !writing);
+  } else if (rv < 0 && (errno == EINVAL || errno == ENOSYS)) {
+    return 0;
+  } else {
+    // On EOF or error, end the transfer.
+    sl_data_transfer_destroy(transfer);
+  }
+
+  return 1;
+}
+
+// Switches a transfer that can't be spliced to the ring buffer.
+static void sl_data_transfer_start_buffered(
+    struct sl_data_transfer* transfer) {
+  transfer->splice = 0;
+  transfer->data = malloc(DATA_TRANSFER_BUFFER_SIZE);
+  assert(transfer->data);
+}
+
 static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
+  size_t tail, size;
+  ssize_t rv;
+
   if ((mask & WL_EVENT_READABLE) == 0) {
     assert(mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR));
 
     // Epoll (and therefore wl_event_loop) will notify listeners of errors and
     // hangups even if all other events are disabled. Therefore, at this point,
     // we don't know whether we didn't get a readable event because the fd has
-    // been exhausted, or because we aren't in the reading state and weren't
-    // listening for one. We can make the distinction be checking if there's any
-    // data left in the buffer. If there is, then we are just waiting for the
-    // writing to finish, otherwise end the transfer.
+    // been exhausted, or because we aren't reading and weren't listening for
+    // one. If we aren't reading, then we are just waiting for the writing to
+    // make room and there might still be data to read after that.
+    if (!transfer->reading)
+      return 0;
 
     // In the case of an error, where there is not likely to be any more data to
     // read, we still want to wait for any data we did get to be written out.
     if (!transfer->bytes_left) {
       sl_data_transfer_destroy(transfer);
+    } else {
+      transfer->read_done = 1;
+      sl_data_transfer_update_buffered(transfer);
     }
     return 0;
   }
 
-  // At this point we must be in the reading state.
-  assert(!transfer->bytes_left);
-
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left > 0) {
-    transfer->offset = 0;
-    // There may still be data to read from the event source, but we have no
-    // room in our buffer so move to the writing state.
-    wl_event_source_fd_update(transfer->read_event_source, 0);
-    wl_event_source_fd_update(transfer->write_event_source, WL_EVENT_WRITABLE);
-  } else {
-    // On a read error or EOF, end the transfer.
+  if (transfer->splice) {
+    if (sl_data_transfer_splice(transfer, 0))
+      return 0;
+    sl_data_transfer_start_buffered(transfer);
+  }
+
+  // Read as much as fits in the free space after the buffered data.
+  assert(transfer->bytes_left < DATA_TRANSFER_BUFFER_SIZE);
+  tail = (transfer->offset + transfer->bytes_left) % DATA_TRANSFER_BUFFER_SIZE;
+  size = MIN(DATA_TRANSFER_BUFFER_SIZE - transfer->bytes_left,
+             DATA_TRANSFER_BUFFER_SIZE - tail);
+
+  rv = read(transfer->read_fd, transfer->data + tail, size);
+  if (rv > 0) {
+    transfer->bytes_left += rv;
+  } else if (rv < 0 && errno == EAGAIN) {
+    return 0;
+  } else if (!transfer->bytes_left) {
+    // On a read error or EOF with nothing left to write, end the transfer.
     sl_data_transfer_destroy(transfer);
+    return 0;
+  } else {
+    // Otherwise finish writing what was read.
+    transfer->read_done = 1;
   }
 
+  sl_data_transfer_update_buffered(transfer);
   return 0;
 }
 
 static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
-  int rv;
+  size_t size;
+  ssize_t rv;
 
   // If we receive a HANGUP or ERROR event on the write source then there is no
   // point in continuing the transfer. We could still read more data, but we
@@ -111,28 +198,40 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
     return 0;
   }
 
-  // At this point we must be in the writing state.
-  assert(transfer->bytes_left);
+  if (transfer->splice) {
+    if (sl_data_transfer_splice(transfer, 1))
+      return 0;
+    sl_data_transfer_start_buffered(transfer);
+    sl_data_transfer_update_buffered(transfer);
+    return 0;
+  }
 
-  rv = write(transfer->write_fd, transfer->data + transfer->offset,
-             transfer->bytes_left);
+  // Write the buffered data up to the end of the ring buffer.
+  assert(transfer->bytes_left);
+  size = MIN(transfer->bytes_left,
+             DATA_TRANSFER_BUFFER_SIZE - transfer->offset);
 
+  rv = write(transfer->write_fd, transfer->data + transfer->offset, size);
   if (rv < 0) {
+    if (errno == EAGAIN)
+      return 0;
+
     // On a write error, end the transfer.
     sl_data_transfer_destroy(transfer);
-  } else {
-    assert(rv <= transfer->bytes_left);
-    transfer->bytes_left -= rv;
-    transfer->offset += rv;
+    return 0;
   }
 
-  if (!transfer->bytes_left) {
-    // If all data has been written, move back to the reading state.
-    wl_event_source_fd_update(transfer->write_event_source, 0);
-    wl_event_source_fd_update(transfer->read_event_source, WL_EVENT_READABLE);
+  assert(rv <= size);
+  transfer->bytes_left -= rv;
+  transfer->offset = (transfer->offset + rv) % DATA_TRANSFER_BUFFER_SIZE;
+
+  // Transfer is complete once all data that was read has been written.
+  if (transfer->read_done && !transfer->bytes_left) {
+    sl_data_transfer_destroy(transfer);
+    return 0;
   }
 
-  // If there is still data left, continue in the writing state.
+  sl_data_transfer_update_buffered(transfer);
   return 0;
 }
 
@@ -140,6 +239,7 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
                                     int read_fd,
                                     int write_fd) {
   struct sl_data_transfer* transfer;
+  struct stat read_stat, write_stat;
   int flags;
   int rv;
 
@@ -153,8 +253,25 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   assert(transfer);
   transfer->read_fd = read_fd;
   transfer->write_fd = write_fd;
+  transfer->reading = 1;
+  transfer->read_done = 0;
   transfer->offset = 0;
   transfer->bytes_left = 0;
+  transfer->data = NULL;
+
+  // Splicing requires one of the ends to be a pipe. It is attempted first
+  // and the ring buffer is used if the kernel rejects it.
+  transfer->splice =
+      (!fstat(read_fd, &read_stat) && S_ISFIFO(read_stat.st_mode)) ||
+      (!fstat(write_fd, &write_stat) && S_ISFIFO(write_stat.st_mode));
+  if (transfer->splice) {
+    // Splicing is also attempted from write events so reads must not block.
+    flags = fcntl(read_fd, F_GETFL, 0);
+    fcntl(read_fd, F_SETFL, flags | O_NONBLOCK);
+  } else {
+    sl_data_transfer_start_buffered(transfer);
+  }
+
   transfer->read_event_source =
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            sl_handle_data_transfer_read, transfer);
@@ -365,6 +482,7 @@ static void sl_data_device_start_drag(struct wl_client* client,
   struct sl_host_surface* host_icon =
       icon_resource ? wl_resource_get_user_data(icon_resource) : NULL;
   host_icon->has_role = 1;
+  host_icon->low_resolution = 0;
 
   wl_data_device_start_drag(host->proxy,
                             host_source ? host_source->proxy : NULL,
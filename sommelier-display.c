@@ -50,7 +50,7 @@ static void sl_host_callback_destroy(struct wl_resource* resource) {
 
   wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&host->ctx->callback_slab, host);
 }
 
 static void sl_display_sync(struct wl_client* client,
@@ -59,8 +59,8 @@ static void sl_display_sync(struct wl_client* client,
   struct sl_context* ctx = wl_resource_get_user_data(resource);
   struct sl_host_callback* host_callback;
 
-  host_callback = malloc(sizeof(*host_callback));
-  assert(host_callback);
+  host_callback = sl_slab_alloc(&ctx->callback_slab, sizeof(*host_callback));
+  host_callback->ctx = ctx;
 
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, id);
@@ -120,7 +120,8 @@ static enum wl_iterator_result sl_set_implementation(
   return WL_ITERATOR_CONTINUE;
 }
 
-void sl_set_display_implementation(struct sl_context* ctx) {
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client) {
   // Find display resource and set implementation.
-  wl_client_for_each_resource(ctx->client, sl_set_implementation, ctx);
+  wl_client_for_each_resource(client, sl_set_implementation, ctx);
 }
@@ -5,10 +5,13 @@
 #include "sommelier.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <gbm.h>
 #include <libdrm/drm_fourcc.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -16,6 +19,18 @@
 
 #include "drm-server-protocol.h"
 #include "linux-dmabuf-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+
+#define DMA_BUF_SYNC_READ (1 << 0)
+
+#define DMA_BUF_BASE 'b'
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE \
+  _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+
+struct dma_buf_export_sync_file {
+  __u32 flags;
+  __s32 fd;
+};
 
 struct sl_host_drm {
   struct sl_context* ctx;
@@ -25,6 +40,22 @@ struct sl_host_drm {
   struct wl_callback* callback;
 };
 
+struct sl_host_linux_dmabuf {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct zwp_linux_dmabuf_v1* proxy;
+};
+
+struct sl_host_linux_buffer_params {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct zwp_linux_buffer_params_v1* proxy;
+  // First plane of the buffer, kept to wait for rendering to complete.
+  int fd;
+  int32_t width;
+  int32_t height;
+};
+
 static void sl_drm_authenticate(struct wl_client* client,
                                 struct wl_resource* resource,
                                 uint32_t id) {
@@ -58,34 +89,129 @@ static void sl_drm_create_planar_buffer(struct wl_client* client,
   assert(0);
 }
 
-static void sl_drm_sync(struct sl_context* ctx,
+// Returns a fd that becomes readable once GPU rendering to the buffer of
+// |sync_point| has completed, or -1 if the kernel can't export one. Never
+// blocks.
+static int sl_drm_fence(struct sl_context* ctx,
                         struct sl_sync_point* sync_point) {
-  int drm_fd = gbm_device_get_fd(ctx->gbm);
+  struct dma_buf_export_sync_file export_sync_file;
+  int ret;
+
+  // First attempts to export a sync_file with the fences a reader has to
+  // wait for. This will fail on kernels without sync_file export support.
+  memset(&export_sync_file, 0, sizeof(export_sync_file));
+  export_sync_file.flags = DMA_BUF_SYNC_READ;
+  export_sync_file.fd = -1;
+  ret = drmIoctl(sync_point->fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE,
+                 &export_sync_file);
+  if (!ret)
+    return export_sync_file.fd;
+
+  // Otherwise sl_drm_sync() has to be used.
+  return -1;
+}
+
+// Virtio-gpu resource of a dmabuf. The GEM handle is kept open for as long
+// as a sync point holds on to the dmabuf, so buffers created again for the
+// same dmabuf need no ioctls.
+struct sl_drm_resource {
+  struct wl_list link;
+  struct sl_context* ctx;
+  int refcount;
+  dev_t dev;
+  ino_t ino;
+  uint32_t handle;
+  uint32_t stride;
+};
+
+static void sl_drm_gem_close(struct sl_context* ctx, uint32_t handle) {
+  struct drm_gem_close gem_close;
+
+  memset(&gem_close, 0, sizeof(gem_close));
+  gem_close.handle = handle;
+  drmIoctl(gbm_device_get_fd(ctx->gbm), DRM_IOCTL_GEM_CLOSE, &gem_close);
+}
+
+// Returns a reference to the virtio-gpu resource of the dmabuf |fd|, or NULL
+// if |fd| is not a virtio-gpu resource.
+static struct sl_drm_resource* sl_drm_resource_get(struct sl_context* ctx,
+                                                   int fd) {
+  struct sl_drm_resource* resource;
   struct drm_prime_handle prime_handle;
+  struct drm_virtgpu_resource_info info_arg;
+  struct stat st;
+  int drm_fd;
   int ret;
 
+  if (!ctx->gbm || ctx->drm_resource_info_unsupported)
+    return NULL;
+
+  // Dmabufs are identified by their inode. It can't be reused while an
+  // entry exists, as the sync point of the entry keeps the dmabuf open.
+  if (fstat(fd, &st))
+    return NULL;
+
+  wl_list_for_each(resource, &ctx->drm_resources, link) {
+    if (resource->dev == st.st_dev && resource->ino == st.st_ino) {
+      resource->refcount++;
+      return resource;
+    }
+  }
+
+  drm_fd = gbm_device_get_fd(ctx->gbm);
+
   // First imports the prime fd to a gem handle. This will fail if this
   // function was not passed a prime handle that can be imported by the drm
   // device given to sommelier.
   memset(&prime_handle, 0, sizeof(prime_handle));
-  prime_handle.fd = sync_point->fd;
+  prime_handle.fd = fd;
   ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-  if (!ret) {
-    struct drm_virtgpu_3d_wait wait_arg;
-    struct drm_gem_close gem_close;
-
-    // Then attempts to wait for GPU operations to complete. This will fail
-    // silently if the drm device passed to sommelier is not a virtio-gpu
-    // device.
-    memset(&wait_arg, 0, sizeof(wait_arg));
-    wait_arg.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
-
-    // Always close the handle we imported.
-    memset(&gem_close, 0, sizeof(gem_close));
-    gem_close.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+  if (ret)
+    return NULL;
+
+  // Then attempts to get resource information. This will fail if the drm
+  // device passed to sommelier is not a virtio-gpu device, in which case
+  // there is no point in trying again.
+  memset(&info_arg, 0, sizeof(info_arg));
+  info_arg.bo_handle = prime_handle.handle;
+  ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
+  if (ret) {
+    if (errno == EINVAL || errno == ENOTTY)
+      ctx->drm_resource_info_unsupported = 1;
+    sl_drm_gem_close(ctx, prime_handle.handle);
+    return NULL;
   }
+
+  resource = malloc(sizeof(*resource));
+  assert(resource);
+  resource->ctx = ctx;
+  resource->refcount = 1;
+  resource->dev = st.st_dev;
+  resource->ino = st.st_ino;
+  resource->handle = prime_handle.handle;
+  resource->stride = info_arg.stride;
+  wl_list_insert(&ctx->drm_resources, &resource->link);
+
+  return resource;
+}
+
+static void sl_drm_sync(struct sl_context* ctx,
+                        struct sl_sync_point* sync_point) {
+  struct drm_virtgpu_3d_wait wait_arg;
+
+  // Waits for GPU operations on the resource to complete.
+  memset(&wait_arg, 0, sizeof(wait_arg));
+  wait_arg.handle = sync_point->resource->handle;
+  drmIoctl(gbm_device_get_fd(ctx->gbm), DRM_IOCTL_VIRTGPU_WAIT, &wait_arg);
+}
+
+void sl_drm_resource_unref(struct sl_drm_resource* resource) {
+  if (--resource->refcount)
+    return;
+
+  sl_drm_gem_close(resource->ctx, resource->handle);
+  wl_list_remove(&resource->link);
+  free(resource);
 }
 
 static void sl_drm_create_prime_buffer(struct wl_client* client,
@@ -113,39 +239,10 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
   // Attempts to correct stride0 with virtio-gpu specific resource information,
   // if available.  Ideally mesa/gbm should have the correct stride. Remove
   // after crbug.com/892242 is resolved in mesa.
-  int is_gpu_buffer = 0;
-  if (host->ctx->gbm) {
-    int drm_fd = gbm_device_get_fd(host->ctx->gbm);
-    struct drm_prime_handle prime_handle;
-    int ret;
-
-    // First imports the prime fd to a gem handle. This will fail if this
-    // function was not passed a prime handle that can be imported by the drm
-    // device given to sommelier.
-    memset(&prime_handle, 0, sizeof(prime_handle));
-    prime_handle.fd = name;
-    ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-    if (!ret) {
-      struct drm_virtgpu_resource_info info_arg;
-      struct drm_gem_close gem_close;
-
-      // Then attempts to get resource information. This will fail silently if
-      // the drm device passed to sommelier is not a virtio-gpu device.
-      memset(&info_arg, 0, sizeof(info_arg));
-      info_arg.bo_handle = prime_handle.handle;
-      ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &info_arg);
-      // Correct stride0 if we are able to get proper resource info.
-      if (!ret) {
-        stride0 = info_arg.stride;
-        is_gpu_buffer = 1;
-      }
-
-      // Always close the handle we imported.
-      memset(&gem_close, 0, sizeof(gem_close));
-      gem_close.handle = prime_handle.handle;
-      drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
-    }
-  }
+  struct sl_drm_resource* drm_resource =
+      sl_drm_resource_get(host->ctx, name);
+  if (drm_resource)
+    stride0 = drm_resource->stride;
 
   buffer_params =
       zwp_linux_dmabuf_v1_create_params(host->ctx->linux_dmabuf->internal);
@@ -154,13 +251,15 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
                                  DRM_FORMAT_MOD_INVALID & 0xffffffff);
 
   struct sl_host_buffer* host_buffer =
-      sl_create_host_buffer(client, id,
+      sl_create_host_buffer(host->ctx, client, id,
                             zwp_linux_buffer_params_v1_create_immed(
                                 buffer_params, width, height, format, 0),
                             width, height);
-  if (is_gpu_buffer) {
+  if (drm_resource) {
     host_buffer->sync_point = sl_sync_point_create(name);
+    host_buffer->sync_point->fence = sl_drm_fence;
     host_buffer->sync_point->sync = sl_drm_sync;
+    host_buffer->sync_point->resource = drm_resource;
   } else {
     close(name);
   }
@@ -259,3 +358,240 @@ struct sl_global* sl_drm_global_create(struct sl_context* ctx) {
 
   return sl_global_create(ctx, &wl_drm_interface, 2, ctx, sl_bind_host_drm);
 }
+
+// Sets up waiting for rendering to |host_buffer| to complete before it is
+// committed. The first plane fd of |host| is handed over to the sync point.
+static void sl_linux_buffer_params_set_sync_point(
+    struct sl_host_linux_buffer_params* host,
+    struct sl_host_buffer* host_buffer) {
+  struct sl_drm_resource* drm_resource;
+
+  if (host->fd < 0)
+    return;
+
+  drm_resource = sl_drm_resource_get(host->ctx, host->fd);
+  if (drm_resource) {
+    host_buffer->sync_point = sl_sync_point_create(host->fd);
+    host_buffer->sync_point->fence = sl_drm_fence;
+    host_buffer->sync_point->sync = sl_drm_sync;
+    host_buffer->sync_point->resource = drm_resource;
+  } else {
+    close(host->fd);
+  }
+  host->fd = -1;
+}
+
+static void sl_linux_buffer_params_created(
+    void* data,
+    struct zwp_linux_buffer_params_v1* params,
+    struct wl_buffer* buffer) {
+  struct sl_host_linux_buffer_params* host =
+      zwp_linux_buffer_params_v1_get_user_data(params);
+  struct sl_host_buffer* host_buffer;
+
+  host_buffer =
+      sl_create_host_buffer(host->ctx, wl_resource_get_client(host->resource),
+                            0, buffer, host->width, host->height);
+  sl_linux_buffer_params_set_sync_point(host, host_buffer);
+  zwp_linux_buffer_params_v1_send_created(host->resource,
+                                          host_buffer->resource);
+}
+
+static void sl_linux_buffer_params_failed(
+    void* data,
+    struct zwp_linux_buffer_params_v1* params) {
+  struct sl_host_linux_buffer_params* host =
+      zwp_linux_buffer_params_v1_get_user_data(params);
+
+  zwp_linux_buffer_params_v1_send_failed(host->resource);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener
+    sl_linux_buffer_params_listener = {sl_linux_buffer_params_created,
+                                       sl_linux_buffer_params_failed};
+
+static void sl_linux_buffer_params_destroy(struct wl_client* client,
+                                           struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_linux_buffer_params_add(struct wl_client* client,
+                                       struct wl_resource* resource,
+                                       int32_t fd,
+                                       uint32_t plane_idx,
+                                       uint32_t offset,
+                                       uint32_t stride,
+                                       uint32_t modifier_hi,
+                                       uint32_t modifier_lo) {
+  struct sl_host_linux_buffer_params* host =
+      wl_resource_get_user_data(resource);
+
+  zwp_linux_buffer_params_v1_add(host->proxy, fd, plane_idx, offset, stride,
+                                 modifier_hi, modifier_lo);
+  if (plane_idx == 0 && host->fd < 0) {
+    host->fd = fd;
+  } else {
+    close(fd);
+  }
+}
+
+static void sl_linux_buffer_params_create(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          int32_t width,
+                                          int32_t height,
+                                          uint32_t format,
+                                          uint32_t flags) {
+  struct sl_host_linux_buffer_params* host =
+      wl_resource_get_user_data(resource);
+
+  host->width = width;
+  host->height = height;
+  zwp_linux_buffer_params_v1_create(host->proxy, width, height, format, flags);
+}
+
+static void sl_linux_buffer_params_create_immed(struct wl_client* client,
+                                                struct wl_resource* resource,
+                                                uint32_t buffer_id,
+                                                int32_t width,
+                                                int32_t height,
+                                                uint32_t format,
+                                                uint32_t flags) {
+  struct sl_host_linux_buffer_params* host =
+      wl_resource_get_user_data(resource);
+  struct sl_host_buffer* host_buffer;
+
+  host_buffer = sl_create_host_buffer(
+      host->ctx, client, buffer_id,
+      zwp_linux_buffer_params_v1_create_immed(host->proxy, width, height,
+                                              format, flags),
+      width, height);
+  sl_linux_buffer_params_set_sync_point(host, host_buffer);
+}
+
+static const struct zwp_linux_buffer_params_v1_interface
+    sl_linux_buffer_params_implementation = {
+        sl_linux_buffer_params_destroy, sl_linux_buffer_params_add,
+        sl_linux_buffer_params_create, sl_linux_buffer_params_create_immed};
+
+static void sl_destroy_host_linux_buffer_params(struct wl_resource* resource) {
+  struct sl_host_linux_buffer_params* host =
+      wl_resource_get_user_data(resource);
+
+  zwp_linux_buffer_params_v1_destroy(host->proxy);
+  if (host->fd >= 0)
+    close(host->fd);
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+static void sl_linux_dmabuf_destroy(struct wl_client* client,
+                                    struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_linux_dmabuf_create_params(struct wl_client* client,
+                                          struct wl_resource* resource,
+                                          uint32_t params_id) {
+  struct sl_host_linux_dmabuf* host = wl_resource_get_user_data(resource);
+  struct sl_host_linux_buffer_params* host_params;
+
+  host_params = malloc(sizeof(*host_params));
+  assert(host_params);
+  host_params->ctx = host->ctx;
+  host_params->fd = -1;
+  host_params->width = 0;
+  host_params->height = 0;
+  host_params->resource =
+      wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+                         wl_resource_get_version(resource), params_id);
+  wl_resource_set_implementation(host_params->resource,
+                                 &sl_linux_buffer_params_implementation,
+                                 host_params,
+                                 sl_destroy_host_linux_buffer_params);
+  host_params->proxy = zwp_linux_dmabuf_v1_create_params(host->proxy);
+  zwp_linux_buffer_params_v1_set_user_data(host_params->proxy, host_params);
+  zwp_linux_buffer_params_v1_add_listener(
+      host_params->proxy, &sl_linux_buffer_params_listener, host_params);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface
+    sl_linux_dmabuf_implementation = {sl_linux_dmabuf_destroy,
+                                      sl_linux_dmabuf_create_params};
+
+static void sl_destroy_host_linux_dmabuf(struct wl_resource* resource) {
+  struct sl_host_linux_dmabuf* host = wl_resource_get_user_data(resource);
+
+  zwp_linux_dmabuf_v1_destroy(host->proxy);
+  wl_resource_set_user_data(resource, NULL);
+  free(host);
+}
+
+static void sl_host_linux_dmabuf_format(
+    void* data,
+    struct zwp_linux_dmabuf_v1* linux_dmabuf,
+    uint32_t format) {
+  struct sl_host_linux_dmabuf* host =
+      zwp_linux_dmabuf_v1_get_user_data(linux_dmabuf);
+
+  zwp_linux_dmabuf_v1_send_format(host->resource, format);
+}
+
+static void sl_host_linux_dmabuf_modifier(
+    void* data,
+    struct zwp_linux_dmabuf_v1* linux_dmabuf,
+    uint32_t format,
+    uint32_t modifier_hi,
+    uint32_t modifier_lo) {
+  struct sl_host_linux_dmabuf* host =
+      zwp_linux_dmabuf_v1_get_user_data(linux_dmabuf);
+
+  if (wl_resource_get_version(host->resource) >=
+      ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+    zwp_linux_dmabuf_v1_send_modifier(host->resource, format, modifier_hi,
+                                      modifier_lo);
+  }
+}
+
+static const struct zwp_linux_dmabuf_v1_listener
+    sl_host_linux_dmabuf_listener = {sl_host_linux_dmabuf_format,
+                                     sl_host_linux_dmabuf_modifier};
+
+static void sl_bind_host_linux_dmabuf(struct wl_client* client,
+                                      void* data,
+                                      uint32_t version,
+                                      uint32_t id) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_host_linux_dmabuf* host;
+
+  host = malloc(sizeof(*host));
+  assert(host);
+  host->ctx = ctx;
+  host->resource =
+      wl_resource_create(client, &zwp_linux_dmabuf_v1_interface,
+                         MIN(version, ctx->linux_dmabuf->version), id);
+  wl_resource_set_implementation(host->resource,
+                                 &sl_linux_dmabuf_implementation, host,
+                                 sl_destroy_host_linux_dmabuf);
+
+  // The host sends the supported formats and modifiers in response to the
+  // bind, and they are forwarded as they arrive.
+  host->proxy = wl_registry_bind(wl_display_get_registry(ctx->display),
+                                 ctx->linux_dmabuf->id,
+                                 &zwp_linux_dmabuf_v1_interface,
+                                 wl_resource_get_version(host->resource));
+  zwp_linux_dmabuf_v1_set_user_data(host->proxy, host);
+  zwp_linux_dmabuf_v1_add_listener(host->proxy, &sl_host_linux_dmabuf_listener,
+                                   host);
+}
+
+struct sl_global* sl_linux_dmabuf_global_create(struct sl_context* ctx) {
+  assert(ctx->linux_dmabuf);
+
+  // Clients can only be handed modifiers with version 3 or later.
+  if (ctx->linux_dmabuf->version < 3)
+    return NULL;
+
+  return sl_global_create(ctx, &zwp_linux_dmabuf_v1_interface,
+                          ctx->linux_dmabuf->version, ctx,
+                          sl_bind_host_linux_dmabuf);
+}
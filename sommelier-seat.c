@@ -53,6 +53,9 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
   if (surface_resource) {
     host_surface = wl_resource_get_user_data(surface_resource);
     host_surface->has_role = 1;
+    host_surface->is_cursor = 1;
+    host_surface->low_resolution = 0;
+    sl_host_surface_finish_commit(host_surface);
     if (host_surface->contents_width && host_surface->contents_height)
       wl_surface_commit(host_surface->proxy);
   }
@@ -78,6 +81,45 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+// Forwards motion that has been held back by coalescing.
+static void sl_pointer_send_pending_motion(struct sl_host_pointer* host) {
+  if (host->motion_pending) {
+    wl_pointer_send_motion(host->resource, host->motion_time, host->motion_x,
+                           host->motion_y);
+    host->seat->ctx->stats.pointer_motion_sent++;
+    host->motion_pending = 0;
+  }
+  sl_relative_pointers_flush(host);
+}
+
+// Called for all events but motion. These keep their order relative to
+// motion, so coalesced motion is sent first and becomes part of the current
+// frame.
+static void sl_pointer_begin_event(struct sl_host_pointer* host) {
+  if (!host->motion_timer)
+    return;
+
+  sl_pointer_send_pending_motion(host);
+  host->frame_deferred = 0;
+  host->frame_events++;
+}
+
+static int sl_pointer_motion_timer(void* data) {
+  struct sl_host_pointer* host = data;
+
+  if (!host->frame_deferred) {
+    host->motion_timer_armed = 0;
+    return 0;
+  }
+
+  sl_pointer_send_pending_motion(host);
+  wl_pointer_send_frame(host->resource);
+  host->frame_deferred = 0;
+  wl_event_source_timer_update(host->motion_timer,
+                               host->seat->ctx->pointer_motion_interval);
+  return 0;
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -124,6 +166,8 @@ static void sl_pointer_enter(void* data,
   struct sl_host_surface* host_surface =
       surface ? wl_surface_get_user_data(surface) : NULL;
 
+  sl_pointer_begin_event(host);
+
   if (!host_surface)
     return;
 
@@ -140,6 +184,7 @@ static void sl_pointer_leave(void* data,
                              struct wl_surface* surface) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_begin_event(host);
   sl_pointer_set_focus(host, serial, NULL, 0, 0);
 }
 
@@ -151,7 +196,19 @@ static void sl_pointer_motion(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  host->seat->ctx->stats.pointer_motion_received++;
+
+  // Only the latest position is forwarded when coalescing.
+  if (host->motion_timer) {
+    host->motion_pending = 1;
+    host->motion_time = time;
+    host->motion_x = x * scale;
+    host->motion_y = y * scale;
+    return;
+  }
+
   wl_pointer_send_motion(host->resource, time, x * scale, y * scale);
+  host->seat->ctx->stats.pointer_motion_sent++;
 }
 
 static void sl_pointer_button(void* data,
@@ -162,6 +219,7 @@ static void sl_pointer_button(void* data,
                               uint32_t state) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_begin_event(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -177,13 +235,31 @@ static void sl_pointer_axis(void* data,
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
   double scale = host->seat->ctx->scale;
 
+  sl_pointer_begin_event(host);
   host->time = time;
   host->axis_delta[axis] += value * scale;
+  host->axis_pending[axis] = 1;
 }
 
 static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  if (host->motion_timer) {
+    // Motion-only frames are forwarded at most once per interval. The
+    // timer sends the last one held back when it expires.
+    if (!host->frame_events) {
+      if (host->motion_timer_armed) {
+        host->frame_deferred = 1;
+        return;
+      }
+      wl_event_source_timer_update(host->motion_timer,
+                                   host->seat->ctx->pointer_motion_interval);
+      host->motion_timer_armed = 1;
+    }
+    sl_pointer_send_pending_motion(host);
+    host->frame_events = 0;
+  }
+
   // Many X apps (e.g. VS Code, Firefox, Chromium) only allow scrolls to happen
   // in multiples of 5 units. This value comes from the smooth scrolling
   // extension of X, which says that 5 smooth scroll units is equal to 1 tick of
@@ -197,6 +273,11 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   const int kDiscreteScrollUnit = 5;
 
   for (int axis = 0; axis < 2; axis++) {
+    // Axes without events are only skipped when motion is coalesced, as
+    // frames are then sent for motion alone.
+    if (host->motion_timer && !host->axis_pending[axis])
+      continue;
+
     if (host->axis_discrete[axis] != 0) {
       wl_pointer_send_axis_discrete(host->resource, axis,
                                     host->axis_discrete[axis]);
@@ -212,6 +293,7 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
 
     host->axis_delta[axis] = wl_fixed_from_int(0);
     host->axis_discrete[axis] = 0;
+    host->axis_pending[axis] = 0;
   }
 
   wl_pointer_send_frame(host->resource);
@@ -222,6 +304,7 @@ void sl_pointer_axis_source(void* data,
                             uint32_t axis_source) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_begin_event(host);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -231,6 +314,7 @@ static void sl_pointer_axis_stop(void* data,
                                  uint32_t axis) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_begin_event(host);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -240,7 +324,9 @@ static void sl_pointer_axis_discrete(void* data,
                                      int32_t discrete) {
   struct sl_host_pointer* host = wl_pointer_get_user_data(pointer);
 
+  sl_pointer_begin_event(host);
   host->axis_discrete[axis] += discrete;
+  host->axis_pending[axis] = 1;
 }
 
 static const struct wl_pointer_listener sl_pointer_listener = {
@@ -580,6 +666,9 @@ static void sl_destroy_host_pointer(struct wl_resource* resource) {
   } else {
     wl_pointer_destroy(host->proxy);
   }
+  if (host->motion_timer)
+    wl_event_source_remove(host->motion_timer);
+  sl_relative_pointers_release(host);
   wl_list_remove(&host->focus_resource_listener.link);
   wl_resource_set_user_data(resource, NULL);
   free(host);
@@ -622,6 +711,23 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
   host_pointer->axis_delta[1] = wl_fixed_from_int(0);
   host_pointer->axis_discrete[0] = 0;
   host_pointer->axis_discrete[1] = 0;
+  host_pointer->axis_pending[0] = 0;
+  host_pointer->axis_pending[1] = 0;
+  host_pointer->motion_pending = 0;
+  host_pointer->frame_events = 0;
+  host_pointer->frame_deferred = 0;
+  host_pointer->motion_timer_armed = 0;
+  host_pointer->motion_timer = NULL;
+  wl_list_init(&host_pointer->relative_pointers);
+
+  // Coalescing relies on the host grouping events into frames.
+  if (host->seat->ctx->pointer_motion_interval &&
+      wl_pointer_get_version(host_pointer->proxy) >=
+          WL_POINTER_FRAME_SINCE_VERSION) {
+    host_pointer->motion_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->seat->ctx->host_display),
+        sl_pointer_motion_timer, host_pointer);
+  }
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -5,7 +5,10 @@
 #include "sommelier.h"
 
 #include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -17,6 +20,9 @@ struct sl_host_shm_pool {
   struct wl_resource* resource;
   struct wl_shm_pool* proxy;
   int fd;
+  int32_t size;
+  // Mapping of the pool that buffers which need to be copied point into.
+  struct sl_mmap* mmap;
 };
 
 struct sl_host_shm {
@@ -26,37 +32,6 @@ struct sl_host_shm {
   struct zwp_linux_dmabuf_v1* linux_dmabuf_proxy;
 };
 
-size_t sl_shm_bpp_for_shm_format(uint32_t format) {
-  switch (format) {
-    case WL_SHM_FORMAT_NV12:
-      return 1;
-    case WL_SHM_FORMAT_RGB565:
-      return 2;
-    case WL_SHM_FORMAT_ARGB8888:
-    case WL_SHM_FORMAT_ABGR8888:
-    case WL_SHM_FORMAT_XRGB8888:
-    case WL_SHM_FORMAT_XBGR8888:
-      return 4;
-  }
-  assert(0);
-  return 0;
-}
-
-size_t sl_shm_num_planes_for_shm_format(uint32_t format) {
-  switch (format) {
-    case WL_SHM_FORMAT_NV12:
-      return 2;
-    case WL_SHM_FORMAT_RGB565:
-    case WL_SHM_FORMAT_ARGB8888:
-    case WL_SHM_FORMAT_ABGR8888:
-    case WL_SHM_FORMAT_XRGB8888:
-    case WL_SHM_FORMAT_XBGR8888:
-      return 1;
-  }
-  assert(0);
-  return 0;
-}
-
 static size_t sl_y_subsampling_for_shm_format_plane(uint32_t format,
                                                     size_t plane) {
   switch (format) {
@@ -121,6 +96,64 @@ static size_t sl_size_for_shm_format(uint32_t format,
   return total_size;
 }
 
+// Formats that every host wl_shm implementation supports and that can be
+// used for buffers that alias the client pool.
+static int sl_shm_format_is_zero_copy(uint32_t format) {
+  switch (format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+      return 1;
+  }
+  return 0;
+}
+
+// Returns true if the host can map |fd| directly. Any fd can be shared when
+// connected to the host compositor with a regular socket. Only virtwl
+// allocations can be shared when the connection goes through virtwl.
+static int sl_shm_fd_is_host_shareable(struct sl_context* ctx, int fd) {
+  char path[64];
+  char target[64];
+  ssize_t len;
+
+  if (ctx->virtwl_socket_fd == -1)
+    return 1;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  len = readlink(path, target, sizeof(target) - 1);
+  if (len < 0)
+    return 0;
+  target[len] = '\0';
+
+  return strstr(target, "virtwl") != NULL;
+}
+
+// Returns a mapping of the pool that covers at least |size| bytes. The
+// mapping is created on first use and shared by all buffers of the pool.
+static struct sl_mmap* sl_host_shm_pool_map(struct sl_host_shm_pool* host,
+                                            size_t size) {
+  size = MAX(size, (size_t)host->size);
+
+  // Buffers that point into a mapping which is too small keep it alive.
+  if (host->mmap && host->mmap->size < size) {
+    sl_mmap_unref(host->mmap);
+    host->mmap = NULL;
+  }
+
+  if (!host->mmap) {
+    host->mmap =
+        sl_mmap_create(host->shm->ctx, host->fd, size, 1, 1, 0, 0, 0, 0, 1, 1);
+    // In the case of mmaps created from the client buffer, we want to be able
+    // to close the FD when the client releases the shm pool (i.e. when it's
+    // done transferring) as opposed to when the pool is freed (i.e. when we're
+    // done drawing).
+    // We do this by removing the handle to the FD after it has been mmapped,
+    // which prevents a double-close.
+    host->mmap->fd = -1;
+  }
+
+  return host->mmap;
+}
+
 static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 struct wl_resource* resource,
                                                 uint32_t id,
@@ -131,31 +164,28 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 uint32_t format) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
-  if (host->shm->ctx->shm_driver == SHM_DRIVER_NOOP) {
+  // Buffers of pools that are shared with the host alias the client pixels
+  // and need no copy.
+  if (host->shm->ctx->shm_driver == SHM_DRIVER_NOOP ||
+      (host->proxy && sl_shm_format_is_zero_copy(format))) {
     assert(host->proxy);
-    sl_create_host_buffer(client, id,
+    sl_create_host_buffer(host->shm->ctx, client, id,
                           wl_shm_pool_create_buffer(host->proxy, offset, width,
                                                     height, stride, format),
                           width, height);
   } else {
+    size_t size = sl_size_for_shm_format(format, height, stride);
     struct sl_host_buffer* host_buffer =
-        sl_create_host_buffer(client, id, NULL, width, height);
+        sl_create_host_buffer(host->shm->ctx, client, id, NULL, width, height);
 
     host_buffer->shm_format = format;
-    host_buffer->shm_mmap = sl_mmap_create(
-        host->fd, sl_size_for_shm_format(format, height, stride),
+    host_buffer->shm_mmap = sl_mmap_create_view(
+        sl_host_shm_pool_map(host, offset + size), size,
         sl_shm_bpp_for_shm_format(format),
         sl_shm_num_planes_for_shm_format(format), offset, stride,
         offset + sl_offset_for_shm_format_plane(format, height, stride, 1),
         stride, sl_y_subsampling_for_shm_format_plane(format, 0),
         sl_y_subsampling_for_shm_format_plane(format, 1));
-    // In the case of mmaps created from the client buffer, we want to be able
-    // to close the FD when the client releases the shm pool (i.e. when it's
-    // done transferring) as opposed to when the pool is freed (i.e. when we're
-    // done drawing).
-    // We do this by removing the handle to the FD after it has been mmapped,
-    // which prevents a double-close.
-    host_buffer->shm_mmap->fd = -1;
     host_buffer->shm_mmap->buffer_resource = host_buffer->resource;
   }
 }
@@ -170,8 +200,35 @@ static void sl_host_shm_pool_resize(struct wl_client* client,
                                     int32_t size) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
-  if (host->proxy)
-    wl_shm_pool_resize(host->proxy, size);
+  host->size = size;
+
+  // Grow the pool mapping in place so that buffers pointing into it are not
+  // affected. It can only move when no buffer uses it. Otherwise those
+  // buffers keep the old mapping and the next buffer maps the pool again.
+  if (host->mmap && host->mmap->size < (size_t)size) {
+    void* addr = mremap(host->mmap->addr, host->mmap->size, size,
+                        host->mmap->refcount == 1 ? MREMAP_MAYMOVE : 0);
+    if (addr != MAP_FAILED) {
+      host->mmap->addr = addr;
+      host->mmap->size = size;
+    } else {
+      sl_mmap_unref(host->mmap);
+      host->mmap = NULL;
+    }
+  }
+
+  if (!host->proxy)
+    return;
+
+  // VirtWL allocations can't grow. Stop sharing the pool with the host and
+  // copy contents of buffers created after this instead.
+  if (host->fd >= 0 && host->shm->ctx->virtwl_socket_fd != -1) {
+    wl_shm_pool_destroy(host->proxy);
+    host->proxy = NULL;
+    return;
+  }
+
+  wl_shm_pool_resize(host->proxy, size);
 }
 
 static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
@@ -181,6 +238,8 @@ static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
 static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   struct sl_host_shm_pool* host = wl_resource_get_user_data(resource);
 
+  if (host->mmap)
+    sl_mmap_unref(host->mmap);
   if (host->fd >= 0)
     close(host->fd);
   if (host->proxy)
@@ -202,6 +261,8 @@ static void sl_shm_create_host_pool(struct wl_client* client,
 
   host_shm_pool->shm = host->shm;
   host_shm_pool->fd = -1;
+  host_shm_pool->size = size;
+  host_shm_pool->mmap = NULL;
   host_shm_pool->proxy = NULL;
   host_shm_pool->resource =
       wl_resource_create(client, &wl_shm_pool_interface, 1, id);
@@ -219,6 +280,14 @@ static void sl_shm_create_host_pool(struct wl_client* client,
     case SHM_DRIVER_VIRTWL:
     case SHM_DRIVER_VIRTWL_DMABUF:
       host_shm_pool->fd = fd;
+      // Also share the pool with the host when possible. The fd is kept for
+      // buffers in formats that still need to be copied.
+      if (host->shm->ctx->zero_copy_shm &&
+          sl_shm_fd_is_host_shareable(host->shm->ctx, fd)) {
+        host_shm_pool->proxy =
+            wl_shm_create_pool(host->shm->ctx->shm->internal, fd, size);
+        wl_shm_pool_set_user_data(host_shm_pool->proxy, host_shm_pool);
+      }
       break;
   }
 }
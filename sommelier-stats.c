@@ -0,0 +1,295 @@
+// Copyright 2020 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+#include <xcb/xproto.h>
+
+// Process id written with every trace event.
+static int sl_trace_pid;
+
+uint64_t sl_now_usec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char* sl_x_event_name(int type) {
+  switch (type) {
+    case XCB_CREATE_NOTIFY:
+      return "CreateNotify";
+    case XCB_DESTROY_NOTIFY:
+      return "DestroyNotify";
+    case XCB_REPARENT_NOTIFY:
+      return "ReparentNotify";
+    case XCB_MAP_REQUEST:
+      return "MapRequest";
+    case XCB_MAP_NOTIFY:
+      return "MapNotify";
+    case XCB_UNMAP_NOTIFY:
+      return "UnmapNotify";
+    case XCB_CONFIGURE_REQUEST:
+      return "ConfigureRequest";
+    case XCB_CONFIGURE_NOTIFY:
+      return "ConfigureNotify";
+    case XCB_CLIENT_MESSAGE:
+      return "ClientMessage";
+    case XCB_FOCUS_IN:
+      return "FocusIn";
+    case XCB_FOCUS_OUT:
+      return "FocusOut";
+    case XCB_PROPERTY_NOTIFY:
+      return "PropertyNotify";
+    case XCB_SELECTION_NOTIFY:
+      return "SelectionNotify";
+    case XCB_SELECTION_REQUEST:
+      return "SelectionRequest";
+  }
+  return "XEvent";
+}
+
+static void sl_stats_print_counters(FILE* f,
+                                    const char* name,
+                                    struct sl_event_counters* counters) {
+  fprintf(f, "\"%s\":{\"count\":%" PRIu64 ",\"usec\":%" PRIu64 "}", name,
+          counters->count, counters->usec);
+}
+
+static void sl_stats_print_virtwl(FILE* f,
+                                  const char* name,
+                                  struct sl_virtwl_counters* counters) {
+  fprintf(f,
+          "\"%s\":{\"messages\":%" PRIu64 ",\"bytes\":%" PRIu64
+          ",\"fds\":%" PRIu64 "}",
+          name, counters->messages, counters->bytes, counters->fds);
+}
+
+static void sl_stats_print_transfers(FILE* f,
+                                     const char* name,
+                                     struct sl_transfer_counters* counters) {
+  fprintf(f,
+          "\"%s\":{\"transfers\":%" PRIu64 ",\"bytes\":%" PRIu64
+          ",\"usec\":%" PRIu64 "}",
+          name, counters->transfers, counters->bytes, counters->usec);
+}
+
+static void sl_stats_print_slab(FILE* f,
+                                const char* name,
+                                struct sl_slab* slab) {
+  fprintf(f,
+          "\"%s\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64
+          ",\"free\":%zu}",
+          name, slab->hits, slab->misses, slab->free_count);
+}
+
+// Writes all counters of |ctx| as a single JSON object.
+static void sl_stats_print(struct sl_context* ctx, FILE* f) {
+  struct sl_stats* stats = &ctx->stats;
+  struct sl_host_surface* host_surface;
+  const char* separator = "";
+  int i;
+
+  fprintf(f,
+          "{\"commits\":%" PRIu64 ",\"damage_area\":%" PRIu64
+          ",\"bytes_copied\":%" PRIu64 ",\"write_usec\":%" PRIu64
+          ",\"output_buffers_created\":%" PRIu64
+          ",\"output_buffers_destroyed\":%" PRIu64
+          ",\"output_buffers_trimmed\":%" PRIu64
+          ",\"output_buffer_size\":%zu,\"output_buffer_pool_size\":%zu"
+          ",\"busy_buffers_max\":%" PRIu64
+          ",\"cursor_cache_hits\":%" PRIu64
+          ",\"cursor_cache_misses\":%" PRIu64
+          ",\"configures_coalesced\":%" PRIu64
+          ",\"pointer_motion_received\":%" PRIu64
+          ",\"pointer_motion_sent\":%" PRIu64
+          ",\"loop_iterations\":%" PRIu64 ",\"events_dispatched\":%" PRIu64
+          ",\"host_writes\":%" PRIu64 ",\"x_writes\":%" PRIu64 ",",
+          stats->commits, stats->damage_area, stats->bytes_copied,
+          stats->write_usec, stats->output_buffers_created,
+          stats->output_buffers_destroyed, stats->output_buffers_trimmed,
+          ctx->output_buffer_size, ctx->output_buffer_pool_size,
+          stats->busy_buffers_max,
+          stats->cursor_cache_hits, stats->cursor_cache_misses,
+          stats->configures_coalesced,
+          stats->pointer_motion_received, stats->pointer_motion_sent,
+          stats->loop_iterations, stats->events_dispatched,
+          stats->host_writes, stats->x_writes);
+  sl_stats_print_counters(f, "frame_callbacks", &stats->frame_callbacks);
+  fprintf(f, ",\"clients\":%d", wl_list_length(&ctx->clients));
+
+  fprintf(f, ",\"slabs\":{");
+  sl_stats_print_slab(f, "callback", &ctx->callback_slab);
+  fprintf(f, ",");
+  sl_stats_print_slab(f, "host_buffer", &ctx->host_buffer_slab);
+  fprintf(f, ",");
+  sl_stats_print_slab(f, "output_buffer", &ctx->output_buffer_slab);
+  fprintf(f, ",");
+  sl_stats_print_slab(f, "mmap", &ctx->mmap_slab);
+  fprintf(f, ",");
+  sl_stats_print_slab(f, "send_request", &ctx->send_request_slab);
+  fprintf(f, "}");
+
+  fprintf(f, ",\"virtwl\":{");
+  sl_stats_print_virtwl(f, "to_client", &ctx->virtwl_to_client);
+  fprintf(f, ",");
+  sl_stats_print_virtwl(f, "to_host", &ctx->virtwl_to_host);
+  fprintf(f, "},\"selection\":{");
+  sl_stats_print_transfers(f, "to_x", &ctx->selection_to_x);
+  fprintf(f, ",");
+  sl_stats_print_transfers(f, "to_wayland", &ctx->selection_to_wayland);
+  fprintf(f, ",\"cache_hits\":%" PRIu64, stats->selection_cache_hits);
+
+  fprintf(f, "},\"x_events\":{");
+  for (i = 0; i < X_EVENT_TYPE_COUNT; ++i) {
+    const char* name = sl_x_event_name(i);
+    char number[32];
+
+    if (!stats->x_events[i].count)
+      continue;
+
+    // Events without a name of their own are keyed by type.
+    if (!strcmp(name, sl_x_event_name(-1))) {
+      snprintf(number, sizeof(number), "%d", i);
+      name = number;
+    }
+    fprintf(f, "%s", separator);
+    sl_stats_print_counters(f, name, &stats->x_events[i]);
+    separator = ",";
+  }
+
+  fprintf(f, "},\"surfaces\":[");
+  separator = "";
+  wl_list_for_each(host_surface, &ctx->host_surfaces, link) {
+    // Surfaces of X11 windows also report the window, and surfaces of
+    // Wayland clients report 0.
+    fprintf(f,
+            "%s{\"surface\":%u,\"window\":%u,\"commits\":%" PRIu64
+            ",\"damage_area\":%" PRIu64 ",\"bytes_copied\":%" PRIu64
+            ",\"busy_buffers\":%d}",
+            separator, wl_resource_get_id(host_surface->resource),
+            host_surface->window ? host_surface->window->id : 0,
+            host_surface->commits, host_surface->damage_area,
+            host_surface->bytes_copied,
+            wl_list_length(&host_surface->busy_buffers));
+    separator = ",";
+  }
+  fprintf(f, "]}\n");
+}
+
+// The counters are rendered into a buffer and sent with a single
+// non-blocking write. Clients that are not ready to receive all of it are
+// dropped so that they never stall the event loop.
+static int sl_handle_stats_connection(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  char* buffer = NULL;
+  size_t size = 0;
+  FILE* f;
+  int client_fd;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd < 0)
+    return 1;
+
+  f = open_memstream(&buffer, &size);
+  if (f) {
+    sl_stats_print(ctx, f);
+    if (fclose(f) == 0)
+      send(client_fd, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+  free(buffer);
+  close(client_fd);
+  return 1;
+}
+
+// Creates a socket at |path| that writes the current counters as JSON to
+// every client that connects to it.
+void sl_stats_listen(struct sl_context* ctx, const char* path) {
+  struct sockaddr_un addr;
+  int rv;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "error: stats socket path too long: %s\n", path);
+    _exit(EXIT_FAILURE);
+  }
+
+  addr.sun_family = AF_LOCAL;
+  strcpy(addr.sun_path, path);
+  unlink(addr.sun_path);
+
+  ctx->stats_fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  assert(ctx->stats_fd >= 0);
+
+  rv = bind(ctx->stats_fd, (struct sockaddr*)&addr,
+            offsetof(struct sockaddr_un, sun_path) + strlen(addr.sun_path));
+  if (rv < 0) {
+    fprintf(stderr, "error: failed to bind stats socket %s: %s\n", path,
+            strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  rv = listen(ctx->stats_fd, 8);
+  assert(rv >= 0);
+  UNUSED(rv);
+
+  ctx->stats_event_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), ctx->stats_fd,
+      WL_EVENT_READABLE, sl_handle_stats_connection, ctx);
+}
+
+// Opens |path| for trace events in the Chrome trace event format, which
+// can be loaded into Perfetto or chrome://tracing. The closing bracket of
+// the event array is optional in this format so the file is valid at any
+// point.
+void sl_trace_open(struct sl_context* ctx, const char* path) {
+  ctx->trace_file = fopen(path, "we");
+  if (!ctx->trace_file) {
+    fprintf(stderr, "error: failed to open trace file %s: %s\n", path,
+            strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  sl_trace_pid = getpid();
+  fprintf(ctx->trace_file, "[\n");
+}
+
+void sl_trace_event(struct sl_context* ctx,
+                    const char* category,
+                    const char* name,
+                    uint64_t start_usec,
+                    uint64_t end_usec) {
+  if (!ctx->trace_file)
+    return;
+
+  fprintf(ctx->trace_file,
+          "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRIu64
+          ",\"dur\":%" PRIu64 ",\"pid\":%d,\"tid\":%d},\n",
+          name, category, start_usec, end_usec - start_usec, sl_trace_pid,
+          sl_trace_pid);
+}
+
+void sl_startup_phase(struct sl_context* ctx,
+                      const char* name,
+                      uint64_t start_usec) {
+  uint64_t now_usec = sl_now_usec();
+
+  if (ctx->log_startup) {
+    fprintf(stderr, "startup: %-16s %8.1f ms (took %.1f ms)\n", name,
+            (now_usec - ctx->startup_usec) / 1000.0,
+            (now_usec - start_usec) / 1000.0);
+  }
+  sl_trace_event(ctx, "startup", name, start_usec, now_usec);
+}
@@ -100,6 +100,11 @@ static void sl_subcompositor_get_subsurface(
       wl_resource_get_user_data(parent_resource);
   struct sl_host_subsurface* host_subsurface;
 
+  // Commits of both surfaces are no longer deferred from now on, so pending
+  // ones have to reach the host first.
+  sl_host_surface_finish_commit(host_surface);
+  sl_host_surface_finish_commit(host_parent);
+
   host_subsurface = malloc(sizeof(*host_subsurface));
   assert(host_subsurface);
 
@@ -113,6 +118,8 @@ static void sl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
   host_surface->has_role = 1;
+  host_surface->in_subsurface_tree = 1;
+  host_parent->in_subsurface_tree = 1;
 }
 
 static const struct wl_subcompositor_interface sl_subcompositor_implementation =
@@ -11,6 +11,7 @@
 #include <libgen.h>
 #include <linux/virtwl.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -86,19 +87,6 @@ struct sl_data_source {
   struct wl_data_source* internal;
 };
 
-enum {
-  PROPERTY_WM_NAME,
-  PROPERTY_WM_CLASS,
-  PROPERTY_WM_TRANSIENT_FOR,
-  PROPERTY_WM_NORMAL_HINTS,
-  PROPERTY_WM_CLIENT_LEADER,
-  PROPERTY_WM_PROTOCOLS,
-  PROPERTY_MOTIF_WM_HINTS,
-  PROPERTY_NET_STARTUP_ID,
-  PROPERTY_NET_WM_STATE,
-  PROPERTY_GTK_THEME_VARIANT,
-};
-
 #define US_POSITION (1L << 0)
 #define US_SIZE (1L << 1)
 #define P_POSITION (1L << 2)
@@ -197,6 +185,28 @@ struct sl_mwm_hints {
 
 #define XCURSOR_SIZE_BASE 24
 
+// Maximum number of virtwl messages forwarded with one sendmmsg/recvmmsg.
+#define VIRTWL_BATCH_MAX 16
+
+#define MIN_VIRTWL_TRANSFER_SIZE 4096
+// Upper bound for --virtwl-transfer-size. Messages are sent in smaller
+// chunks if the driver rejects them as too large.
+#define MAX_VIRTWL_TRANSFER_SIZE 65536
+
+// Upper bound for the size of each chunk of an incremental selection
+// transfer to X11 clients.
+#define MAX_INCR_CHUNK_SIZE (4 * 1024 * 1024)
+
+// Number of freed objects each slab keeps for reuse.
+#define SLAB_MAX_FREE 64
+
+// Upper bound for the total size of converted selection data kept around
+// for repeated requests of the same selection.
+#define SELECTION_CACHE_MAX_SIZE (16 * 1024 * 1024)
+
+// Interval at which output buffers are checked against memory limits.
+#define TRIM_INTERVAL_MS 1000
+
 #ifndef UNIX_PATH_MAX
 #define UNIX_PATH_MAX 108
 #endif
@@ -229,19 +239,48 @@ __attribute__((__format__(__printf__, 1, 0))) static char* sl_xasprintf(
   return str;
 }
 
-struct sl_mmap* sl_mmap_create(int fd,
-                               size_t size,
-                               size_t bpp,
-                               size_t num_planes,
-                               size_t offset0,
-                               size_t stride0,
-                               size_t offset1,
-                               size_t stride1,
-                               size_t y_ss0,
-                               size_t y_ss1) {
+void* sl_slab_alloc(struct sl_slab* slab, size_t size) {
+  void* object = slab->free_list;
+
+  if (object) {
+    slab->free_list = *(void**)object;
+    slab->free_count--;
+    slab->hits++;
+    return object;
+  }
+
+  slab->misses++;
+  object = malloc(MAX(size, sizeof(void*)));
+  assert(object);
+  return object;
+}
+
+void sl_slab_free(struct sl_slab* slab, void* object) {
+  if (slab->free_count >= SLAB_MAX_FREE) {
+    free(object);
+    return;
+  }
+
+  // Free objects are linked through their first bytes.
+  *(void**)object = slab->free_list;
+  slab->free_list = object;
+  slab->free_count++;
+}
+
+static struct sl_mmap* sl_mmap_alloc(struct sl_slab* slab,
+                                     int fd,
+                                     size_t size,
+                                     size_t bpp,
+                                     size_t num_planes,
+                                     size_t offset0,
+                                     size_t stride0,
+                                     size_t offset1,
+                                     size_t stride1,
+                                     size_t y_ss0,
+                                     size_t y_ss1) {
   struct sl_mmap* map;
 
-  map = malloc(sizeof(*map));
+  map = sl_slab_alloc(slab, sizeof(*map));
   map->refcount = 1;
   map->fd = fd;
   map->size = size;
@@ -256,6 +295,27 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = NULL;
   map->end_write = NULL;
   map->buffer_resource = NULL;
+  map->pool = NULL;
+  map->slab = slab;
+
+  return map;
+}
+
+struct sl_mmap* sl_mmap_create(struct sl_context* ctx,
+                               int fd,
+                               size_t size,
+                               size_t bpp,
+                               size_t num_planes,
+                               size_t offset0,
+                               size_t stride0,
+                               size_t offset1,
+                               size_t stride1,
+                               size_t y_ss0,
+                               size_t y_ss1) {
+  struct sl_mmap* map =
+      sl_mmap_alloc(&ctx->mmap_slab, fd, size, bpp, num_planes, offset0,
+                    stride0, offset1, stride1, y_ss0, y_ss1);
+
   map->addr =
       mmap(NULL, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   errno_assert(map->addr != MAP_FAILED);
@@ -263,6 +323,27 @@ struct sl_mmap* sl_mmap_create(int fd,
   return map;
 }
 
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* pool,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1) {
+  struct sl_mmap* map =
+      sl_mmap_alloc(pool->slab, -1, size, bpp, num_planes, offset0, stride0,
+                    offset1, stride1, y_ss0, y_ss1);
+
+  assert(offset0 + size <= pool->size);
+  map->addr = pool->addr;
+  map->pool = sl_mmap_ref(pool);
+
+  return map;
+}
+
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
   map->refcount++;
   return map;
@@ -270,10 +351,13 @@ struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
 
 void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount-- == 1) {
-    munmap(map->addr, map->size + map->offset[0]);
+    if (map->pool)
+      sl_mmap_unref(map->pool);
+    else
+      munmap(map->addr, map->size + map->offset[0]);
     if (map->fd != -1)
       close(map->fd);
-    free(map);
+    sl_slab_free(map->slab, map);
   }
 }
 
@@ -282,12 +366,16 @@ struct sl_sync_point* sl_sync_point_create(int fd) {
 
   sync_point = malloc(sizeof(*sync_point));
   sync_point->fd = fd;
+  sync_point->fence = NULL;
   sync_point->sync = NULL;
+  sync_point->resource = NULL;
 
   return sync_point;
 }
 
 void sl_sync_point_destroy(struct sl_sync_point* sync_point) {
+  if (sync_point->resource)
+    sl_drm_resource_unref(sync_point->resource);
   close(sync_point->fd);
   free(sync_point);
 }
@@ -394,6 +482,82 @@ static void sl_configure_window(struct sl_window* window) {
   window->next_config.states_length = 0;
 }
 
+// Returns the frame interval in milliseconds of the fastest host output.
+static int sl_output_frame_interval(struct sl_context* ctx) {
+  struct sl_host_output* output;
+  int refresh = 0;
+
+  wl_list_for_each(output, &ctx->host_outputs, link)
+    refresh = MAX(refresh, output->refresh);
+  if (!refresh)
+    refresh = 60000;
+
+  // Refresh rates are in mHz.
+  return MAX(1, 1000000 / refresh);
+}
+
+static int sl_window_configure_timer(void* data);
+
+// Configures the window with the next configuration, unless the window is
+// being resized and a configuration was already applied during the current
+// output frame.
+static void sl_window_configure_next(struct sl_window* window) {
+  struct sl_context* ctx = window->ctx;
+
+  if (window->resizing) {
+    if (window->configure_timer_armed) {
+      window->configure_deferred = 1;
+      return;
+    }
+    if (!window->configure_timer) {
+      window->configure_timer =
+          wl_event_loop_add_timer(wl_display_get_event_loop(ctx->host_display),
+                                  sl_window_configure_timer, window);
+    }
+    wl_event_source_timer_update(window->configure_timer,
+                                 sl_output_frame_interval(ctx));
+    window->configure_timer_armed = 1;
+  }
+
+  sl_configure_window(window);
+}
+
+// Applies the next configuration and acks it right away if the contents
+// of the window already match.
+static void sl_window_apply_next_config(struct sl_window* window) {
+  struct wl_resource* host_resource;
+  struct sl_host_surface* host_surface = NULL;
+
+  host_resource =
+      wl_client_get_object(window->ctx->client, window->host_surface_id);
+  if (host_resource)
+    host_surface = wl_resource_get_user_data(host_resource);
+
+  sl_window_configure_next(window);
+
+  if (sl_process_pending_configure_acks(window, host_surface)) {
+    if (host_surface) {
+      sl_host_surface_finish_commit(host_surface);
+      wl_surface_commit(host_surface->proxy);
+    }
+  }
+}
+
+static int sl_window_configure_timer(void* data) {
+  struct sl_window* window = data;
+
+  window->configure_timer_armed = 0;
+  if (!window->configure_deferred)
+    return 0;
+
+  window->configure_deferred = 0;
+  if (window->xdg_surface && window->next_config.serial &&
+      !window->pending_config.serial) {
+    sl_window_apply_next_config(window);
+  }
+  return 0;
+}
+
 static void sl_set_input_focus(struct sl_context* ctx,
                                struct sl_window* window) {
   if (window) {
@@ -470,7 +634,7 @@ int sl_process_pending_configure_acks(struct sl_window* window,
   window->pending_config.serial = 0;
 
   if (window->next_config.serial)
-    sl_configure_window(window);
+    sl_window_configure_next(window);
 
   return 1;
 }
@@ -480,23 +644,14 @@ static void sl_internal_xdg_surface_configure(void* data,
                                               uint32_t serial) {
   struct sl_window* window = xdg_surface_get_user_data(xdg_surface);
 
-  window->next_config.serial = serial;
-  if (!window->pending_config.serial) {
-    struct wl_resource* host_resource;
-    struct sl_host_surface* host_surface = NULL;
-
-    host_resource =
-        wl_client_get_object(window->ctx->client, window->host_surface_id);
-    if (host_resource)
-      host_surface = wl_resource_get_user_data(host_resource);
-
-    sl_configure_window(window);
+  // Only the latest configuration is applied. Acking its serial acks the
+  // ones it replaced.
+  if (window->next_config.serial)
+    window->ctx->stats.configures_coalesced++;
 
-    if (sl_process_pending_configure_acks(window, host_surface)) {
-      if (host_surface)
-        wl_surface_commit(host_surface->proxy);
-    }
-  }
+  window->next_config.serial = serial;
+  if (!window->pending_config.serial)
+    sl_window_apply_next_config(window);
 }
 
 static const struct xdg_surface_listener sl_internal_xdg_surface_listener = {
@@ -537,6 +692,7 @@ static void sl_internal_xdg_toplevel_configure(
   }
 
   window->allow_resize = 1;
+  window->resizing = 0;
   wl_array_for_each(state, states) {
     if (*state == XDG_TOPLEVEL_STATE_FULLSCREEN) {
       window->allow_resize = 0;
@@ -552,8 +708,10 @@ static void sl_internal_xdg_toplevel_configure(
     }
     if (*state == XDG_TOPLEVEL_STATE_ACTIVATED)
       activated = 1;
-    if (*state == XDG_TOPLEVEL_STATE_RESIZING)
+    if (*state == XDG_TOPLEVEL_STATE_RESIZING) {
       window->allow_resize = 0;
+      window->resizing = 1;
+    }
   }
 
   if (activated != window->activated) {
@@ -614,6 +772,26 @@ static void sl_window_set_wm_state(struct sl_window* window, int state) {
                       ctx->atoms[ATOM_WM_STATE].value, 32, 2, values);
 }
 
+// Returns non-zero if |name| or the global application id is listed in
+// --low-resolution. A "*" entry matches everything.
+int sl_low_resolution_match(struct sl_context* ctx, const char* name) {
+  const char* entry = ctx->low_resolution;
+
+  while (entry && *entry) {
+    const char* end = strchrnul(entry, ',');
+    size_t length = end - entry;
+
+    if ((length == 1 && *entry == '*') ||
+        (name && strlen(name) == length && !strncmp(entry, name, length)) ||
+        (ctx->application_id && strlen(ctx->application_id) == length &&
+         !strncmp(entry, ctx->application_id, length)))
+      return 1;
+
+    entry = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
 void sl_update_application_id(struct sl_context* ctx,
                               struct sl_window* window) {
   if (!window->aura_surface)
@@ -642,6 +820,79 @@ void sl_update_application_id(struct sl_context* ctx,
   }
 }
 
+static uint32_t sl_window_hash(uint32_t id) {
+  return (id * 2654435761u) >> 24 & (WINDOW_HASH_SIZE - 1);
+}
+
+static struct sl_window* sl_lookup_window(struct sl_context* ctx,
+                                          xcb_window_t id) {
+  struct wl_list* bucket = &ctx->window_id_hash[sl_window_hash(id)];
+  struct sl_window* window;
+
+  wl_list_for_each(window, bucket, id_link) {
+    if (window->id == id)
+      return window;
+  }
+  bucket = &ctx->window_frame_id_hash[sl_window_hash(id)];
+  wl_list_for_each(window, bucket, frame_id_link) {
+    if (window->frame_id == id)
+      return window;
+  }
+  return NULL;
+}
+
+struct sl_window* sl_lookup_window_by_host_surface_id(struct sl_context* ctx,
+                                                      uint32_t id) {
+  struct wl_list* bucket =
+      &ctx->window_host_surface_id_hash[sl_window_hash(id)];
+  struct sl_window* window;
+
+  wl_list_for_each(window, bucket, host_surface_id_link) {
+    if (window->host_surface_id == id)
+      return window;
+  }
+  return NULL;
+}
+
+static void sl_window_set_frame_id(struct sl_window* window,
+                                   xcb_window_t frame_id) {
+  struct sl_context* ctx = window->ctx;
+
+  if (window->frame_id != XCB_WINDOW_NONE)
+    wl_list_remove(&window->frame_id_link);
+  window->frame_id = frame_id;
+  if (frame_id != XCB_WINDOW_NONE) {
+    wl_list_insert(&ctx->window_frame_id_hash[sl_window_hash(frame_id)],
+                   &window->frame_id_link);
+  }
+}
+
+// Changes the host surface a window is associated with. Callers are
+// expected to call sl_window_update() afterwards to pair the window with
+// the surface.
+void sl_window_set_host_surface_id(struct sl_window* window, uint32_t id) {
+  struct sl_context* ctx = window->ctx;
+
+  if (window->host_surface_id) {
+    struct wl_resource* host_resource =
+        wl_client_get_object(ctx->client, window->host_surface_id);
+
+    if (host_resource) {
+      struct sl_host_surface* host_surface =
+          wl_resource_get_user_data(host_resource);
+
+      if (host_surface->window == window)
+        host_surface->window = NULL;
+    }
+    wl_list_remove(&window->host_surface_id_link);
+  }
+  window->host_surface_id = id;
+  if (id) {
+    wl_list_insert(&ctx->window_host_surface_id_hash[sl_window_hash(id)],
+                   &window->host_surface_id_link);
+  }
+}
+
 void sl_window_update(struct sl_window* window) {
   struct wl_resource* host_resource = NULL;
   struct sl_host_surface* host_surface;
@@ -655,6 +906,10 @@ void sl_window_update(struct sl_window* window) {
       wl_list_insert(&ctx->windows, &window->link);
       window->unpaired = 0;
     }
+    if (host_resource) {
+      host_surface = wl_resource_get_user_data(host_resource);
+      host_surface->window = window;
+    }
   } else if (!window->unpaired) {
     wl_list_remove(&window->link);
     wl_list_insert(&ctx->unpaired_windows, &window->link);
@@ -691,14 +946,11 @@ void sl_window_update(struct sl_window* window) {
 
   if (window->managed) {
     if (window->transient_for != XCB_WINDOW_NONE) {
-      struct sl_window* sibling;
+      struct sl_window* sibling = sl_lookup_window(ctx, window->transient_for);
 
-      wl_list_for_each(sibling, &ctx->windows, link) {
-        if (sibling->id == window->transient_for) {
-          if (sibling->xdg_toplevel)
-            parent = sibling;
-          break;
-        }
+      if (sibling && sibling->id == window->transient_for &&
+          !sibling->unpaired && sibling->xdg_toplevel) {
+        parent = sibling;
       }
     }
   }
@@ -836,6 +1088,7 @@ void sl_window_update(struct sl_window* window) {
                              (window->y - parent->y) / ctx->scale);
   }
 
+  sl_host_surface_finish_commit(host_surface);
   wl_surface_commit(host_surface->proxy);
   if (host_surface->contents_width && host_surface->contents_height)
     window->realized = 1;
@@ -870,19 +1123,20 @@ static void sl_destroy_host_buffer(struct wl_resource* resource) {
     sl_sync_point_destroy(host->sync_point);
   }
   wl_resource_set_user_data(resource, NULL);
-  free(host);
+  sl_slab_free(&host->ctx->host_buffer_slab, host);
 }
 
-struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
+struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
+                                             struct wl_client* client,
                                              uint32_t id,
                                              struct wl_buffer* proxy,
                                              int32_t width,
                                              int32_t height) {
   struct sl_host_buffer* host_buffer;
 
-  host_buffer = malloc(sizeof(*host_buffer));
-  assert(host_buffer);
+  host_buffer = sl_slab_alloc(&ctx->host_buffer_slab, sizeof(*host_buffer));
 
+  host_buffer->ctx = ctx;
   host_buffer->width = width;
   host_buffer->height = height;
   host_buffer->resource =
@@ -903,6 +1157,103 @@ struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
   return host_buffer;
 }
 
+struct sl_selection_cache_entry {
+  struct wl_list link;
+  xcb_atom_t target;
+  uint32_t serial;
+  struct wl_array data;
+};
+
+static struct sl_selection_cache_entry* sl_selection_cache_entry_create(
+    struct sl_context* ctx, xcb_atom_t target) {
+  struct sl_selection_cache_entry* entry;
+
+  entry = malloc(sizeof(*entry));
+  assert(entry);
+  entry->target = target;
+  entry->serial = ctx->selection_cache_serial;
+  wl_array_init(&entry->data);
+  return entry;
+}
+
+static void sl_selection_cache_entry_destroy(
+    struct sl_selection_cache_entry* entry) {
+  wl_array_release(&entry->data);
+  free(entry);
+}
+
+// Adds |entry| to the front of the cache unless the selection changed since
+// it was created, evicting least recently used entries to stay within
+// SELECTION_CACHE_MAX_SIZE.
+static void sl_selection_cache_insert(struct sl_context* ctx,
+                                      struct sl_selection_cache_entry* entry) {
+  if (entry->serial != ctx->selection_cache_serial ||
+      entry->data.size > SELECTION_CACHE_MAX_SIZE) {
+    sl_selection_cache_entry_destroy(entry);
+    return;
+  }
+
+  while (ctx->selection_cache_size + entry->data.size >
+         SELECTION_CACHE_MAX_SIZE) {
+    struct sl_selection_cache_entry* oldest = wl_container_of(
+        ctx->selection_cache.prev, oldest, link);
+
+    wl_list_remove(&oldest->link);
+    ctx->selection_cache_size -= oldest->data.size;
+    sl_selection_cache_entry_destroy(oldest);
+  }
+
+  wl_list_insert(&ctx->selection_cache, &entry->link);
+  ctx->selection_cache_size += entry->data.size;
+}
+
+// Takes the entry for |target| off the cache, or returns NULL if there is
+// none.
+static struct sl_selection_cache_entry* sl_selection_cache_take(
+    struct sl_context* ctx, xcb_atom_t target) {
+  struct sl_selection_cache_entry* entry;
+
+  wl_list_for_each(entry, &ctx->selection_cache, link) {
+    if (entry->target == target) {
+      wl_list_remove(&entry->link);
+      ctx->selection_cache_size -= entry->data.size;
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void sl_selection_cache_clear(struct sl_context* ctx) {
+  struct sl_selection_cache_entry* entry;
+  struct sl_selection_cache_entry* next;
+
+  wl_list_for_each_safe(entry, next, &ctx->selection_cache, link) {
+    wl_list_remove(&entry->link);
+    sl_selection_cache_entry_destroy(entry);
+  }
+  ctx->selection_cache_size = 0;
+  ctx->selection_cache_serial++;
+}
+
+// Abandons a transfer served from the selection cache, as its requestor
+// might never ask for the rest of the data. The entry goes back to the
+// cache.
+static void sl_selection_cache_cancel_read(struct sl_context* ctx) {
+  struct sl_selection_cache_entry* entry = ctx->selection_cache_read_entry;
+
+  if (!entry)
+    return;
+
+  ctx->selection_cache_read_entry = NULL;
+  sl_selection_cache_insert(ctx, entry);
+
+  ctx->selection_request.requestor = XCB_NONE;
+  ctx->selection_incremental_transfer = 0;
+  ctx->selection_data_ack_pending = 0;
+  wl_array_release(&ctx->selection_data);
+  wl_array_init(&ctx->selection_data);
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
   wl_data_offer_destroy(host->internal);
   wl_array_release(&host->atoms);
@@ -912,6 +1263,9 @@ static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
 
 static void sl_set_selection(struct sl_context* ctx,
                              struct sl_data_offer* data_offer) {
+  sl_selection_cache_cancel_read(ctx);
+  sl_selection_cache_clear(ctx);
+
   if (ctx->selection_data_offer) {
     sl_internal_data_offer_destroy(ctx->selection_data_offer);
     ctx->selection_data_offer = NULL;
@@ -1085,6 +1439,27 @@ static void sl_global_destroy(struct sl_global* global) {
   free(global);
 }
 
+static void sl_linux_dmabuf_format(void* data,
+                                   struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                   uint32_t format) {}
+
+static void sl_linux_dmabuf_modifier(void* data,
+                                     struct zwp_linux_dmabuf_v1* linux_dmabuf,
+                                     uint32_t format,
+                                     uint32_t modifier_hi,
+                                     uint32_t modifier_lo) {
+  struct sl_linux_dmabuf* host = (struct sl_linux_dmabuf*)data;
+  struct sl_dmabuf_modifier* m;
+
+  m = wl_array_add(&host->modifiers, sizeof(*m));
+  assert(m);
+  m->format = format;
+  m->modifier = ((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+static const struct zwp_linux_dmabuf_v1_listener sl_linux_dmabuf_listener = {
+    sl_linux_dmabuf_format, sl_linux_dmabuf_modifier};
+
 static void sl_registry_handler(void* data,
                                 struct wl_registry* registry,
                                 uint32_t id,
@@ -1240,12 +1615,20 @@ static void sl_registry_handler(void* data,
     assert(linux_dmabuf);
     linux_dmabuf->ctx = ctx;
     linux_dmabuf->id = id;
-    linux_dmabuf->version = MIN(2, version);
+    linux_dmabuf->version = MIN(3, version);
     linux_dmabuf->internal = wl_registry_bind(
         registry, id, &zwp_linux_dmabuf_v1_interface, linux_dmabuf->version);
+    wl_array_init(&linux_dmabuf->modifiers);
+    zwp_linux_dmabuf_v1_add_listener(linux_dmabuf->internal,
+                                     &sl_linux_dmabuf_listener, linux_dmabuf);
     assert(!ctx->linux_dmabuf);
     ctx->linux_dmabuf = linux_dmabuf;
     linux_dmabuf->host_drm_global = sl_drm_global_create(ctx);
+    linux_dmabuf->host_linux_dmabuf_global = NULL;
+    if (ctx->dmabuf_modifiers) {
+      linux_dmabuf->host_linux_dmabuf_global =
+          sl_linux_dmabuf_global_create(ctx);
+    }
   } else if (strcmp(interface, "zcr_keyboard_extension_v1") == 0) {
     struct sl_keyboard_extension* keyboard_extension =
         malloc(sizeof(struct sl_keyboard_extension));
@@ -1340,7 +1723,10 @@ static void sl_registry_remover(void* data,
   if (ctx->linux_dmabuf && ctx->linux_dmabuf->id == id) {
     if (ctx->linux_dmabuf->host_drm_global)
       sl_global_destroy(ctx->linux_dmabuf->host_drm_global);
+    if (ctx->linux_dmabuf->host_linux_dmabuf_global)
+      sl_global_destroy(ctx->linux_dmabuf->host_linux_dmabuf_global);
     zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf->internal);
+    wl_array_release(&ctx->linux_dmabuf->modifiers);
     free(ctx->linux_dmabuf);
     ctx->linux_dmabuf = NULL;
     return;
@@ -1399,30 +1785,139 @@ static int sl_handle_event(int fd, uint32_t mask, void* data) {
   int count = 0;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(ctx->client);
+    wl_display_flush_clients(ctx->host_display);
     exit(EXIT_SUCCESS);
   }
 
-  if (mask & WL_EVENT_READABLE)
-    count = wl_display_dispatch(ctx->display);
+  // Events are read and dispatched without the flush and poll that
+  // wl_display_dispatch() would do. All connections are flushed once per
+  // event loop iteration by sl_flush().
+  if (mask & WL_EVENT_READABLE) {
+    while (wl_display_prepare_read(ctx->display) != 0)
+      wl_display_dispatch_pending(ctx->display);
+    count = wl_display_read_events(ctx->display);
+    if (count != -1)
+      count = wl_display_dispatch_pending(ctx->display);
+  }
   if (mask & WL_EVENT_WRITABLE)
     wl_display_flush(ctx->display);
 
-  if (mask == 0) {
+  if (mask == 0)
     count = wl_display_dispatch_pending(ctx->display);
-    wl_display_flush(ctx->display);
-  }
+
+  if (count > 0)
+    ctx->stats.events_dispatched += count;
 
   return count;
 }
 
+static xcb_atom_t sl_window_property_atom(struct sl_context* ctx, int type) {
+  switch (type) {
+    case PROPERTY_WM_NAME:
+      return XCB_ATOM_WM_NAME;
+    case PROPERTY_WM_CLASS:
+      return XCB_ATOM_WM_CLASS;
+    case PROPERTY_WM_TRANSIENT_FOR:
+      return XCB_ATOM_WM_TRANSIENT_FOR;
+    case PROPERTY_WM_NORMAL_HINTS:
+      return XCB_ATOM_WM_NORMAL_HINTS;
+    case PROPERTY_WM_CLIENT_LEADER:
+      return ctx->atoms[ATOM_WM_CLIENT_LEADER].value;
+    case PROPERTY_WM_PROTOCOLS:
+      return ctx->atoms[ATOM_WM_PROTOCOLS].value;
+    case PROPERTY_MOTIF_WM_HINTS:
+      return ctx->atoms[ATOM_MOTIF_WM_HINTS].value;
+    case PROPERTY_NET_STARTUP_ID:
+      return ctx->atoms[ATOM_NET_STARTUP_ID].value;
+    case PROPERTY_NET_WM_STATE:
+      return ctx->atoms[ATOM_NET_WM_STATE].value;
+    case PROPERTY_GTK_THEME_VARIANT:
+      return ctx->atoms[ATOM_GTK_THEME_VARIANT].value;
+  }
+  return XCB_ATOM_NONE;
+}
+
+static void sl_window_discard_property(struct sl_window* window, int type) {
+  struct sl_window_property* property = &window->properties[type];
+
+  if (property->pending) {
+    xcb_discard_reply(window->ctx->connection, property->cookie.sequence);
+    property->pending = 0;
+  }
+  free(property->reply);
+  property->reply = NULL;
+  property->valid = 0;
+}
+
+static void sl_window_fetch_property(struct sl_window* window, int type) {
+  struct sl_window_property* property = &window->properties[type];
+  struct sl_context* ctx = window->ctx;
+
+  sl_window_discard_property(window, type);
+  property->cookie =
+      xcb_get_property(ctx->connection, 0, window->id,
+                       sl_window_property_atom(ctx, type), XCB_ATOM_ANY, 0,
+                       2048);
+  property->pending = 1;
+  property->valid = 1;
+}
+
+// Starts fetching all properties that are not already cached.
+static void sl_window_prefetch_properties(struct sl_window* window) {
+  int type;
+
+  for (type = 0; type < PROPERTY_COUNT; ++type) {
+    if (!window->properties[type].valid)
+      sl_window_fetch_property(window, type);
+  }
+}
+
+// Returns the cached property value of |window|, waiting for the reply only
+// if it is still in flight. Returns NULL if the property is not set.
+static xcb_get_property_reply_t* sl_window_get_property(
+    struct sl_window* window,
+    int type) {
+  struct sl_window_property* property = &window->properties[type];
+
+  if (!property->valid)
+    sl_window_fetch_property(window, type);
+  if (property->pending) {
+    property->reply = xcb_get_property_reply(window->ctx->connection,
+                                             property->cookie, NULL);
+    property->pending = 0;
+  }
+  if (property->reply && property->reply->type == XCB_ATOM_NONE)
+    return NULL;
+  return property->reply;
+}
+
+// Invalidates the cached value of |atom|. The new value is fetched right
+// away unless the window is managed, as the property change handling of
+// managed windows fetches the values that it needs itself, or the value was
+// never fetched, as for override-redirect windows.
+static void sl_window_invalidate_property(struct sl_window* window,
+                                          xcb_atom_t atom) {
+  int type;
+
+  for (type = 0; type < PROPERTY_COUNT; ++type) {
+    if (sl_window_property_atom(window->ctx, type) != atom)
+      continue;
+
+    if (window->managed || !window->properties[type].valid)
+      sl_window_discard_property(window, type);
+    else
+      sl_window_fetch_property(window, type);
+  }
+}
+
 static void sl_create_window(struct sl_context* ctx,
                              xcb_window_t id,
                              int x,
                              int y,
                              int width,
                              int height,
-                             int border_width) {
+                             int border_width,
+                             int override_redirect) {
   struct sl_window* window = malloc(sizeof(struct sl_window));
   uint32_t values[1];
   assert(window);
@@ -1431,6 +1926,7 @@ static void sl_create_window(struct sl_context* ctx,
   window->frame_id = XCB_WINDOW_NONE;
   window->host_surface_id = 0;
   window->unpaired = 1;
+  wl_list_insert(&ctx->window_id_hash[sl_window_hash(id)], &window->id_link);
   window->x = x;
   window->y = y;
   window->width = width;
@@ -1447,6 +1943,7 @@ static void sl_create_window(struct sl_context* ctx,
   window->decorated = 0;
   window->name = NULL;
   window->clazz = NULL;
+  window->low_resolution = sl_low_resolution_match(ctx, NULL);
   window->startup_id = NULL;
   window->dark_frame = 0;
   window->size_flags = P_POSITION;
@@ -1465,21 +1962,40 @@ static void sl_create_window(struct sl_context* ctx,
   window->pending_config.serial = 0;
   window->pending_config.mask = 0;
   window->pending_config.states_length = 0;
+  window->resizing = 0;
+  window->configure_timer = NULL;
+  window->configure_timer_armed = 0;
+  window->configure_deferred = 0;
   wl_list_insert(&ctx->unpaired_windows, &window->link);
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb_change_window_attributes(ctx->connection, window->id, XCB_CW_EVENT_MASK,
                                values);
+
+  // Start fetching what is needed to map the window. Property changes after
+  // this point are tracked by sl_handle_property_notify(). Override-redirect
+  // windows are never managed, so they don't need the properties.
+  window->geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
+  window->geometry_pending = 1;
+  memset(window->properties, 0, sizeof(window->properties));
+  if (!override_redirect)
+    sl_window_prefetch_properties(window);
 }
 
 static void sl_destroy_window(struct sl_window* window) {
+  int i;
+
   if (window->frame_id != XCB_WINDOW_NONE)
     xcb_destroy_window(window->ctx->connection, window->frame_id);
+  sl_window_set_frame_id(window, XCB_WINDOW_NONE);
+  sl_window_set_host_surface_id(window, 0);
 
   if (window->ctx->host_focus_window == window) {
     window->ctx->host_focus_window = NULL;
     window->ctx->needs_set_input_focus = 1;
   }
 
+  if (window->configure_timer)
+    wl_event_source_remove(window->configure_timer);
   if (window->xdg_popup)
     xdg_popup_destroy(window->xdg_popup);
   if (window->xdg_toplevel)
@@ -1496,35 +2012,16 @@ static void sl_destroy_window(struct sl_window* window) {
   if (window->startup_id)
     free(window->startup_id);
 
-  wl_list_remove(&window->link);
-  free(window);
-}
-
-static int sl_is_window(struct sl_window* window, xcb_window_t id) {
-  if (window->id == id)
-    return 1;
-
-  if (window->frame_id != XCB_WINDOW_NONE) {
-    if (window->frame_id == id)
-      return 1;
+  for (i = 0; i < PROPERTY_COUNT; ++i)
+    sl_window_discard_property(window, i);
+  if (window->geometry_pending) {
+    xcb_discard_reply(window->ctx->connection,
+                      window->geometry_cookie.sequence);
   }
 
-  return 0;
-}
-
-static struct sl_window* sl_lookup_window(struct sl_context* ctx,
-                                          xcb_window_t id) {
-  struct sl_window* window;
-
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  wl_list_for_each(window, &ctx->unpaired_windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  return NULL;
+  wl_list_remove(&window->link);
+  wl_list_remove(&window->id_link);
+  free(window);
 }
 
 static int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
@@ -1539,13 +2036,17 @@ static void sl_handle_create_notify(struct sl_context* ctx,
     return;
 
   sl_create_window(ctx, event->window, event->x, event->y, event->width,
-                   event->height, event->border_width);
+                   event->height, event->border_width,
+                   event->override_redirect);
 }
 
 static void sl_handle_destroy_notify(struct sl_context* ctx,
                                      xcb_destroy_notify_event_t* event) {
   struct sl_window* window;
 
+  if (event->window == ctx->selection_request.requestor)
+    sl_selection_cache_cancel_read(ctx);
+
   if (sl_is_our_window(ctx, event->window))
     return;
 
@@ -1582,7 +2083,7 @@ static void sl_handle_reparent_notify(struct sl_context* ctx,
       free(geometry_reply);
     }
     sl_create_window(ctx, event->window, event->x, event->y, width, height,
-                     border_width);
+                     border_width, event->override_redirect);
     return;
   }
 
@@ -1608,34 +2109,18 @@ static void sl_decode_wm_class(struct sl_window* window,
     window->clazz = strndup(value + instance_length + 1,
                             value_length - instance_length - 1);
   }
+  window->low_resolution = sl_low_resolution_match(window->ctx, window->clazz);
 }
 
 static void sl_handle_map_request(struct sl_context* ctx,
                                   xcb_map_request_event_t* event) {
   struct sl_window* window = sl_lookup_window(ctx, event->window);
-  struct {
-    int type;
-    xcb_atom_t atom;
-  } properties[] = {
-      {PROPERTY_WM_NAME, XCB_ATOM_WM_NAME},
-      {PROPERTY_WM_CLASS, XCB_ATOM_WM_CLASS},
-      {PROPERTY_WM_TRANSIENT_FOR, XCB_ATOM_WM_TRANSIENT_FOR},
-      {PROPERTY_WM_NORMAL_HINTS, XCB_ATOM_WM_NORMAL_HINTS},
-      {PROPERTY_WM_CLIENT_LEADER, ctx->atoms[ATOM_WM_CLIENT_LEADER].value},
-      {PROPERTY_WM_PROTOCOLS, ctx->atoms[ATOM_WM_PROTOCOLS].value},
-      {PROPERTY_MOTIF_WM_HINTS, ctx->atoms[ATOM_MOTIF_WM_HINTS].value},
-      {PROPERTY_NET_STARTUP_ID, ctx->atoms[ATOM_NET_STARTUP_ID].value},
-      {PROPERTY_NET_WM_STATE, ctx->atoms[ATOM_NET_WM_STATE].value},
-      {PROPERTY_GTK_THEME_VARIANT, ctx->atoms[ATOM_GTK_THEME_VARIANT].value},
-  };
-  xcb_get_geometry_cookie_t geometry_cookie;
-  xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
   struct sl_wm_size_hints size_hints = {0};
   struct sl_mwm_hints mwm_hints = {0};
   xcb_atom_t* reply_atoms;
   bool maximize_h = false, maximize_v = false;
   uint32_t values[5];
-  int i;
+  int type, i;
 
   if (!window)
     return;
@@ -1644,23 +2129,15 @@ static void sl_handle_map_request(struct sl_context* ctx,
     return;
 
   window->managed = 1;
-  if (window->frame_id == XCB_WINDOW_NONE)
-    geometry_cookie = xcb_get_geometry(ctx->connection, window->id);
-
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
-    property_cookies[i] =
-        xcb_get_property(ctx->connection, 0, window->id, properties[i].atom,
-                         XCB_ATOM_ANY, 0, 2048);
-  }
 
-  if (window->frame_id == XCB_WINDOW_NONE) {
-    xcb_get_geometry_reply_t* geometry_reply =
-        xcb_get_geometry_reply(ctx->connection, geometry_cookie, NULL);
+  // Position and size of unmanaged windows are kept up to date by
+  // sl_handle_configure_request() and sl_handle_configure_notify() so only
+  // the depth is needed here.
+  if (window->geometry_pending) {
+    xcb_get_geometry_reply_t* geometry_reply = xcb_get_geometry_reply(
+        ctx->connection, window->geometry_cookie, NULL);
+    window->geometry_pending = 0;
     if (geometry_reply) {
-      window->x = geometry_reply->x;
-      window->y = geometry_reply->y;
-      window->width = geometry_reply->width;
-      window->height = geometry_reply->height;
       window->depth = geometry_reply->depth;
       free(geometry_reply);
     }
@@ -1670,6 +2147,7 @@ static void sl_handle_map_request(struct sl_context* ctx,
   window->name = NULL;
   free(window->clazz);
   window->clazz = NULL;
+  window->low_resolution = sl_low_resolution_match(ctx, NULL);
   free(window->startup_id);
   window->startup_id = NULL;
   window->transient_for = XCB_WINDOW_NONE;
@@ -1678,19 +2156,13 @@ static void sl_handle_map_request(struct sl_context* ctx,
   window->size_flags = 0;
   window->dark_frame = 0;
 
-  for (i = 0; i < ARRAY_SIZE(properties); ++i) {
-    xcb_get_property_reply_t* reply =
-        xcb_get_property_reply(ctx->connection, property_cookies[i], NULL);
+  for (type = 0; type < PROPERTY_COUNT; ++type) {
+    xcb_get_property_reply_t* reply = sl_window_get_property(window, type);
 
     if (!reply)
       continue;
 
-    if (reply->type == XCB_ATOM_NONE) {
-      free(reply);
-      continue;
-    }
-
-    switch (properties[i].type) {
+    switch (type) {
       case PROPERTY_WM_NAME:
         window->name = strndup(xcb_get_property_value(reply),
                                xcb_get_property_value_length(reply));
@@ -1753,7 +2225,6 @@ static void sl_handle_map_request(struct sl_context* ctx,
       default:
         break;
     }
-    free(reply);
   }
 
   if (mwm_hints.flags & MWM_HINTS_DECORATIONS) {
@@ -1830,7 +2301,7 @@ static void sl_handle_map_request(struct sl_context* ctx,
                 XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
     values[2] = ctx->colormaps[depth];
 
-    window->frame_id = xcb_generate_id(ctx->connection);
+    sl_window_set_frame_id(window, xcb_generate_id(ctx->connection));
     xcb_create_window(
         ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
         window->y, window->width, window->height, 0,
@@ -1883,7 +2354,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
   }
 
   if (window->host_surface_id) {
-    window->host_surface_id = 0;
+    sl_window_set_host_surface_id(window, 0);
     sl_window_update(window);
   }
 
@@ -1894,7 +2365,7 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
     xcb_reparent_window(ctx->connection, window->id, ctx->screen->root,
                         window->x, window->y);
     xcb_destroy_window(ctx->connection, window->frame_id);
-    window->frame_id = XCB_WINDOW_NONE;
+    sl_window_set_frame_id(window, XCB_WINDOW_NONE);
   }
 
   // Reset properties to unmanaged state in case the window transitions to
@@ -1902,6 +2373,10 @@ static void sl_handle_unmap_notify(struct sl_context* ctx,
   window->managed = 0;
   window->decorated = 0;
   window->size_flags = P_POSITION;
+
+  // Refetch properties that changed while the window was managed so the
+  // next map request doesn't have to wait for them.
+  sl_window_prefetch_properties(window);
 }
 
 static void sl_handle_configure_request(struct sl_context* ctx,
@@ -1917,16 +2392,18 @@ static void sl_handle_configure_request(struct sl_context* ctx,
   if (!window->managed) {
     int i = 0;
 
+    // The geometry is updated right away, as a map request can arrive
+    // before the configure notify for this request.
     if (event->value_mask & XCB_CONFIG_WINDOW_X)
-      values[i++] = event->x;
+      values[i++] = window->x = event->x;
     if (event->value_mask & XCB_CONFIG_WINDOW_Y)
-      values[i++] = event->y;
+      values[i++] = window->y = event->y;
     if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH)
-      values[i++] = event->width;
+      values[i++] = window->width = event->width;
     if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT)
-      values[i++] = event->height;
+      values[i++] = window->height = event->height;
     if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH)
-      values[i++] = event->border_width;
+      values[i++] = window->border_width = event->border_width;
     if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING)
       values[i++] = event->sibling;
     if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE)
@@ -2106,18 +2583,11 @@ static void sl_request_attention(struct sl_context* ctx,
 static void sl_handle_client_message(struct sl_context* ctx,
                                      xcb_client_message_event_t* event) {
   if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
-    struct sl_window *window, *unpaired_window = NULL;
-
-    wl_list_for_each(window, &ctx->unpaired_windows, link) {
-      if (sl_is_window(window, event->window)) {
-        unpaired_window = window;
-        break;
-      }
-    }
+    struct sl_window* window = sl_lookup_window(ctx, event->window);
 
-    if (unpaired_window) {
-      unpaired_window->host_surface_id = event->data.data32[0];
-      sl_window_update(unpaired_window);
+    if (window && window->unpaired) {
+      sl_window_set_host_surface_id(window, event->data.data32[0]);
+      sl_window_update(window);
     }
   } else if (event->type == ctx->atoms[ATOM_NET_ACTIVE_WINDOW].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
@@ -2197,6 +2667,12 @@ static void sl_handle_focus_in(struct sl_context* ctx,
 static void sl_handle_focus_out(struct sl_context* ctx,
                                 xcb_focus_out_event_t* event) {}
 
+static void sl_selection_transfer_done(struct sl_transfer_counters* counters,
+                                       uint64_t start_usec) {
+  counters->transfers++;
+  counters->usec += sl_now_usec() - start_usec;
+}
+
 int sl_begin_data_source_send(struct sl_context* ctx,
                               int fd,
                               xcb_intern_atom_cookie_t cookie,
@@ -2220,6 +2696,9 @@ int sl_begin_data_source_send(struct sl_context* ctx,
   errno_assert(!rv);
 
   ctx->selection_data_source_send_fd = fd;
+  ctx->selection_property_requested = 0;
+  ctx->selection_property_new_value = 0;
+  ctx->selection_send_start_usec = sl_now_usec();
   free(reply);
   return 1;
 }
@@ -2233,12 +2712,14 @@ void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
 
     int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
                                        request->data_source);
-    free(request);
+    sl_slab_free(&ctx->send_request_slab, request);
     if (rv)
       break;
   }
 }
 
+static void sl_receive_selection_chunk(struct sl_context* ctx);
+
 static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = data;
   uint8_t* value;
@@ -2253,15 +2734,24 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
     fprintf(stderr, "write error to target fd: %m\n");
     close(fd);
     fd = -1;
+
+    // Drop the chunk that was requested ahead.
+    if (ctx->selection_property_requested) {
+      xcb_discard_reply(ctx->connection,
+                        ctx->selection_property_cookie.sequence);
+      ctx->selection_property_requested = 0;
+    }
+    ctx->selection_property_new_value = 0;
   } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
-    } else {
+    ctx->selection_to_wayland.bytes += bytes;
+    if (!ctx->selection_incremental_transfer) {
+      sl_selection_transfer_done(&ctx->selection_to_wayland,
+                                 ctx->selection_send_start_usec);
       close(fd);
       fd = -1;
     }
   } else {
+    ctx->selection_to_wayland.bytes += bytes;
     ctx->selection_property_offset += bytes;
     return 1;
   }
@@ -2275,6 +2765,8 @@ static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
   if (fd < 0) {
     ctx->selection_data_source_send_fd = -1;
     sl_process_data_source_send_pending_list(ctx);
+  } else if (ctx->selection_property_requested) {
+    sl_receive_selection_chunk(ctx);
   }
   return 1;
 }
@@ -2286,18 +2778,56 @@ static void sl_write_selection_property(struct sl_context* ctx,
   sl_handle_selection_fd_writable(ctx->selection_data_source_send_fd,
                                   WL_EVENT_WRITABLE, ctx);
 
-  if (!ctx->selection_property_reply)
+  // Writing might have moved on to a chunk that is already waiting to be
+  // written.
+  if (!ctx->selection_property_reply || ctx->selection_send_event_source)
     return;
 
-  assert(!ctx->selection_send_event_source);
   ctx->selection_send_event_source = wl_event_loop_add_fd(
       wl_display_get_event_loop(ctx->host_display),
       ctx->selection_data_source_send_fd, WL_EVENT_WRITABLE,
       sl_handle_selection_fd_writable, ctx);
 }
 
-static void sl_send_selection_notify(struct sl_context* ctx,
-                                     xcb_atom_t property) {
+// Requests the next chunk of an incremental transfer from X11. The property
+// is deleted by the same request so the selection owner can provide the
+// following chunk while this one is written out.
+static void sl_request_selection_chunk(struct sl_context* ctx) {
+  ctx->selection_property_cookie = xcb_get_property(
+      ctx->connection, 1, ctx->selection_window,
+      ctx->atoms[ATOM_WL_SELECTION].value, XCB_GET_PROPERTY_TYPE_ANY, 0,
+      0x1fffffff);
+  ctx->selection_property_requested = 1;
+  ctx->selection_property_new_value = 0;
+}
+
+static void sl_receive_selection_chunk(struct sl_context* ctx) {
+  xcb_get_property_reply_t* reply = xcb_get_property_reply(
+      ctx->connection, ctx->selection_property_cookie, NULL);
+
+  ctx->selection_property_requested = 0;
+  if (!reply)
+    return;
+
+  if (xcb_get_property_value_length(reply) > 0) {
+    // The selection owner might already have provided the next chunk.
+    if (ctx->selection_property_new_value)
+      sl_request_selection_chunk(ctx);
+    sl_write_selection_property(ctx, reply);
+  } else {
+    assert(!ctx->selection_send_event_source);
+    sl_selection_transfer_done(&ctx->selection_to_wayland,
+                               ctx->selection_send_start_usec);
+    close(ctx->selection_data_source_send_fd);
+    ctx->selection_data_source_send_fd = -1;
+    free(reply);
+
+    sl_process_data_source_send_pending_list(ctx);
+  }
+}
+
+static void sl_send_selection_notify(struct sl_context* ctx,
+                                     xcb_atom_t property) {
   xcb_selection_notify_event_t event = {
       .response_type = XCB_SELECTION_NOTIFY,
       .sequence = 0,
@@ -2322,35 +2852,99 @@ static void sl_send_selection_data(struct sl_context* ctx) {
   ctx->selection_data.size = 0;
 }
 
-static const uint32_t sl_incr_chunk_size = 64 * 1024;
+// Ends receiving data of the transfer in progress. Data received from the
+// data offer is added to the selection cache if |complete| is set.
+static void sl_end_selection_receive(struct sl_context* ctx, int complete) {
+  struct sl_selection_cache_entry* entry;
 
-static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = data;
+  if (ctx->selection_cache_read_entry) {
+    entry = ctx->selection_cache_read_entry;
+    ctx->selection_cache_read_entry = NULL;
+    sl_selection_cache_insert(ctx, entry);
+    return;
+  }
+
+  entry = ctx->selection_cache_fill_entry;
+  ctx->selection_cache_fill_entry = NULL;
+  if (entry) {
+    if (complete)
+      sl_selection_cache_insert(ctx, entry);
+    else
+      sl_selection_cache_entry_destroy(entry);
+  }
+
+  close(ctx->selection_data_offer_receive_fd);
+  ctx->selection_data_offer_receive_fd = -1;
+}
+
+// Returns true if more data of the transfer in progress is to be received,
+// either from the data offer or from the selection cache.
+static int sl_selection_receive_pending(struct sl_context* ctx) {
+  return ctx->selection_data_offer_receive_fd >= 0 ||
+         ctx->selection_cache_read_entry;
+}
+
+static int sl_read_selection_data(struct sl_context* ctx,
+                                  void* p,
+                                  int bytes_left) {
+  struct sl_selection_cache_entry* entry = ctx->selection_cache_read_entry;
+  struct sl_selection_cache_entry* fill = ctx->selection_cache_fill_entry;
+  size_t bytes;
+  int rv;
+
+  if (entry) {
+    bytes = MIN((size_t)bytes_left,
+                entry->data.size - ctx->selection_cache_read_offset);
+    memcpy(p, (char*)entry->data.data + ctx->selection_cache_read_offset,
+           bytes);
+    ctx->selection_cache_read_offset += bytes;
+    return bytes;
+  }
+
+  rv = read(ctx->selection_data_offer_receive_fd, p, bytes_left);
+
+  // Keep a copy for repeated requests unless the data turns out to be too
+  // large to cache.
+  if (fill && rv > 0) {
+    if (fill->data.size + rv > SELECTION_CACHE_MAX_SIZE) {
+      sl_selection_cache_entry_destroy(fill);
+      ctx->selection_cache_fill_entry = NULL;
+    } else {
+      memcpy(wl_array_add(&fill->data, rv), p, rv);
+    }
+  }
+  return rv;
+}
+
+// Receives the next part of the selection data and forwards it to the
+// requestor. Returns true if more data should be received right away.
+static int sl_receive_selection_data(struct sl_context* ctx) {
   int bytes, offset, bytes_left;
   void* p;
 
   offset = ctx->selection_data.size;
-  if (ctx->selection_data.size < sl_incr_chunk_size)
-    p = wl_array_add(&ctx->selection_data, sl_incr_chunk_size);
+  if (ctx->selection_data.size < ctx->selection_incr_chunk_size)
+    p = wl_array_add(&ctx->selection_data, ctx->selection_incr_chunk_size);
   else
     p = (char*)ctx->selection_data.data + ctx->selection_data.size;
   bytes_left = ctx->selection_data.alloc - offset;
 
-  bytes = read(fd, p, bytes_left);
+  bytes = sl_read_selection_data(ctx, p, bytes_left);
   if (bytes == -1) {
     fprintf(stderr, "read error from data source: %m\n");
     sl_send_selection_notify(ctx, XCB_ATOM_NONE);
-    ctx->selection_data_offer_receive_fd = -1;
-    close(fd);
+    sl_end_selection_receive(ctx, 0);
   } else {
     ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
+    ctx->selection_to_x.bytes += bytes;
+    if (ctx->selection_data.size >= ctx->selection_incr_chunk_size) {
       if (!ctx->selection_incremental_transfer) {
         ctx->selection_incremental_transfer = 1;
         xcb_change_property(
             ctx->connection, XCB_PROP_MODE_REPLACE,
             ctx->selection_request.requestor, ctx->selection_request.property,
-            ctx->atoms[ATOM_INCR].value, 32, 1, &sl_incr_chunk_size);
+            ctx->atoms[ATOM_INCR].value, 32, 1,
+            &ctx->selection_incr_chunk_size);
         ctx->selection_data_ack_pending = 1;
         sl_send_selection_notify(ctx, ctx->selection_request.property);
       } else if (!ctx->selection_data_ack_pending) {
@@ -2363,16 +2957,31 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
         sl_send_selection_notify(ctx, ctx->selection_request.property);
         ctx->selection_request.requestor = XCB_NONE;
         wl_array_release(&ctx->selection_data);
+        sl_selection_transfer_done(&ctx->selection_to_x,
+                                   ctx->selection_receive_start_usec);
       }
-      xcb_flush(ctx->connection);
-      ctx->selection_data_offer_receive_fd = -1;
-      close(fd);
+      sl_end_selection_receive(ctx, 1);
     } else {
-      ctx->selection_data.size = offset + bytes;
       return 1;
     }
   }
 
+  return 0;
+}
+
+// Cached data is received in one go up to the next chunk boundary, just like
+// a data offer that never blocks.
+static void sl_receive_cached_selection_data(struct sl_context* ctx) {
+  while (sl_receive_selection_data(ctx))
+    continue;
+}
+
+static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = data;
+
+  if (sl_receive_selection_data(ctx))
+    return 1;
+
   wl_event_source_remove(ctx->selection_event_source);
   ctx->selection_event_source = NULL;
   return 1;
@@ -2380,6 +2989,11 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
 
 static void sl_handle_property_notify(struct sl_context* ctx,
                                       xcb_property_notify_event_t* event) {
+  struct sl_window* cached_window = sl_lookup_window(ctx, event->window);
+
+  if (cached_window)
+    sl_window_invalidate_property(cached_window, event->atom);
+
   if (event->atom == XCB_ATOM_WM_NAME) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (!window)
@@ -2565,26 +3179,15 @@ static void sl_handle_property_notify(struct sl_context* ctx,
     if (event->window == ctx->selection_window &&
         event->state == XCB_PROPERTY_NEW_VALUE &&
         ctx->selection_incremental_transfer) {
-      xcb_get_property_reply_t* reply = xcb_get_property_reply(
-          ctx->connection,
-          xcb_get_property(ctx->connection, 0, ctx->selection_window,
-                           ctx->atoms[ATOM_WL_SELECTION].value,
-                           XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
-          NULL);
-
-      if (!reply)
+      // Only one chunk is requested ahead of the one being written.
+      if (ctx->selection_property_requested) {
+        ctx->selection_property_new_value = 1;
         return;
-
-      if (xcb_get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
-      } else {
-        assert(!ctx->selection_send_event_source);
-        close(ctx->selection_data_source_send_fd);
-        ctx->selection_data_source_send_fd = -1;
-        free(reply);
-
-        sl_process_data_source_send_pending_list(ctx);
       }
+
+      sl_request_selection_chunk(ctx);
+      if (!ctx->selection_property_reply)
+        sl_receive_selection_chunk(ctx);
     }
   } else if (event->atom == ctx->selection_request.property) {
     if (event->window == ctx->selection_request.requestor &&
@@ -2595,12 +3198,14 @@ static void sl_handle_property_notify(struct sl_context* ctx,
       ctx->selection_data_ack_pending = 0;
 
       // Handle the case when there's more data to be received.
-      if (ctx->selection_data_offer_receive_fd >= 0) {
+      if (sl_selection_receive_pending(ctx)) {
         // Avoid sending empty data until transfer is complete.
         if (data_size)
           sl_send_selection_data(ctx);
 
-        if (!ctx->selection_event_source) {
+        if (ctx->selection_cache_read_entry) {
+          sl_receive_cached_selection_data(ctx);
+        } else if (!ctx->selection_event_source) {
           ctx->selection_event_source = wl_event_loop_add_fd(
               wl_display_get_event_loop(ctx->host_display),
               ctx->selection_data_offer_receive_fd, WL_EVENT_READABLE,
@@ -2615,6 +3220,8 @@ static void sl_handle_property_notify(struct sl_context* ctx,
       if (!data_size) {
         ctx->selection_request.requestor = XCB_NONE;
         wl_array_release(&ctx->selection_data);
+        sl_selection_transfer_done(&ctx->selection_to_x,
+                                   ctx->selection_receive_start_usec);
       }
     }
   }
@@ -2637,8 +3244,8 @@ static void sl_internal_data_source_send(void* data,
   if (ctx->selection_data_source_send_fd < 0) {
     sl_begin_data_source_send(ctx, fd, cookie, host);
   } else {
-    struct sl_data_source_send_request* request =
-        malloc(sizeof(struct sl_data_source_send_request));
+    struct sl_data_source_send_request* request = sl_slab_alloc(
+        &ctx->send_request_slab, sizeof(struct sl_data_source_send_request));
 
     request->fd = fd;
     request->cookie = cookie;
@@ -2794,6 +3401,7 @@ static void sl_send_timestamp(struct sl_context* ctx) {
 }
 
 static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
+  struct sl_selection_cache_entry* entry;
   int rv, fd_to_receive, fd_to_wayland;
 
   if (!ctx->selection_data_offer) {
@@ -2801,14 +3409,37 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     return;
   }
 
-  if (ctx->selection_event_source) {
+  if (ctx->selection_event_source || ctx->selection_cache_read_entry) {
     fprintf(stderr, "error: selection transfer already pending\n");
     sl_send_selection_notify(ctx, XCB_ATOM_NONE);
     return;
   }
 
+  // Use the largest property change the X server accepts for each chunk of
+  // an incremental transfer. The maximum request length is in units of 4
+  // bytes and the request header takes up to 8 of them with BIG-REQUESTS.
+  if (!ctx->selection_incr_chunk_size) {
+    ctx->selection_incr_chunk_size =
+        MIN(MAX_INCR_CHUNK_SIZE,
+            (xcb_get_maximum_request_length(ctx->connection) - 8) * 4);
+  }
+
   ctx->selection_data_type = data_type;
 
+  // Serve repeated requests of the same target from memory instead of
+  // receiving the data from the data offer again.
+  entry = sl_selection_cache_take(ctx, data_type);
+  if (entry) {
+    ctx->stats.selection_cache_hits++;
+    wl_array_init(&ctx->selection_data);
+    ctx->selection_data_ack_pending = 0;
+    ctx->selection_receive_start_usec = sl_now_usec();
+    ctx->selection_cache_read_entry = entry;
+    ctx->selection_cache_read_offset = 0;
+    sl_receive_cached_selection_data(ctx);
+    return;
+  }
+
   // We will need the name of this atom later to tell the wayland server what
   // type of data to send us, so start the request now.
   xcb_get_atom_name_cookie_t atom_name_cookie =
@@ -2816,6 +3447,7 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
 
   wl_array_init(&ctx->selection_data);
   ctx->selection_data_ack_pending = 0;
+  ctx->selection_receive_start_usec = sl_now_usec();
 
   switch (ctx->data_driver) {
     case DATA_DRIVER_VIRTWL: {
@@ -2856,6 +3488,8 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     // If we got the atom name, then send the request to wayland and add our end
     // of the pipe to the wayland event loop.
     ctx->selection_data_offer_receive_fd = fd_to_receive;
+    ctx->selection_cache_fill_entry =
+        sl_selection_cache_entry_create(ctx, data_type);
     char* name = sl_copy_atom_name(atom_name_reply);
     wl_data_offer_receive(ctx->selection_data_offer->internal, name,
                           fd_to_wayland);
@@ -2882,6 +3516,10 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
 
 static void sl_handle_selection_request(struct sl_context* ctx,
                                         xcb_selection_request_event_t* event) {
+  // A cached transfer still in progress is abandoned rather than blocking
+  // new requests, as its requestor might never finish it.
+  sl_selection_cache_cancel_read(ctx);
+
   ctx->selection_request = *event;
   ctx->selection_incremental_transfer = 0;
 
@@ -2915,6 +3553,9 @@ static void sl_handle_xfixes_selection_notify(
   if (event->selection != ctx->atoms[ATOM_CLIPBOARD].value)
     return;
 
+  sl_selection_cache_cancel_read(ctx);
+  sl_selection_cache_clear(ctx);
+
   if (event->owner == XCB_WINDOW_NONE) {
     // If client selection is gone. Set NULL selection for each seat.
     if (ctx->selection_owner != ctx->selection_window) {
@@ -2954,7 +3595,11 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
   }
 
   while ((event = xcb_poll_for_event(ctx->connection))) {
-    switch (event->response_type & ~SEND_EVENT_MASK) {
+    int type = event->response_type & ~SEND_EVENT_MASK;
+    uint64_t start_usec = sl_now_usec();
+    uint64_t end_usec;
+
+    switch (type) {
       case XCB_CREATE_NOTIFY:
         sl_handle_create_notify(ctx, (xcb_create_notify_event_t*)event);
         break;
@@ -3006,12 +3651,16 @@ static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
         break;
     }
 
+    end_usec = sl_now_usec();
+    ctx->stats.x_events[type].count++;
+    ctx->stats.x_events[type].usec += end_usec - start_usec;
+    sl_trace_event(ctx, "x11", sl_x_event_name(type), start_usec, end_usec);
+
     free(event);
     ++count;
   }
 
-  if ((mask & ~WL_EVENT_WRITABLE) == 0)
-    xcb_flush(ctx->connection);
+  ctx->stats.events_dispatched += count;
 
   return count;
 }
@@ -3037,6 +3686,7 @@ static void sl_set_supported(struct sl_context* ctx) {
 
 static void sl_connect(struct sl_context* ctx) {
   const char wm_name[] = "Sommelier";
+  uint64_t start_usec = sl_now_usec();
   const xcb_setup_t* setup;
   xcb_screen_iterator_t screen_iterator;
   uint32_t values[1];
@@ -3044,15 +3694,23 @@ static void sl_connect(struct sl_context* ctx) {
   xcb_generic_error_t* error;
   xcb_intern_atom_reply_t* atom_reply;
   xcb_depth_iterator_t depth_iterator;
+  xcb_xfixes_query_version_cookie_t xfixes_query_version_cookie;
   xcb_xfixes_query_version_reply_t* xfixes_query_version_reply;
   const xcb_query_extension_reply_t* composite_extension;
   unsigned i;
 
   ctx->connection = xcb_connect_to_fd(ctx->wm_fd, NULL);
   assert(!xcb_connection_has_error(ctx->connection));
+  sl_startup_phase(ctx, "x_setup", start_usec);
+  start_usec = sl_now_usec();
+
+  // Everything below is issued as one batch. Only the extension data, the
+  // XFixes version and the atoms need replies, and those round trips
+  // overlap.
 
   xcb_prefetch_extension_data(ctx->connection, &xcb_xfixes_id);
   xcb_prefetch_extension_data(ctx->connection, &xcb_composite_id);
+  xcb_prefetch_maximum_request_length(ctx->connection);
 
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
     const char* name = ctx->atoms[i].name;
@@ -3080,14 +3738,8 @@ static void sl_connect(struct sl_context* ctx) {
       xcb_get_extension_data(ctx->connection, &xcb_xfixes_id);
   assert(ctx->xfixes_extension->present);
 
-  xfixes_query_version_reply = xcb_xfixes_query_version_reply(
-      ctx->connection,
-      xcb_xfixes_query_version(ctx->connection, XCB_XFIXES_MAJOR_VERSION,
-                               XCB_XFIXES_MINOR_VERSION),
-      NULL);
-  assert(xfixes_query_version_reply);
-  assert(xfixes_query_version_reply->major_version >= 5);
-  free(xfixes_query_version_reply);
+  xfixes_query_version_cookie = xcb_xfixes_query_version(
+      ctx->connection, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
 
   composite_extension =
       xcb_get_extension_data(ctx->connection, &xcb_composite_id);
@@ -3097,6 +3749,19 @@ static void sl_connect(struct sl_context* ctx) {
   redirect_subwindows_cookie = xcb_composite_redirect_subwindows_checked(
       ctx->connection, ctx->screen->root, XCB_COMPOSITE_REDIRECT_MANUAL);
 
+  ctx->window = xcb_generate_id(ctx->connection);
+  xcb_create_window(ctx->connection, 0, ctx->window, ctx->screen->root, 0, 0, 1,
+                    1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
+                    NULL);
+
+  // The version reply comes after the checked requests above so checking
+  // them below doesn't need another round trip.
+  xfixes_query_version_reply = xcb_xfixes_query_version_reply(
+      ctx->connection, xfixes_query_version_cookie, NULL);
+  assert(xfixes_query_version_reply);
+  assert(xfixes_query_version_reply->major_version >= 5);
+  free(xfixes_query_version_reply);
+
   // Another window manager should not be running.
   error = xcb_request_check(ctx->connection, change_attributes_cookie);
   assert(!error);
@@ -3105,11 +3770,6 @@ static void sl_connect(struct sl_context* ctx) {
   error = xcb_request_check(ctx->connection, redirect_subwindows_cookie);
   assert(!error);
 
-  ctx->window = xcb_generate_id(ctx->connection);
-  xcb_create_window(ctx->connection, 0, ctx->window, ctx->screen->root, 0, 0, 1,
-                    1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
-                    NULL);
-
   for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
     atom_reply =
         xcb_intern_atom_reply(ctx->connection, ctx->atoms[i].cookie, &error);
@@ -3174,6 +3834,7 @@ static void sl_connect(struct sl_context* ctx) {
   xcb_set_input_focus(ctx->connection, XCB_INPUT_FOCUS_NONE, XCB_NONE,
                       XCB_CURRENT_TIME);
   xcb_flush(ctx->connection);
+  sl_startup_phase(ctx, "x_wm_setup", start_usec);
 }
 
 static void sl_sd_notify(const char* state) {
@@ -3326,6 +3987,7 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
 
   display_name[bytes_read] = '\0';
   setenv("DISPLAY", display_name, 1);
+  sl_startup_phase(ctx, "xwayland_ready", ctx->startup_xwayland_usec);
 
   sl_connect(ctx);
 
@@ -3350,31 +4012,210 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   }
 
   ctx->child_pid = pid;
+  sl_startup_phase(ctx, "child_spawn", ctx->startup_usec);
 
   return 1;
 }
 
+static void sl_startup_sync_callback_done(void* data,
+                                          struct wl_callback* callback,
+                                          uint32_t serial) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  // All host globals have been announced and bound at this point.
+  sl_startup_phase(ctx, "host_globals", ctx->startup_registry_usec);
+  wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sl_startup_sync_callback_listener = {
+    sl_startup_sync_callback_done};
+
 static void sl_sigchld_handler(int signal) {
   while (waitpid(-1, NULL, WNOHANG) > 0)
     continue;
 }
 
+struct sl_client {
+  struct sl_context* ctx;
+  struct wl_client* client;
+  struct wl_list link;
+  struct wl_listener destroy_listener;
+  struct wl_listener resource_created_listener;
+  // Live resources of the client. Their destroy listeners refer to this
+  // struct, so it is freed once both the client and its last tracked
+  // resource are gone.
+  int resource_count;
+};
+
+struct sl_client_resource {
+  struct wl_listener destroy_listener;
+  struct sl_client* client;
+};
+
+static void sl_client_release(struct sl_client* client) {
+  if (!client->client && !client->resource_count)
+    free(client);
+}
+
+static void sl_client_resource_destroy_notify(struct wl_listener* listener,
+                                              void* data) {
+  struct sl_client_resource* resource =
+      wl_container_of(listener, resource, destroy_listener);
+  struct sl_client* client = resource->client;
+
+  wl_list_remove(&listener->link);
+  sl_slab_free(&client->ctx->client_resource_slab, resource);
+  client->resource_count--;
+  sl_client_release(client);
+}
+
+static void sl_client_resource_created_notify(struct wl_listener* listener,
+                                              void* data) {
+  struct sl_client* client =
+      wl_container_of(listener, client, resource_created_listener);
+  struct sl_context* ctx = client->ctx;
+  struct wl_resource* resource = data;
+  struct sl_client_resource* host;
+
+  // A client that keeps creating objects is disconnected before it uses up
+  // memory that is shared with all other clients.
+  if (client->resource_count >= ctx->client_resource_limit) {
+    fprintf(stderr, "error: client exceeded limit of %d resources\n",
+            ctx->client_resource_limit);
+    wl_resource_post_no_memory(resource);
+    return;
+  }
+
+  host = sl_slab_alloc(&ctx->client_resource_slab, sizeof(*host));
+  host->client = client;
+  host->destroy_listener.notify = sl_client_resource_destroy_notify;
+  wl_resource_add_destroy_listener(resource, &host->destroy_listener);
+  client->resource_count++;
+}
+
 static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
-  exit(0);
+  struct sl_client* client =
+      wl_container_of(listener, client, destroy_listener);
+
+  // A process that serves a single client is done once it disconnects.
+  if (!client->ctx->multi_client)
+    exit(0);
+
+  wl_list_remove(&client->link);
+  wl_list_remove(&client->resource_created_listener.link);
+  client->client = NULL;
+  sl_client_release(client);
 }
 
-static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+static void sl_attach_client(struct sl_context* ctx, int client_fd) {
+  struct sl_client* client;
+
+  client = malloc(sizeof(*client));
+  assert(client);
+  client->ctx = ctx;
+  client->resource_count = 0;
+  client->client = wl_client_create(ctx->host_display, client_fd);
+  if (!client->client) {
+    fprintf(stderr, "error: failed to create client: %m\n");
+    close(client_fd);
+    free(client);
+    return;
+  }
+  wl_list_insert(&ctx->clients, &client->link);
+  if (!ctx->multi_client)
+    ctx->client = client->client;
+
+  // Replace the core display implementation. This is needed in order to
+  // implement sync handler properly.
+  sl_set_display_implementation(ctx, client->client);
+
+  client->destroy_listener.notify = sl_client_destroy_notify;
+  wl_client_add_destroy_listener(client->client, &client->destroy_listener);
+
+  wl_list_init(&client->resource_created_listener.link);
+  if (ctx->client_resource_limit) {
+    client->resource_created_listener.notify =
+        sl_client_resource_created_notify;
+    wl_client_add_resource_created_listener(
+        client->client, &client->resource_created_listener);
+  }
+}
+
+// Accepts clients with --multi-client. They are served by this process
+// alongside all other clients.
+static int sl_handle_listen_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int client_fd;
+
+  client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+  if (client_fd < 0) {
+    fprintf(stderr, "error: failed to accept: %m\n");
+    return 1;
+  }
+
+  sl_attach_client(ctx, client_fd);
+  return 1;
+}
+
+// Receives the client connection and its pid from the master. Until then a
+// worker is fully connected to the host and has bound its globals.
+static int sl_handle_worker_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_recv = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* recv_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct msghdr msg = {0};
-  struct iovec buffer_iov;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = &ctx->peer_pid,
+                      .iov_len = sizeof(ctx->peer_pid)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  struct cmsghdr* cmsg;
+  int client_fd;
   ssize_t bytes;
-  int fd_count;
-  int rv;
+
+  do {
+    bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (bytes < 0 && errno == EINTR);
+
+  // Master went away before handing us a client.
+  if (bytes <= 0)
+    exit(EXIT_SUCCESS);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (bytes != sizeof(ctx->peer_pid) || !cmsg ||
+      cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    fprintf(stderr, "error: invalid message from master\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&client_fd, CMSG_DATA(cmsg), sizeof(client_fd));
+
+  wl_event_source_remove(ctx->worker_event_source);
+  ctx->worker_event_source = NULL;
+  close(fd);
+  ctx->worker_fd = -1;
+
+  sl_attach_client(ctx, client_fd);
+  return 1;
+}
+
+static struct virtwl_ioctl_txn* sl_virtwl_txn(struct sl_context* ctx,
+                                              int index) {
+  size_t txn_size =
+      sizeof(struct virtwl_ioctl_txn) + ctx->virtwl_transfer_size;
+
+  return (struct virtwl_ioctl_txn*)(ctx->virtwl_transfer_buffer +
+                                    index * txn_size);
+}
+
+static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  char fd_buffers[VIRTWL_BATCH_MAX]
+                 [CMSG_SPACE(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct mmsghdr msgs[VIRTWL_BATCH_MAX];
+  struct iovec buffer_iovs[VIRTWL_BATCH_MAX];
+  int fd_counts[VIRTWL_BATCH_MAX];
+  int hangup = 0;
+  int first = 1;
+  int count;
 
   if (!(mask & WL_EVENT_READABLE)) {
     fprintf(stderr,
@@ -3384,64 +4225,137 @@ static int sl_handle_virtwl_ctx_event(int fd, uint32_t mask, void* data) {
     exit(EXIT_SUCCESS);
   }
 
-  ioctl_recv->len = max_recv_size;
-  rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
-  if (rv) {
+  // Drain all queued messages. They are forwarded in batches of up to
+  // VIRTWL_BATCH_MAX messages with a single sendmmsg call.
+  do {
+    int sent;
+    int i;
+
+    for (count = 0; count < VIRTWL_BATCH_MAX; ++count) {
+      struct virtwl_ioctl_txn* ioctl_recv = sl_virtwl_txn(ctx, count);
+      struct msghdr* msg = &msgs[count].msg_hdr;
+      int fd_count;
+      int rv;
+
+      // Only the first message is known to be available. Stop when the
+      // queue is empty instead of blocking in the receive ioctl.
+      if (!first) {
+        struct pollfd fds = {.fd = fd, .events = POLLIN};
+
+        if (poll(&fds, 1, 0) <= 0)
+          break;
+      }
+      first = 0;
+
+      ioctl_recv->len = ctx->virtwl_transfer_size;
+      rv = ioctl(fd, VIRTWL_IOCTL_RECV, ioctl_recv);
+      if (rv) {
+        hangup = 1;
+        break;
+      }
+
+      buffer_iovs[count].iov_base =
+          (uint8_t*)ioctl_recv + sizeof(struct virtwl_ioctl_txn);
+      buffer_iovs[count].iov_len = ioctl_recv->len;
+
+      memset(msg, 0, sizeof(*msg));
+      msg->msg_iov = &buffer_iovs[count];
+      msg->msg_iovlen = 1;
+      msg->msg_control = fd_buffers[count];
+
+      // Count how many FDs the kernel gave us.
+      for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; fd_count++) {
+        if (ioctl_recv->fds[fd_count] < 0)
+          break;
+      }
+      if (fd_count) {
+        struct cmsghdr* cmsg;
+
+        // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
+        // cmsghdr. We copy every fd we just received from the ioctl into this
+        // cmsghdr.
+        msg->msg_controllen = sizeof(fd_buffers[count]);
+        cmsg = CMSG_FIRSTHDR(msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), ioctl_recv->fds, fd_count * sizeof(int));
+        msg->msg_controllen = cmsg->cmsg_len;
+      }
+      fd_counts[count] = fd_count;
+    }
+
+    // Stream sockets block until each message has been sent completely so
+    // only the number of messages sent needs to be checked.
+    for (sent = 0; sent < count;) {
+      int rv = sendmmsg(ctx->virtwl_socket_fd, msgs + sent, count - sent,
+                        MSG_NOSIGNAL);
+      errno_assert(rv > 0);
+      sent += rv;
+    }
+
+    for (i = 0; i < count; ++i) {
+      struct virtwl_ioctl_txn* ioctl_recv = sl_virtwl_txn(ctx, i);
+      int fd_count = fd_counts[i];
+
+      errno_assert(msgs[i].msg_len == ioctl_recv->len);
+
+      ctx->virtwl_to_client.messages++;
+      ctx->virtwl_to_client.bytes += ioctl_recv->len;
+      ctx->virtwl_to_client.fds += fd_count;
+
+      while (fd_count--)
+        close(ioctl_recv->fds[fd_count]);
+    }
+  } while (count == VIRTWL_BATCH_MAX);
+
+  if (hangup) {
     close(ctx->virtwl_socket_fd);
     ctx->virtwl_socket_fd = -1;
     return 0;
   }
 
-  buffer_iov.iov_base = recv_data;
-  buffer_iov.iov_len = ioctl_recv->len;
-
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-
-  // Count how many FDs the kernel gave us.
-  for (fd_count = 0; fd_count < VIRTWL_SEND_MAX_ALLOCS; fd_count++) {
-    if (ioctl_recv->fds[fd_count] < 0)
-      break;
-  }
-  if (fd_count) {
-    struct cmsghdr* cmsg;
+  return 1;
+}
 
-    // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
-    // cmsghdr. We copy every fd we just received from the ioctl into this
-    // cmsghdr.
-    msg.msg_controllen = sizeof(fd_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
-    memcpy(CMSG_DATA(cmsg), ioctl_recv->fds, fd_count * sizeof(int));
-    msg.msg_controllen = cmsg->cmsg_len;
-  }
+// Sends the first |len| bytes of data in |ioctl_send| to the host. Messages
+// the driver rejects as too large are split into smaller ones, and the FDs
+// go with the first of them.
+static void sl_virtwl_send(struct sl_context* ctx,
+                           struct virtwl_ioctl_txn* ioctl_send,
+                           size_t len) {
+  int fds[VIRTWL_SEND_MAX_ALLOCS];
+  int i;
 
-  bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
-  errno_assert(bytes == ioctl_recv->len);
+  memcpy(fds, ioctl_send->fds, sizeof(fds));
+  while (len) {
+    size_t size = MIN(len, ctx->virtwl_send_size);
+    int rv;
 
-  while (fd_count--)
-    close(ioctl_recv->fds[fd_count]);
+    ioctl_send->len = size;
+    rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
+    if (rv && errno == EMSGSIZE && size > MIN_VIRTWL_TRANSFER_SIZE) {
+      ctx->virtwl_send_size = MAX(MIN_VIRTWL_TRANSFER_SIZE, size / 2);
+      continue;
+    }
+    errno_assert(!rv);
 
-  return 1;
+    // Move the rest of the message to the front for the next chunk.
+    len -= size;
+    memmove(ioctl_send->data, ioctl_send->data + size, len);
+    for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
+      ioctl_send->fds[i] = -1;
+  }
+  memcpy(ioctl_send->fds, fds, sizeof(fds));
 }
 
 static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
-  uint8_t ioctl_buffer[4096];
-  struct virtwl_ioctl_txn* ioctl_send = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  void* send_data = ioctl_buffer + sizeof(struct virtwl_ioctl_txn);
-  size_t max_send_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  char fd_buffer[CMSG_LEN(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
-  struct iovec buffer_iov;
-  struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
-  ssize_t bytes;
-  int fd_count = 0;
-  int rv;
-  int i;
+  char fd_buffers[VIRTWL_BATCH_MAX]
+                 [CMSG_SPACE(sizeof(int) * VIRTWL_SEND_MAX_ALLOCS)];
+  struct mmsghdr msgs[VIRTWL_BATCH_MAX];
+  struct iovec buffer_iovs[VIRTWL_BATCH_MAX];
+  int count;
 
   if (!(mask & WL_EVENT_READABLE)) {
     fprintf(stderr,
@@ -3451,51 +4365,140 @@ static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
     exit(EXIT_SUCCESS);
   }
 
-  buffer_iov.iov_base = send_data;
-  buffer_iov.iov_len = max_send_size;
+  // Drain the socket, receiving up to VIRTWL_BATCH_MAX messages with a
+  // single recvmmsg call.
+  do {
+    int i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < VIRTWL_BATCH_MAX; ++i) {
+      buffer_iovs[i].iov_base =
+          (uint8_t*)sl_virtwl_txn(ctx, i) + sizeof(struct virtwl_ioctl_txn);
+      buffer_iovs[i].iov_len = ctx->virtwl_transfer_size;
+      msgs[i].msg_hdr.msg_iov = &buffer_iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = fd_buffers[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(fd_buffers[i]);
+    }
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
-  msg.msg_controllen = sizeof(fd_buffer);
+    count = recvmmsg(ctx->virtwl_socket_fd, msgs, VIRTWL_BATCH_MAX,
+                     MSG_DONTWAIT, NULL);
+    if (count == -1 && errno == EAGAIN)
+      break;
+    errno_assert(count > 0);
+
+    for (i = 0; i < count; ++i) {
+      struct virtwl_ioctl_txn* ioctl_send = sl_virtwl_txn(ctx, i);
+      struct msghdr* msg = &msgs[i].msg_hdr;
+      struct cmsghdr* cmsg;
+      int fd_count = 0;
+      int j;
+
+      errno_assert(msgs[i].msg_len > 0);
+
+      // If there were any FDs recv'd by recvmmsg, there will be some data in
+      // the msg_control buffer. To get the FDs out we iterate all cmsghdr's
+      // within and unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+      for (cmsg = msg->msg_controllen != 0 ? CMSG_FIRSTHDR(msg) : NULL; cmsg;
+           cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        size_t cmsg_fd_count;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+
+        cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
+        // control message buffer only allocates enough space for that many
+        // FDs.
+        memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
+               cmsg_fd_count * sizeof(int));
+        fd_count += cmsg_fd_count;
+      }
 
-  bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+      for (j = fd_count; j < VIRTWL_SEND_MAX_ALLOCS; ++j)
+        ioctl_send->fds[j] = -1;
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+      // The FDs and data were extracted from the recvmmsg call into the
+      // ioctl_send structure which we now pass along to the kernel.
+      sl_virtwl_send(ctx, ioctl_send, msgs[i].msg_len);
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-      continue;
+      ctx->virtwl_to_host.messages++;
+      ctx->virtwl_to_host.bytes += msgs[i].msg_len;
+      ctx->virtwl_to_host.fds += fd_count;
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      while (fd_count--)
+        close(ioctl_send->fds[fd_count]);
+    }
+  } while (count == VIRTWL_BATCH_MAX);
 
-    // fd_count will never exceed VIRTWL_SEND_MAX_ALLOCS because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&ioctl_send->fds[fd_count], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    fd_count += cmsg_fd_count;
-  }
+  return 1;
+}
 
-  for (i = fd_count; i < VIRTWL_SEND_MAX_ALLOCS; ++i)
-    ioctl_send->fds[i] = -1;
+// Flushes the client, X and host connections. This is the only place that
+// flushes once the event loop runs, and it is called right before the loop
+// goes to sleep. Events that fan out to several connections are written
+// with one syscall per connection instead of one per handler.
+static int sl_flush(struct sl_context* ctx) {
+  int bytes;
 
-  // The FDs and data were extracted from the recvmsg call into the ioctl_send
-  // structure which we now pass along to the kernel.
-  ioctl_send->len = bytes;
-  rv = ioctl(ctx->virtwl_ctx_fd, VIRTWL_IOCTL_SEND, ioctl_send);
-  errno_assert(!rv);
+  ctx->stats.loop_iterations++;
 
-  while (fd_count--)
-    close(ioctl_send->fds[fd_count]);
+  wl_display_flush_clients(ctx->host_display);
+  if (ctx->connection) {
+    uint64_t written = xcb_total_written(ctx->connection);
+
+    if (ctx->needs_set_input_focus) {
+      sl_set_input_focus(ctx, ctx->host_focus_window);
+      ctx->needs_set_input_focus = 0;
+    }
+    xcb_flush(ctx->connection);
+    if (xcb_total_written(ctx->connection) != written)
+      ctx->stats.x_writes++;
+  }
 
+  bytes = wl_display_flush(ctx->display);
+  if (bytes > 0)
+    ctx->stats.host_writes++;
+  return bytes;
+}
+
+// Writes buffered trace events so the trace file can be inspected while
+// sommelier is running.
+static int sl_handle_sigusr1(int signal_number, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  fflush(ctx->trace_file);
   return 1;
 }
 
+// Returns the share of time in percent that some tasks stalled on memory
+// during the last 10 seconds, or 0 if pressure stall information is not
+// available.
+static double sl_memory_pressure(void) {
+  double avg10 = 0.0;
+  FILE* f;
+
+  f = fopen("/proc/pressure/memory", "r");
+  if (!f)
+    return 0.0;
+  if (fscanf(f, "some avg10=%lf", &avg10) != 1)
+    avg10 = 0.0;
+  fclose(f);
+
+  return avg10;
+}
+
+static int sl_handle_trim_timer(void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int memory_pressure =
+      ctx->memory_pressure > 0 && sl_memory_pressure() >= ctx->memory_pressure;
+
+  sl_compositor_trim_buffers(ctx, memory_pressure);
+  wl_event_source_timer_update(ctx->trim_timer, TRIM_INTERVAL_MS);
+  return 0;
+}
+
 // Break |str| into a sequence of zero or more nonempty arguments. No more
 // than |argc| arguments will be added to |argv|. Returns the total number of
 // argments found in |str|.
@@ -3536,6 +4539,142 @@ static int sl_parse_cmd_prefix(char* str, int argc, char** argv) {
   return n;
 }
 
+// Executes a peer sommelier with |extra_args| followed by the flags in
+// |argv| that apply to peers.
+static void sl_exec_peer(const char* peer_cmd_prefix,
+                         int argc,
+                         char** argv,
+                         char** extra_args) {
+  char* peer_cmd_prefix_str;
+  char* args[64];
+  int i = 0, j;
+
+  if (!peer_cmd_prefix)
+    peer_cmd_prefix = PEER_CMD_PREFIX;
+
+  if (peer_cmd_prefix) {
+    peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+
+    i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+    if (i > 32) {
+      fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
+      i = 0;
+    }
+  }
+
+  args[i++] = argv[0];
+  while (*extra_args)
+    args[i++] = *extra_args++;
+
+  // forward some flags.
+  for (j = 1; j < argc; ++j) {
+    char* arg = argv[j];
+    if (strstr(arg, "--display") == arg || strstr(arg, "--scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--virtwl-device") == arg ||
+        strstr(arg, "--virtwl-transfer-size") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--shm-driver") == arg ||
+        strstr(arg, "--data-driver") == arg ||
+        strstr(arg, "--damage-tiles") == arg ||
+        strstr(arg, "--dmabuf-modifiers") == arg ||
+        strstr(arg, "--buffer-pool-size") == arg ||
+        strstr(arg, "--buffer-budget") == arg ||
+        strstr(arg, "--idle-buffer-timeout") == arg ||
+        strstr(arg, "--memory-pressure") == arg ||
+        strstr(arg, "--client-resource-limit") == arg ||
+        strstr(arg, "--resize-bucket-size") == arg ||
+        strstr(arg, "--zero-copy-shm") == arg ||
+        strstr(arg, "--copy-threads") == arg ||
+        strstr(arg, "--max-inflight-buffers") == arg ||
+        strstr(arg, "--pointer-motion-interval") == arg ||
+        strstr(arg, "--fullscreen-mode") == arg ||
+        strstr(arg, "--log-startup") == arg ||
+        strstr(arg, "--stats-socket") == arg ||
+        strstr(arg, "--trace-file") == arg ||
+        strstr(arg, "--low-resolution") == arg) {
+      args[i++] = arg;
+    }
+  }
+
+  args[i++] = NULL;
+
+  execvp(args[0], args);
+  _exit(EXIT_FAILURE);
+}
+
+struct sl_worker {
+  pid_t pid;
+  int fd;
+};
+
+// Starts a peer that connects to the host and binds its globals ahead of
+// time. It waits for a client from sl_worker_send_client() after that.
+static void sl_worker_spawn(struct sl_worker* worker,
+                            const char* peer_cmd_prefix,
+                            int argc,
+                            char** argv,
+                            int sock_fd,
+                            int lock_fd) {
+  int sv[2];
+  pid_t pid;
+  int rv;
+
+  rv = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+  errno_assert(!rv);
+
+  pid = fork();
+  errno_assert(pid != -1);
+  if (pid == 0) {
+    char* extra_args[2];
+
+    close(sock_fd);
+    close(lock_fd);
+
+    // Keep the worker end of the connection open across exec.
+    rv = fcntl(sv[1], F_SETFD, 0);
+    errno_assert(rv >= 0);
+
+    extra_args[0] = sl_xasprintf("--worker-fd=%d", sv[1]);
+    extra_args[1] = NULL;
+    sl_exec_peer(peer_cmd_prefix, argc, argv, extra_args);
+  }
+
+  close(sv[1]);
+  worker->pid = pid;
+  worker->fd = sv[0];
+}
+
+// Hands |client_fd| to |worker|, which serves it from then on. Returns 0 if
+// the worker is gone.
+static int sl_worker_send_client(struct sl_worker* worker,
+                                 int client_fd,
+                                 pid_t peer_pid) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = &peer_pid, .iov_len = sizeof(peer_pid)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control,
+                       .msg_controllen = sizeof(control)};
+  struct cmsghdr* cmsg;
+  ssize_t bytes;
+
+  memset(control, 0, sizeof(control));
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+  do {
+    bytes = sendmsg(worker->fd, &msg, MSG_NOSIGNAL);
+  } while (bytes < 0 && errno == EINTR);
+
+  close(worker->fd);
+  worker->fd = -1;
+  return bytes == sizeof(peer_pid);
+}
+
 static void sl_print_usage() {
   printf(
       "usage: sommelier [options] [program] [args...]\n\n"
@@ -3543,6 +4682,9 @@ static void sl_print_usage() {
       "  -h, --help\t\t\tPrint this help\n"
       "  -X\t\t\t\tEnable X11 forwarding\n"
       "  --master\t\t\tRun as master and spawn child processes\n"
+      "  --worker-pool=COUNT\t\tPre-forked child processes in master mode\n"
+      "  --multi-client\t\tServe all clients from the master process\n"
+      "  --client-resource-limit=COUNT\tDisconnect clients with more objects\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
       "  --shm-driver=DRIVER\t\tSHM driver to use (noop, dmabuf, virtwl)\n"
@@ -3552,14 +4694,30 @@ static void sl_print_usage() {
       "  --peer-cmd-prefix=PREFIX\tPeer process command line prefix\n"
       "  --accelerators=ACCELERATORS\tList of keyboard accelerators\n"
       "  --application-id=ID\t\tForced application ID for X11 clients\n"
+      "  --low-resolution=LIST\t\tHalve resolution of matching windows\n"
       "  --x-display=DISPLAY\t\tX11 display to listen on\n"
       "  --xwayland-path=PATH\t\tPath to Xwayland executable\n"
       "  --xwayland-gl-driver-path=PATH\tPath to GL drivers for Xwayland\n"
       "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
       "  --no-exit-with-child\t\tKeep process alive after child exists\n"
       "  --no-clipboard-manager\tDisable X11 clipboard manager\n"
+      "  --damage-tiles\t\tOnly copy and forward tiles that changed\n"
+      "  --dmabuf-modifiers\t\tUse host dmabuf modifiers for buffers\n"
+      "  --buffer-pool-size=MB\t\tMemory limit for unused output buffers\n"
+      "  --buffer-budget=MB\t\tMemory limit for all output buffers\n"
+      "  --idle-buffer-timeout=MS\tFree buffers of surfaces idle for MS\n"
+      "  --memory-pressure=PCT\t\tFree buffers when memory stall is PCT\n"
+      "  --resize-bucket-size=PX\tRound buffer sizes to PX while resizing\n"
+      "  --zero-copy-shm\t\tShare client SHM pools with host when possible\n"
+      "  --copy-threads=COUNT\t\tThreads to use for large contents copies\n"
+      "  --max-inflight-buffers=COUNT\tCoalesce frames when host is behind\n"
+      "  --pointer-motion-interval=MS\tCoalesce pointer motion within MS\n"
+      "  --stats-socket=PATH\t\tSocket that reports counters as JSON\n"
+      "  --trace-file=PATH\t\tWrite Chrome trace events to file\n"
+      "  --log-startup\t\t\tPrint a timeline of startup phases\n"
       "  --frame-color=COLOR\t\tWindow frame color for X11 clients\n"
       "  --virtwl-device=DEVICE\tVirtWL device to use\n"
+      "  --virtwl-transfer-size=BYTES\tMaximum size of forwarded messages\n"
       "  --drm-device=DEVICE\t\tDRM device to use\n"
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
       "  --fullscreen-mode=MODE\tDefault fullscreen behavior (immersive,"
@@ -3603,12 +4761,51 @@ int main(int argc, char** argv) {
       .virtwl_socket_fd = -1,
       .virtwl_ctx_event_source = NULL,
       .virtwl_socket_event_source = NULL,
+      .virtwl_transfer_size = 16384,
+      .virtwl_send_size = 0,
+      .virtwl_transfer_buffer = NULL,
+      .virtwl_to_client = {0},
+      .virtwl_to_host = {0},
       .drm_device = NULL,
       .gbm = NULL,
+      .drm_resource_info_unsupported = 0,
+      .callback_slab = {0},
+      .host_buffer_slab = {0},
+      .output_buffer_slab = {0},
+      .mmap_slab = {0},
+      .send_request_slab = {0},
+      .output_buffer_pool_size = 0,
+      .output_buffer_size = 0,
+      .idle_buffer_timeout = 0,
+      .buffer_budget = 0,
+      .memory_pressure = 0.0,
+      .resize_bucket_size = 0,
+      .trim_timer = NULL,
+      .output_buffer_pool_max_size = 64 * 1024 * 1024,
+      .cursor_buffer_count = 0,
+      .copy_threads = 0,
+      .copy_pool = NULL,
+      .max_inflight_buffers = 0,
+      .pointer_motion_interval = 0,
+      .stats = {0},
+      .stats_fd = -1,
+      .stats_event_source = NULL,
+      .trace_file = NULL,
+      .log_startup = 0,
+      .startup_usec = 0,
+      .startup_xwayland_usec = 0,
+      .startup_registry_usec = 0,
       .xwayland = 0,
       .xwayland_pid = -1,
       .child_pid = -1,
       .peer_pid = -1,
+      .worker_fd = -1,
+      .worker_event_source = NULL,
+      .multi_client = 0,
+      .listen_fd = -1,
+      .listen_event_source = NULL,
+      .client_resource_limit = 0,
+      .client_resource_slab = {0},
       .xkb_context = NULL,
       .next_global_id = 1,
       .connection = NULL,
@@ -3621,9 +4818,13 @@ int main(int argc, char** argv) {
       .desired_scale = 1.0,
       .scale = 1.0,
       .application_id = NULL,
+      .low_resolution = NULL,
       .exit_with_child = 1,
       .sd_notify = NULL,
       .clipboard_manager = 0,
+      .damage_tiles = 0,
+      .dmabuf_modifiers = 0,
+      .zero_copy_shm = 0,
       .frame_color = 0xffffffff,
       .dark_frame_color = 0xff000000,
       .fullscreen_mode = ZAURA_SURFACE_FULLSCREEN_MODE_IMMERSIVE,
@@ -3643,6 +4844,18 @@ int main(int argc, char** argv) {
       .selection_event_source = NULL,
       .selection_data_offer_receive_fd = -1,
       .selection_data_ack_pending = 0,
+      .selection_incr_chunk_size = 0,
+      .selection_property_requested = 0,
+      .selection_property_new_value = 0,
+      .selection_send_start_usec = 0,
+      .selection_receive_start_usec = 0,
+      .selection_to_wayland = {0},
+      .selection_to_x = {0},
+      .selection_cache_size = 0,
+      .selection_cache_serial = 0,
+      .selection_cache_read_entry = NULL,
+      .selection_cache_read_offset = 0,
+      .selection_cache_fill_entry = NULL,
       .atoms =
           {
               [ATOM_WM_S0] = {"WM_S0"},
@@ -3686,12 +4899,35 @@ int main(int argc, char** argv) {
   const char* frame_color = getenv("SOMMELIER_FRAME_COLOR");
   const char* dark_frame_color = getenv("SOMMELIER_DARK_FRAME_COLOR");
   const char* virtwl_device = getenv("SOMMELIER_VIRTWL_DEVICE");
+  const char* virtwl_transfer_size =
+      getenv("SOMMELIER_VIRTWL_TRANSFER_SIZE");
   const char* drm_device = getenv("SOMMELIER_DRM_DEVICE");
   const char* glamor = getenv("SOMMELIER_GLAMOR");
+  const char* damage_tiles = getenv("SOMMELIER_DAMAGE_TILES");
+  const char* dmabuf_modifiers = getenv("SOMMELIER_DMABUF_MODIFIERS");
+  const char* buffer_pool_size = getenv("SOMMELIER_BUFFER_POOL_SIZE");
+  const char* buffer_budget = getenv("SOMMELIER_BUFFER_BUDGET");
+  const char* idle_buffer_timeout = getenv("SOMMELIER_IDLE_BUFFER_TIMEOUT");
+  const char* memory_pressure = getenv("SOMMELIER_MEMORY_PRESSURE");
+  const char* resize_bucket_size = getenv("SOMMELIER_RESIZE_BUCKET_SIZE");
+  const char* zero_copy_shm = getenv("SOMMELIER_ZERO_COPY_SHM");
+  const char* copy_threads = getenv("SOMMELIER_COPY_THREADS");
+  const char* stats_socket = getenv("SOMMELIER_STATS_SOCKET");
+  const char* trace_file = getenv("SOMMELIER_TRACE_FILE");
+  const char* log_startup = getenv("SOMMELIER_LOG_STARTUP");
+  const char* max_inflight_buffers =
+      getenv("SOMMELIER_MAX_INFLIGHT_BUFFERS");
+  const char* pointer_motion_interval =
+      getenv("SOMMELIER_POINTER_MOTION_INTERVAL");
   const char* fullscreen_mode = getenv("SOMMELIER_FULLSCREEN_MODE");
+  const char* low_resolution = getenv("SOMMELIER_LOW_RESOLUTION");
   const char* shm_driver = getenv("SOMMELIER_SHM_DRIVER");
   const char* data_driver = getenv("SOMMELIER_DATA_DRIVER");
   const char* peer_cmd_prefix = getenv("SOMMELIER_PEER_CMD_PREFIX");
+  const char* worker_pool = getenv("SOMMELIER_WORKER_POOL");
+  const char* multi_client = getenv("SOMMELIER_MULTI_CLIENT");
+  const char* client_resource_limit =
+      getenv("SOMMELIER_CLIENT_RESOURCE_LIMIT");
   const char* xwayland_cmd_prefix = getenv("SOMMELIER_XWAYLAND_CMD_PREFIX");
   const char* accelerators = getenv("SOMMELIER_ACCELERATORS");
   const char* xwayland_path = getenv("SOMMELIER_XWAYLAND_PATH");
@@ -3702,10 +4938,9 @@ int main(int argc, char** argv) {
   const char* socket_name = "wayland-0";
   const char* runtime_dir;
   struct wl_event_loop* event_loop;
-  struct wl_listener client_destroy_listener = {.notify =
-                                                    sl_client_destroy_notify};
   int sv[2];
   pid_t pid;
+  uint64_t start_usec;
   int virtwl_display_fd = -1;
   int xdisplay = -1;
   int master = 0;
@@ -3742,6 +4977,14 @@ int main(int argc, char** argv) {
       xwayland_cmd_prefix = sl_arg_value(arg);
     } else if (strstr(arg, "--client-fd") == arg) {
       client_fd = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--worker-pool") == arg) {
+      worker_pool = sl_arg_value(arg);
+    } else if (strstr(arg, "--multi-client") == arg) {
+      multi_client = "1";
+    } else if (strstr(arg, "--client-resource-limit") == arg) {
+      client_resource_limit = sl_arg_value(arg);
+    } else if (strstr(arg, "--worker-fd") == arg) {
+      ctx.worker_fd = atoi(sl_arg_value(arg));
     } else if (strstr(arg, "--scale") == arg) {
       scale = sl_arg_value(arg);
     } else if (strstr(arg, "--dpi") == arg) {
@@ -3750,6 +4993,8 @@ int main(int argc, char** argv) {
       accelerators = sl_arg_value(arg);
     } else if (strstr(arg, "--application-id") == arg) {
       ctx.application_id = sl_arg_value(arg);
+    } else if (strstr(arg, "--low-resolution") == arg) {
+      low_resolution = sl_arg_value(arg);
     } else if (strstr(arg, "-X") == arg) {
       ctx.xwayland = 1;
     } else if (strstr(arg, "--x-display") == arg) {
@@ -3772,10 +5017,40 @@ int main(int argc, char** argv) {
       dark_frame_color = sl_arg_value(arg);
     } else if (strstr(arg, "--virtwl-device") == arg) {
       virtwl_device = sl_arg_value(arg);
+    } else if (strstr(arg, "--virtwl-transfer-size") == arg) {
+      virtwl_transfer_size = sl_arg_value(arg);
     } else if (strstr(arg, "--drm-device") == arg) {
       drm_device = sl_arg_value(arg);
     } else if (strstr(arg, "--glamor") == arg) {
       glamor = "1";
+    } else if (strstr(arg, "--damage-tiles") == arg) {
+      damage_tiles = "1";
+    } else if (strstr(arg, "--dmabuf-modifiers") == arg) {
+      dmabuf_modifiers = "1";
+    } else if (strstr(arg, "--buffer-pool-size") == arg) {
+      buffer_pool_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-budget") == arg) {
+      buffer_budget = sl_arg_value(arg);
+    } else if (strstr(arg, "--idle-buffer-timeout") == arg) {
+      idle_buffer_timeout = sl_arg_value(arg);
+    } else if (strstr(arg, "--memory-pressure") == arg) {
+      memory_pressure = sl_arg_value(arg);
+    } else if (strstr(arg, "--resize-bucket-size") == arg) {
+      resize_bucket_size = sl_arg_value(arg);
+    } else if (strstr(arg, "--zero-copy-shm") == arg) {
+      zero_copy_shm = "1";
+    } else if (strstr(arg, "--copy-threads") == arg) {
+      copy_threads = sl_arg_value(arg);
+    } else if (strstr(arg, "--max-inflight-buffers") == arg) {
+      max_inflight_buffers = sl_arg_value(arg);
+    } else if (strstr(arg, "--pointer-motion-interval") == arg) {
+      pointer_motion_interval = sl_arg_value(arg);
+    } else if (strstr(arg, "--stats-socket") == arg) {
+      stats_socket = sl_arg_value(arg);
+    } else if (strstr(arg, "--trace-file") == arg) {
+      trace_file = sl_arg_value(arg);
+    } else if (strstr(arg, "--log-startup") == arg) {
+      log_startup = "1";
     } else if (strstr(arg, "--fullscreen-mode") == arg) {
       fullscreen_mode = sl_arg_value(arg);
     } else if (strstr(arg, "--x-auth") == arg) {
@@ -3802,14 +5077,34 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  if (multi_client)
+    ctx.multi_client = !!strcmp(multi_client, "0");
+
+  if (client_resource_limit)
+    ctx.client_resource_limit = MAX(0, atoi(client_resource_limit));
+
   if (master) {
+    struct sl_worker* workers = NULL;
     char* lock_addr;
     struct sockaddr_un addr;
     struct sigaction sa;
     struct stat sock_stat;
+    int num_workers = 0;
+    int next_worker = 0;
     int lock_fd;
     int sock_fd;
 
+    // All clients share a single host connection, which can't serve an X
+    // server alongside them.
+    if (ctx.multi_client && ctx.xwayland) {
+      fprintf(stderr, "error: --multi-client requires a Wayland client\n");
+      return EXIT_FAILURE;
+    }
+    if (ctx.multi_client && worker_pool) {
+      fprintf(stderr, "warning: --worker-pool ignored with --multi-client\n");
+      worker_pool = NULL;
+    }
+
     addr.sun_family = AF_LOCAL;
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime_dir,
              socket_name);
@@ -3871,15 +5166,39 @@ int main(int argc, char** argv) {
     rv = sigaction(SIGCHLD, &sa, NULL);
     errno_assert(rv >= 0);
 
-    do {
+    // Clients are served by this process over a single host connection.
+    // The lock is held for as long as it runs, and the child process has
+    // been started above already.
+    if (ctx.multi_client) {
+      ctx.listen_fd = sock_fd;
+      ctx.runprog = NULL;
+    }
+
+    if (worker_pool)
+      num_workers = MAX(0, atoi(worker_pool));
+    if (num_workers) {
+      workers = malloc(num_workers * sizeof(*workers));
+      assert(workers);
+      for (i = 0; i < num_workers; ++i) {
+        sl_worker_spawn(&workers[i], peer_cmd_prefix, argc, argv, sock_fd,
+                        lock_fd);
+      }
+    }
+
+    // Otherwise a peer is started for each client, and the master never
+    // returns.
+    while (!ctx.multi_client) {
 #ifdef __linux__
       struct ucred ucred;
 #elif defined(__FreeBSD__)
       struct xucred ucred;
 #endif
       socklen_t length = sizeof(addr);
+      pid_t peer_pid;
 
-      client_fd = accept(sock_fd, (struct sockaddr*)&addr, &length);
+      // Workers spawned below must not inherit the client connection.
+      client_fd =
+          accept4(sock_fd, (struct sockaddr*)&addr, &length, SOCK_CLOEXEC);
       if (client_fd < 0) {
         fprintf(stderr, "error: failed to accept: %m\n");
         continue;
@@ -3894,74 +5213,68 @@ int main(int argc, char** argv) {
       rv = getsockopt(client_fd, 0, LOCAL_PEERCRED, &ucred, &length);
 #endif
 
-      pid = fork();
-      errno_assert(pid != -1);
-      if (pid == 0) {
-        char* client_fd_str;
-        char* peer_pid_str;
-        char* peer_cmd_prefix_str;
-        char* args[64];
-        int i = 0, j;
+#ifdef __linux__
+      peer_pid = ucred.pid;
+#elif defined(__FreeBSD__)
+      peer_pid = ucred.cr_pid;
+#endif
 
-        close(sock_fd);
-        close(lock_fd);
+      // Hand the client to a warm worker and replace it. Workers that
+      // exited are replaced as well and the next one is tried.
+      for (i = 0; i < num_workers; ++i) {
+        struct sl_worker* worker = &workers[next_worker];
+        int sent = sl_worker_send_client(worker, client_fd, peer_pid);
 
-        if (!peer_cmd_prefix)
-          peer_cmd_prefix = PEER_CMD_PREFIX;
+        next_worker = (next_worker + 1) % num_workers;
+        sl_worker_spawn(worker, peer_cmd_prefix, argc, argv, sock_fd, lock_fd);
+        if (sent)
+          break;
+      }
 
-        if (peer_cmd_prefix) {
-          peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+      if (i == num_workers) {
+        pid = fork();
+        errno_assert(pid != -1);
+        if (pid == 0) {
+          char* extra_args[3];
 
-          i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-          if (i > 32) {
-            fprintf(stderr, "error: too many arguments in cmd prefix: %d\n", i);
-            i = 0;
-          }
-        }
+          close(sock_fd);
+          close(lock_fd);
 
-        args[i++] = argv[0];
-#ifdef __linux__
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.pid);
-#elif defined(__FreeBSD__)
-        peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.cr_pid);
-#endif
-        args[i++] = peer_pid_str;
-        client_fd_str = sl_xasprintf("--client-fd=%d", client_fd);
-        args[i++] = client_fd_str;
-
-        // forward some flags.
-        for (j = 1; j < argc; ++j) {
-          char* arg = argv[j];
-          if (strstr(arg, "--display") == arg ||
-              strstr(arg, "--scale") == arg ||
-              strstr(arg, "--accelerators") == arg ||
-              strstr(arg, "--virtwl-device") == arg ||
-              strstr(arg, "--drm-device") == arg ||
-              strstr(arg, "--shm-driver") == arg ||
-              strstr(arg, "--data-driver") == arg) {
-            args[i++] = arg;
-          }
-        }
+          // Keep the client connection open across exec.
+          rv = fcntl(client_fd, F_SETFD, 0);
+          errno_assert(rv >= 0);
 
-        args[i++] = NULL;
-
-        execvp(args[0], args);
-        _exit(EXIT_FAILURE);
+          extra_args[0] = sl_xasprintf("--peer-pid=%d", peer_pid);
+          extra_args[1] = sl_xasprintf("--client-fd=%d", client_fd);
+          extra_args[2] = NULL;
+          sl_exec_peer(peer_cmd_prefix, argc, argv, extra_args);
+        }
       }
       close(client_fd);
-    } while (1);
-
-    // Control should never reach here.
-    assert(false);
+    }
   }
 
-  if (client_fd == -1) {
+  if (client_fd == -1 && ctx.worker_fd == -1 && ctx.listen_fd == -1) {
     if (!ctx.runprog || !ctx.runprog[0]) {
       sl_print_usage();
       return EXIT_FAILURE;
     }
   }
 
+  // Peers started by a master share its flags, so each of them gets its
+  // own stats socket and trace file.
+  if (client_fd != -1 || ctx.worker_fd != -1) {
+    if (stats_socket)
+      stats_socket = sl_xasprintf("%s.%d", stats_socket, getpid());
+    if (trace_file)
+      trace_file = sl_xasprintf("%s.%d", trace_file, getpid());
+  }
+
+  ctx.startup_usec = sl_now_usec();
+  // Opened early so that the startup phases end up in the trace.
+  if (trace_file)
+    sl_trace_open(&ctx, trace_file);
+
   if (ctx.xwayland) {
     assert(client_fd == -1);
 
@@ -3970,6 +5283,56 @@ int main(int argc, char** argv) {
       ctx.clipboard_manager = !!strcmp(clipboard_manager, "0");
   }
 
+  if (damage_tiles)
+    ctx.damage_tiles = !!strcmp(damage_tiles, "0");
+
+  if (dmabuf_modifiers)
+    ctx.dmabuf_modifiers = !!strcmp(dmabuf_modifiers, "0");
+
+  if (zero_copy_shm)
+    ctx.zero_copy_shm = !!strcmp(zero_copy_shm, "0");
+
+  if (log_startup)
+    ctx.log_startup = !!strcmp(log_startup, "0");
+
+  if (copy_threads)
+    ctx.copy_threads = MAX(0, atoi(copy_threads));
+
+  // Hosts might hold on to the last buffer until a new one is committed so
+  // a limit of less than two buffers could stall presentation.
+  if (max_inflight_buffers) {
+    int count = atoi(max_inflight_buffers);
+
+    ctx.max_inflight_buffers = count > 0 ? MAX(2, count) : 0;
+  }
+
+  if (pointer_motion_interval)
+    ctx.pointer_motion_interval = MAX(0, atoi(pointer_motion_interval));
+
+  if (virtwl_transfer_size) {
+    ctx.virtwl_transfer_size =
+        MIN(MAX_VIRTWL_TRANSFER_SIZE,
+            MAX(MIN_VIRTWL_TRANSFER_SIZE,
+                strtoul(virtwl_transfer_size, NULL, 0)));
+  }
+
+  // Pool size is specified in MiB.
+  if (buffer_pool_size)
+    ctx.output_buffer_pool_max_size = strtoul(buffer_pool_size, NULL, 0) << 20;
+
+  // Budget is specified in MiB as well.
+  if (buffer_budget)
+    ctx.buffer_budget = strtoul(buffer_budget, NULL, 0) << 20;
+
+  if (idle_buffer_timeout)
+    ctx.idle_buffer_timeout = MAX(0, atoi(idle_buffer_timeout));
+
+  if (memory_pressure)
+    ctx.memory_pressure = MAX(0.0, atof(memory_pressure));
+
+  if (resize_bucket_size)
+    ctx.resize_bucket_size = MAX(0, atoi(resize_bucket_size));
+
   if (scale) {
     ctx.desired_scale = atof(scale);
     // Round to integer scale until we detect wp_viewporter support.
@@ -4006,6 +5369,8 @@ int main(int argc, char** argv) {
     }
   }
 
+  ctx.low_resolution = low_resolution;
+
   // Handle broken pipes without signals that kill the entire process.
   signal(SIGPIPE, SIG_IGN);
 
@@ -4057,6 +5422,14 @@ int main(int argc, char** argv) {
 
       ctx.virtwl_ctx_fd = new_ctx.fd;
 
+      // Round up so transactions in the batch buffer stay aligned.
+      ctx.virtwl_transfer_size = (ctx.virtwl_transfer_size + 7) & ~7;
+      ctx.virtwl_send_size = ctx.virtwl_transfer_size;
+      ctx.virtwl_transfer_buffer =
+          malloc(VIRTWL_BATCH_MAX * (sizeof(struct virtwl_ioctl_txn) +
+                                     ctx.virtwl_transfer_size));
+      assert(ctx.virtwl_transfer_buffer);
+
       ctx.virtwl_socket_event_source = wl_event_loop_add_fd(
           event_loop, ctx.virtwl_socket_fd, WL_EVENT_READABLE,
           sl_handle_virtwl_socket_event, &ctx);
@@ -4175,6 +5548,7 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  start_usec = sl_now_usec();
   if (virtwl_display_fd != -1) {
     ctx.display = wl_display_connect_to_fd(virtwl_display_fd);
   } else {
@@ -4190,14 +5564,36 @@ int main(int argc, char** argv) {
     fprintf(stderr, "error: failed to connect to %s\n", display);
     return EXIT_FAILURE;
   }
+  sl_startup_phase(&ctx, "host_connect", start_usec);
+
+  // Request the host globals right away. The host prepares and sends them
+  // while the rest of the setup below runs and Xwayland starts, and the
+  // sync callback marks when all of them have arrived.
+  ctx.startup_registry_usec = sl_now_usec();
+  wl_registry_add_listener(wl_display_get_registry(ctx.display),
+                           &sl_registry_listener, &ctx);
+  wl_callback_add_listener(wl_display_sync(ctx.display),
+                           &sl_startup_sync_callback_listener, &ctx);
+  wl_display_flush(ctx.display);
 
   wl_list_init(&ctx.accelerators);
   wl_list_init(&ctx.registries);
   wl_list_init(&ctx.globals);
   wl_list_init(&ctx.outputs);
   wl_list_init(&ctx.seats);
+  wl_list_init(&ctx.drm_resources);
+  wl_list_init(&ctx.output_buffer_pool);
+  wl_list_init(&ctx.host_surfaces);
+  wl_list_init(&ctx.selection_cache);
+  wl_list_init(&ctx.clients);
+  wl_list_init(&ctx.cursor_buffers);
   wl_list_init(&ctx.windows);
   wl_list_init(&ctx.unpaired_windows);
+  for (i = 0; i < WINDOW_HASH_SIZE; ++i) {
+    wl_list_init(&ctx.window_id_hash[i]);
+    wl_list_init(&ctx.window_frame_id_hash[i]);
+    wl_list_init(&ctx.window_host_surface_id_hash[i]);
+  }
   wl_list_init(&ctx.host_outputs);
   wl_list_init(&ctx.selection_data_source_send_pending);
 
@@ -4252,14 +5648,31 @@ int main(int argc, char** argv) {
       wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
                            WL_EVENT_READABLE, sl_handle_event, &ctx);
 
-  wl_registry_add_listener(wl_display_get_registry(ctx.display),
-                           &sl_registry_listener, &ctx);
+  if (ctx.worker_fd != -1) {
+    ctx.worker_event_source =
+        wl_event_loop_add_fd(event_loop, ctx.worker_fd, WL_EVENT_READABLE,
+                             sl_handle_worker_event, &ctx);
+  } else if (ctx.listen_fd != -1) {
+    ctx.listen_event_source =
+        wl_event_loop_add_fd(event_loop, ctx.listen_fd, WL_EVENT_READABLE,
+                             sl_handle_listen_event, &ctx);
+  } else {
+    sl_attach_client(&ctx, client_fd);
+  }
 
-  ctx.client = wl_client_create(ctx.host_display, client_fd);
+  // Counters are reported by the stats socket. SIGUSR1 only flushes the
+  // trace file.
+  if (ctx.trace_file)
+    wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx);
 
-  // Replace the core display implementation. This is needed in order to
-  // implement sync handler properly.
-  sl_set_display_implementation(&ctx);
+  if (stats_socket)
+    sl_stats_listen(&ctx, stats_socket);
+
+  if (ctx.buffer_budget || ctx.idle_buffer_timeout || ctx.memory_pressure > 0) {
+    ctx.trim_timer =
+        wl_event_loop_add_timer(event_loop, sl_handle_trim_timer, &ctx);
+    wl_event_source_timer_update(ctx.trim_timer, TRIM_INTERVAL_MS);
+  }
 
   if (ctx.runprog || ctx.xwayland) {
     ctx.sigchld_event_source =
@@ -4291,6 +5704,7 @@ int main(int argc, char** argv) {
 
       ctx.wm_fd = wm[0];
 
+      ctx.startup_xwayland_usec = sl_now_usec();
       pid = fork();
       errno_assert(pid != -1);
       if (pid == 0) {
@@ -4360,6 +5774,7 @@ int main(int argc, char** argv) {
       }
       close(wm[1]);
       ctx.xwayland_pid = pid;
+      sl_startup_phase(&ctx, "xwayland_spawn", ctx.startup_xwayland_usec);
     } else {
       pid = fork();
       errno_assert(pid != -1);
@@ -4368,22 +5783,13 @@ int main(int argc, char** argv) {
         _exit(EXIT_FAILURE);
       }
       ctx.child_pid = pid;
+      sl_startup_phase(&ctx, "child_spawn", ctx.startup_usec);
     }
     close(sv[1]);
   }
 
-  wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
-
   do {
-    wl_display_flush_clients(ctx.host_display);
-    if (ctx.connection) {
-      if (ctx.needs_set_input_focus) {
-        sl_set_input_focus(&ctx, ctx.host_focus_window);
-        ctx.needs_set_input_focus = 0;
-      }
-      xcb_flush(ctx.connection);
-    }
-    if (wl_display_flush(ctx.display) < 0)
+    if (sl_flush(&ctx) < 0)
       return EXIT_FAILURE;
   } while (wl_event_loop_dispatch(event_loop, -1) != -1);
 
@@ -73,6 +73,7 @@
       'link_settings': {
         'libraries': [
           '-lm',
+          '-lpthread',
         ],
       },
       'dependencies': [
@@ -80,6 +81,7 @@
       ],
       'sources': [
         'sommelier-compositor.c',
+        'sommelier-copy.c',
         'sommelier-data-device-manager.c',
         'sommelier-display.c',
         'sommelier-drm.c',
@@ -88,6 +90,7 @@
         'sommelier-seat.c',
         'sommelier-shell.c',
         'sommelier-shm.c',
+        'sommelier-stats.c',
         'sommelier-subcompositor.c',
         'sommelier-text-input.c',
         'sommelier-viewporter.c',
@@ -144,5 +147,65 @@
         'demos/x11_demo.cc',
       ],
     },
+    {
+      'target_name': 'wayland_benchmark',
+      'type': 'executable',
+      'variables': {
+        'deps': [
+          'libbrillo-<(libbase_ver)',
+          'libchrome-<(libbase_ver)',
+          'wayland-client',
+        ],
+      },
+      'link_settings': {
+        'libraries': [
+          '-lwayland-client',
+        ],
+      },
+      'sources': [
+        'demos/wayland_benchmark.cc',
+      ],
+    },
+    {
+      'target_name': 'x11_benchmark',
+      'type': 'executable',
+      'variables': {
+        'deps': [
+          'libbrillo-<(libbase_ver)',
+          'libchrome-<(libbase_ver)',
+        ],
+      },
+      'link_settings': {
+        'libraries': [
+          '-lX11',
+        ],
+      },
+      'sources': [
+        'demos/x11_benchmark.cc',
+      ],
+    },
+    {
+      'target_name': 'benchmark_host',
+      'type': 'executable',
+      'variables': {
+        'deps': [
+          'libbrillo-<(libbase_ver)',
+          'libchrome-<(libbase_ver)',
+          'libdrm',
+          'wayland-server',
+        ],
+      },
+      'link_settings': {
+        'libraries': [
+          '-lwayland-server',
+        ],
+      },
+      'dependencies': [
+        'sommelier-protocol',
+      ],
+      'sources': [
+        'demos/benchmark_host.cc',
+      ],
+    },
   ],
 }
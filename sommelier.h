@@ -5,6 +5,8 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_H_
 
+#include <pixman.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <wayland-server.h>
 #include <wayland-util.h>
@@ -20,6 +22,13 @@
 
 #define UNUSED(x) ((void)(x))
 
+// Event types are 7 bits, the top bit marks events sent by clients.
+#define X_EVENT_TYPE_COUNT 128
+
+// Number of buckets in each of the window lookup tables. Must be a power
+// of two.
+#define WINDOW_HASH_SIZE 256
+
 #define CONTROL_MASK (1 << 0)
 #define ALT_MASK (1 << 1)
 #define SHIFT_MASK (1 << 2)
@@ -41,6 +50,9 @@ struct sl_text_input_manager;
 struct sl_relative_pointer_manager;
 struct sl_pointer_constraints;
 struct sl_window;
+struct sl_copy_job;
+struct sl_copy_pool;
+struct sl_drm_resource;
 struct zaura_shell;
 struct zcr_keyboard_extension_v1;
 
@@ -89,11 +101,85 @@ enum {
   DATA_DRIVER_VIRTWL,
 };
 
+struct sl_virtwl_counters {
+  uint64_t messages;
+  uint64_t bytes;
+  uint64_t fds;
+};
+
+struct sl_transfer_counters {
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t usec;
+};
+
+struct sl_selection_cache_entry;
+
+// Free list of objects of one type that are allocated at a high rate.
+// Freed objects are kept for reuse, up to a bounded number of them. Hits
+// count allocations served from the list and misses those that were not.
+struct sl_slab {
+  void* free_list;
+  size_t free_count;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+struct sl_event_counters {
+  uint64_t count;
+  uint64_t usec;
+};
+
+// Counters for the hot paths of the compositor, exported through the stats
+// socket.
+struct sl_stats {
+  uint64_t commits;
+  uint64_t damage_area;
+  uint64_t bytes_copied;
+  // Time spent in begin_write/end_write of output buffers.
+  uint64_t write_usec;
+  uint64_t output_buffers_created;
+  uint64_t output_buffers_destroyed;
+  // Released output buffers freed to stay within memory limits.
+  uint64_t output_buffers_trimmed;
+  uint64_t busy_buffers_max;
+  // Cursor images found in and added to the cursor cache.
+  uint64_t cursor_cache_hits;
+  uint64_t cursor_cache_misses;
+  // Selection requests served from the selection cache.
+  uint64_t selection_cache_hits;
+  // Host configure events superseded by a later one before being applied.
+  uint64_t configures_coalesced;
+  // Pointer motion received from the host and forwarded to the client.
+  uint64_t pointer_motion_received;
+  uint64_t pointer_motion_sent;
+  // Host and X events dispatched, and the flushes that had to write to
+  // each connection. Clients are flushed at most once per loop iteration.
+  uint64_t loop_iterations;
+  uint64_t events_dispatched;
+  uint64_t host_writes;
+  uint64_t x_writes;
+  // Round-trip time from frame request to done event.
+  struct sl_event_counters frame_callbacks;
+  // Dispatch time of X events by type.
+  struct sl_event_counters x_events[X_EVENT_TYPE_COUNT];
+};
+
 struct sl_context {
   char** runprog;
   struct wl_display* display;
   struct wl_display* host_display;
+  // The client served by this process, or NULL with --multi-client where
+  // all clients that connect to |listen_fd| share the host connection.
   struct wl_client* client;
+  int multi_client;
+  int listen_fd;
+  struct wl_event_source* listen_event_source;
+  struct wl_list clients;
+  // Live resources each client may have, 0 for no limit. The resources of
+  // all clients are tracked through |client_resource_slab|.
+  int client_resource_limit;
+  struct sl_slab client_resource_slab;
   struct sl_compositor* compositor;
   struct sl_subcompositor* subcompositor;
   struct sl_shm* shm;
@@ -121,12 +207,71 @@ struct sl_context {
   int virtwl_socket_fd;
   struct wl_event_source* virtwl_ctx_event_source;
   struct wl_event_source* virtwl_socket_event_source;
+  size_t virtwl_transfer_size;
+  // Largest message the driver accepted so far.
+  size_t virtwl_send_size;
+  uint8_t* virtwl_transfer_buffer;
+  struct sl_virtwl_counters virtwl_to_client;
+  struct sl_virtwl_counters virtwl_to_host;
   const char* drm_device;
   struct gbm_device* gbm;
+  // Virtio-gpu resources of live prime buffers, and whether the DRM device
+  // turned out not to provide resource information.
+  struct wl_list drm_resources;
+  int drm_resource_info_unsupported;
+  // Free lists of objects that are allocated for every frame or buffer.
+  struct sl_slab callback_slab;
+  struct sl_slab host_buffer_slab;
+  struct sl_slab output_buffer_slab;
+  struct sl_slab mmap_slab;
+  struct sl_slab send_request_slab;
+  struct wl_list output_buffer_pool;
+  size_t output_buffer_pool_size;
+  size_t output_buffer_pool_max_size;
+  // Memory held by all output buffers.
+  size_t output_buffer_size;
+  // Limits for memory held by output buffers. Released buffers of surfaces
+  // that have been idle for |idle_buffer_timeout| ms are freed. Surfaces are
+  // also trimmed, least recently committed first, while output buffers use
+  // more than |buffer_budget| bytes or memory pressure is above
+  // |memory_pressure|. Zero disables a limit.
+  int idle_buffer_timeout;
+  size_t buffer_budget;
+  double memory_pressure;
+  // Output buffers of windows that are being resized are rounded up to
+  // multiples of |resize_bucket_size| pixels, so the same buffers can be
+  // used for many sizes. Zero disables this.
+  int resize_bucket_size;
+  // Surfaces, most recently committed first.
+  struct wl_list host_surfaces;
+  struct wl_event_source* trim_timer;
+  // Output buffers holding recently used cursor images, most recently used
+  // first.
+  struct wl_list cursor_buffers;
+  int cursor_buffer_count;
+  int copy_threads;
+  struct sl_copy_pool* copy_pool;
+  int max_inflight_buffers;
+  // Minimum time in ms between forwarded motion-only pointer frames. Zero
+  // forwards every motion event as it arrives.
+  int pointer_motion_interval;
+  struct sl_stats stats;
+  int stats_fd;
+  struct wl_event_source* stats_event_source;
+  FILE* trace_file;
+  // Startup timeline. Phases are logged to stderr when |log_startup| is set
+  // and always written to the trace file.
+  int log_startup;
+  uint64_t startup_usec;
+  uint64_t startup_xwayland_usec;
+  uint64_t startup_registry_usec;
   int xwayland;
   pid_t xwayland_pid;
   pid_t child_pid;
   pid_t peer_pid;
+  // Connection to the master when running as a pre-forked worker.
+  int worker_fd;
+  struct wl_event_source* worker_event_source;
   struct xkb_context* xkb_context;
   struct wl_list accelerators;
   struct wl_list registries;
@@ -139,14 +284,26 @@ struct sl_context {
   xcb_screen_t* screen;
   xcb_window_t window;
   struct wl_list windows, unpaired_windows;
+  // Windows hashed by X window id, frame window id and host surface id.
+  struct wl_list window_id_hash[WINDOW_HASH_SIZE];
+  struct wl_list window_frame_id_hash[WINDOW_HASH_SIZE];
+  struct wl_list window_host_surface_id_hash[WINDOW_HASH_SIZE];
   struct sl_window* host_focus_window;
   int needs_set_input_focus;
   double desired_scale;
   double scale;
   const char* application_id;
+  // Comma separated WM_CLASS names and application ids of windows that are
+  // forwarded at half resolution.
+  const char* low_resolution;
+  // Allocate dmabuf output buffers with host modifiers and expose
+  // zwp_linux_dmabuf_v1 to clients.
+  int dmabuf_modifiers;
   int exit_with_child;
   const char* sd_notify;
   int clipboard_manager;
+  int damage_tiles;
+  int zero_copy_shm;
   uint32_t frame_color;
   uint32_t dark_frame_color;
   int fullscreen_mode;
@@ -169,6 +326,25 @@ struct sl_context {
   struct wl_array selection_data;
   int selection_data_offer_receive_fd;
   int selection_data_ack_pending;
+  uint32_t selection_incr_chunk_size;
+  xcb_get_property_cookie_t selection_property_cookie;
+  int selection_property_requested;
+  int selection_property_new_value;
+  uint64_t selection_send_start_usec;
+  uint64_t selection_receive_start_usec;
+  struct sl_transfer_counters selection_to_wayland;
+  struct sl_transfer_counters selection_to_x;
+  // Converted data of the current Wayland selection by target, most recently
+  // used first. Entries are dropped whenever the selection changes, which
+  // bumps the serial. The entry that the transfer in progress is served from
+  // is taken off the list, and the one being received is only added once
+  // the transfer is complete.
+  struct wl_list selection_cache;
+  size_t selection_cache_size;
+  uint32_t selection_cache_serial;
+  struct sl_selection_cache_entry* selection_cache_read_entry;
+  size_t selection_cache_read_offset;
+  struct sl_selection_cache_entry* selection_cache_fill_entry;
   union {
     const char* name;
     xcb_intern_atom_cookie_t cookie;
@@ -212,6 +388,19 @@ struct sl_host_pointer {
   uint32_t time;
   wl_fixed_t axis_delta[2];
   int32_t axis_discrete[2];
+  int axis_pending[2];
+  // Latest motion when coalescing. Only set if |motion_timer| exists.
+  int motion_pending;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  // Number of events other than motion in the current frame.
+  int frame_events;
+  // Set when a motion-only frame is held back until |motion_timer| expires.
+  int frame_deferred;
+  int motion_timer_armed;
+  struct wl_event_source* motion_timer;
+  struct wl_list relative_pointers;
 };
 
 struct sl_relative_pointer_manager {
@@ -232,8 +421,10 @@ struct sl_viewport {
 };
 
 struct sl_host_callback {
+  struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_callback* proxy;
+  uint64_t start_usec;
 };
 
 struct sl_host_surface {
@@ -246,12 +437,60 @@ struct sl_host_surface {
   int32_t contents_scale;
   struct wl_list contents_viewport;
   struct sl_mmap* contents_shm_mmap;
+  uint32_t contents_shm_format;
+  // Factor by which the shm contents are reduced in the output buffer.
+  int contents_downscale;
+  // Size bucket that output buffers are rounded up to while the window is
+  // resized, 0 when they match the contents size. The host surface viewport
+  // crops bucketed buffers to the contents while |viewport_cropped| is set.
+  int contents_bucket;
+  int viewport_cropped;
+  // Set for surfaces of non-X11 clients that match --low-resolution.
+  int low_resolution;
   int has_role;
+  // Set once the surface is used as a cursor. Its contents are then looked
+  // up in the cursor cache when committed.
+  int is_cursor;
+  int cursor_attach;
   int has_output;
   uint32_t last_event_serial;
   struct sl_output_buffer* current_buffer;
   struct wl_list released_buffers;
   struct wl_list busy_buffers;
+  // Damage tracking state used when --damage-tiles is enabled. Client damage
+  // is held back until commit and tile hashes of the last committed contents
+  // determine what is forwarded to the host.
+  pixman_region32_t damage;
+  uint64_t* tile_hashes;
+  uint32_t tile_hashes_width;
+  uint32_t tile_hashes_height;
+  // Contents copy in progress on the copy threads.
+  struct sl_copy_job* copy_job;
+  // Set once the surface has or is a subsurface. The host commits of such
+  // surfaces are never deferred, as that would reorder them against the
+  // requests for related surfaces that the client sends after them.
+  int in_subsurface_tree;
+  // Set when --max-inflight-buffers deferred the attach of the current
+  // contents, and when a commit of them waits for the host to release a
+  // buffer. The offset is also used for deferred cursor attaches.
+  int mailbox_attach;
+  int32_t mailbox_x;
+  int32_t mailbox_y;
+  int mailbox_pending;
+  // Fence of the attached buffer, and the fence the last commit waits for
+  // before it is forwarded to the host.
+  int contents_fence_fd;
+  int fence_fd;
+  struct wl_event_source* fence_source;
+  // Window that is paired with this surface, if any.
+  struct sl_window* window;
+  // Position in the list of surfaces ordered by last commit, and the time of
+  // that commit.
+  struct wl_list link;
+  uint64_t last_commit_usec;
+  uint64_t commits;
+  uint64_t damage_area;
+  uint64_t bytes_copied;
 };
 
 struct sl_host_region {
@@ -261,6 +500,7 @@ struct sl_host_region {
 };
 
 struct sl_host_buffer {
+  struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_buffer* proxy;
   uint32_t width;
@@ -392,12 +632,21 @@ struct sl_aura_shell {
   struct zaura_shell* internal;
 };
 
+struct sl_dmabuf_modifier {
+  uint32_t format;
+  uint64_t modifier;
+};
+
 struct sl_linux_dmabuf {
   struct sl_context* ctx;
   uint32_t id;
   uint32_t version;
   struct sl_global* host_drm_global;
+  struct sl_global* host_linux_dmabuf_global;
   struct zwp_linux_dmabuf_v1* internal;
+  // Format and modifier pairs advertised by the host, as
+  // struct sl_dmabuf_modifier.
+  struct wl_array modifiers;
 };
 
 struct sl_global {
@@ -431,14 +680,77 @@ struct sl_mmap {
   sl_begin_end_access_func_t begin_write;
   sl_begin_end_access_func_t end_write;
   struct wl_resource* buffer_resource;
-};
-
+  // Mapping of the whole shm pool that |addr| belongs to, or NULL if |addr|
+  // was mapped for this buffer alone.
+  struct sl_mmap* pool;
+  // Free list the mapping is returned to when released.
+  struct sl_slab* slab;
+};
+
+typedef void (*sl_copy_plane_func_t)(uint8_t* dst,
+                                     size_t dst_stride,
+                                     const uint8_t* src,
+                                     size_t src_stride,
+                                     size_t bytes,
+                                     size_t rows);
+
+// Destination of the copy kernels.
+struct sl_copy_target {
+  struct sl_mmap* mmap;
+  uint32_t width;
+  // Plane copy used for large rects, or NULL to always use memcpy.
+  sl_copy_plane_func_t stream_plane;
+  // Size of the source contents. Only used by downscaling copies.
+  uint32_t src_width;
+  uint32_t src_height;
+};
+
+typedef void (*sl_copy_rect_func_t)(struct sl_copy_target* target,
+                                    struct sl_mmap* src,
+                                    int32_t x1,
+                                    int32_t y1,
+                                    int32_t x2,
+                                    int32_t y2);
+
+// Returns a new fd that becomes readable once rendering to the buffer of
+// |sync_point| has completed, or -1 if there is nothing to wait for.
+typedef int (*sl_sync_fence_func_t)(struct sl_context* ctx,
+                                    struct sl_sync_point* sync_point);
+
+// Blocks until rendering to the buffer of |sync_point| has completed. Used
+// when no fence is available.
 typedef void (*sl_sync_func_t)(struct sl_context* ctx,
                                struct sl_sync_point* sync_point);
 
 struct sl_sync_point {
   int fd;
+  sl_sync_fence_func_t fence;
   sl_sync_func_t sync;
+  // Cached virtio-gpu resource of |fd|, if any.
+  struct sl_drm_resource* resource;
+};
+
+enum {
+  PROPERTY_WM_NAME,
+  PROPERTY_WM_CLASS,
+  PROPERTY_WM_TRANSIENT_FOR,
+  PROPERTY_WM_NORMAL_HINTS,
+  PROPERTY_WM_CLIENT_LEADER,
+  PROPERTY_WM_PROTOCOLS,
+  PROPERTY_MOTIF_WM_HINTS,
+  PROPERTY_NET_STARTUP_ID,
+  PROPERTY_NET_WM_STATE,
+  PROPERTY_GTK_THEME_VARIANT,
+  PROPERTY_COUNT,
+};
+
+// Window property that is fetched ahead of the window being mapped. The
+// reply is valid until the property changes.
+struct sl_window_property {
+  xcb_get_property_cookie_t cookie;
+  xcb_get_property_reply_t* reply;
+  int pending;
+  int valid;
 };
 
 struct sl_config {
@@ -462,6 +774,8 @@ struct sl_window {
   int border_width;
   int depth;
   int managed;
+  // Set when the window matches --low-resolution.
+  int low_resolution;
   int realized;
   int activated;
   int maximized;
@@ -481,14 +795,28 @@ struct sl_window {
   int max_height;
   struct sl_config next_config;
   struct sl_config pending_config;
+  // Set while the host resizes the window interactively. Configurations
+  // are then applied at most once per output frame, and the timer applies
+  // the latest one that was held back.
+  int resizing;
+  struct wl_event_source* configure_timer;
+  int configure_timer_armed;
+  int configure_deferred;
   struct xdg_surface* xdg_surface;
   struct xdg_toplevel* xdg_toplevel;
   struct xdg_popup* xdg_popup;
   struct zaura_surface* aura_surface;
+  struct sl_window_property properties[PROPERTY_COUNT];
+  xcb_get_geometry_cookie_t geometry_cookie;
+  int geometry_pending;
   struct wl_list link;
+  struct wl_list id_link;
+  struct wl_list frame_id_link;
+  struct wl_list host_surface_id_link;
 };
 
-struct sl_host_buffer* sl_create_host_buffer(struct wl_client* client,
+struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
+                                             struct wl_client* client,
                                              uint32_t id,
                                              struct wl_buffer* proxy,
                                              int32_t width,
@@ -502,10 +830,29 @@ struct sl_global* sl_global_create(struct sl_context* ctx,
 
 struct sl_global* sl_compositor_global_create(struct sl_context* ctx);
 
+void sl_compositor_trim_buffers(struct sl_context* ctx, int memory_pressure);
+
+void sl_host_surface_finish_commit(struct sl_host_surface* host);
+
 size_t sl_shm_bpp_for_shm_format(uint32_t format);
 
 size_t sl_shm_num_planes_for_shm_format(uint32_t format);
 
+sl_copy_plane_func_t sl_stream_copy_plane_func(void);
+
+sl_copy_rect_func_t sl_copy_rect_func_for_shm_format(uint32_t format,
+                                                     struct sl_mmap* mmap);
+
+sl_copy_rect_func_t sl_downscale_rect_func_for_shm_format(uint32_t format);
+
+void sl_dmabuf_begin_write(int fd);
+
+void sl_dmabuf_end_write(int fd);
+
+void sl_virtwl_dmabuf_begin_write(int fd);
+
+void sl_virtwl_dmabuf_end_write(int fd);
+
 struct sl_global* sl_shm_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_subcompositor_global_create(struct sl_context* ctx);
@@ -523,6 +870,10 @@ struct sl_global* sl_seat_global_create(struct sl_seat* seat);
 struct sl_global* sl_relative_pointer_manager_global_create(
     struct sl_context* ctx);
 
+void sl_relative_pointers_flush(struct sl_host_pointer* pointer);
+
+void sl_relative_pointers_release(struct sl_host_pointer* pointer);
+
 struct sl_global* sl_data_device_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_viewporter_global_create(struct sl_context* ctx);
@@ -533,13 +884,19 @@ struct sl_global* sl_gtk_shell_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_drm_global_create(struct sl_context* ctx);
 
+struct sl_global* sl_linux_dmabuf_global_create(struct sl_context* ctx);
+
+void sl_drm_resource_unref(struct sl_drm_resource* resource);
+
 struct sl_global* sl_text_input_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_pointer_constraints_global_create(struct sl_context* ctx);
 
-void sl_set_display_implementation(struct sl_context* ctx);
+void sl_set_display_implementation(struct sl_context* ctx,
+                                   struct wl_client* client);
 
-struct sl_mmap* sl_mmap_create(int fd,
+struct sl_mmap* sl_mmap_create(struct sl_context* ctx,
+                               int fd,
                                size_t size,
                                size_t bpp,
                                size_t num_planes,
@@ -549,9 +906,24 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t stride1,
                                size_t y_ss0,
                                size_t y_ss1);
+// Creates a mapping of a buffer at |offset0| within the already mapped |pool|.
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* pool,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1);
 struct sl_mmap* sl_mmap_ref(struct sl_mmap* map);
 void sl_mmap_unref(struct sl_mmap* map);
 
+void* sl_slab_alloc(struct sl_slab* slab, size_t size);
+
+void sl_slab_free(struct sl_slab* slab, void* object);
+
 struct sl_sync_point* sl_sync_point_create(int fd);
 void sl_sync_point_destroy(struct sl_sync_point* sync_point);
 
@@ -567,4 +939,29 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 
 void sl_window_update(struct sl_window* window);
 
+int sl_low_resolution_match(struct sl_context* ctx, const char* name);
+
+void sl_window_set_host_surface_id(struct sl_window* window, uint32_t id);
+
+struct sl_window* sl_lookup_window_by_host_surface_id(struct sl_context* ctx,
+                                                      uint32_t id);
+
+uint64_t sl_now_usec(void);
+
+const char* sl_x_event_name(int type);
+
+void sl_stats_listen(struct sl_context* ctx, const char* path);
+
+void sl_trace_open(struct sl_context* ctx, const char* path);
+
+void sl_trace_event(struct sl_context* ctx,
+                    const char* category,
+                    const char* name,
+                    uint64_t start_usec,
+                    uint64_t end_usec);
+
+void sl_startup_phase(struct sl_context* ctx,
+                      const char* name,
+                      uint64_t start_usec);
+
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_H_